@@ -0,0 +1,309 @@
+// Runs the sketch on Linux: the Arduino core and RGBmatrixPanel stand-ins, the AVR clock, and a
+// main() that calls setup() once and loop() once per frame. Serial output goes to stdout and the
+// cost report to stderr.
+#define AVR_HOST_RUNTIME
+#include <Arduino.h>
+#include <RGBmatrixPanel.h>
+
+#define DEFAULT_FRAMES 1000		  // Change with --frames=N
+#define DEFAULT_REPORT_INTERVAL 100 // Frames per cost report, change with --report-every=N
+#define SERIAL_TX_BUFFER_SIZE 64
+#define SERIAL_BITS_PER_BYTE 10 // Start and stop bits
+
+void setup();
+void loop();
+
+const AvrOpCost avrOpCosts[AVR_OP_COUNT] = {
+	{"add", 110},
+	{"mul", 140},
+	{"div", 470},
+	{"compare", 50},
+	{"negate", 4},
+	{"to int", 80},
+	{"sqrt", 490},
+	{"fmax/fmin", 60},
+	{"fabs", 4},
+	{"floor", 100},
+	{"fmod", 700},
+	{"exp", 1800},
+	{"log", 1900},
+	{"drawPixel", 120},
+	{"fillScreen", 7000}, // Black or white only, other colors go pixel by pixel
+};
+
+uint64_t avrOpCounts[AVR_OP_COUNT];
+
+// Share of the CPU the panel's refresh interrupt takes, change with --refresh-share=F.
+// It depends on the panel and the library's refresh rate, so measure it.
+static float refreshShare = 0.0f;
+static uint64_t waitCycles; // Spent blocked rather than computing, so the refresh share doesn't stretch it
+
+static uint64_t CpuCycles(const uint64_t *counts, int first, int last)
+{
+	uint64_t cycles = 0;
+	for (int op = first; op < last; op++)
+	{
+		cycles += counts[op] * avrOpCosts[op].cycles;
+	}
+	return cycles;
+}
+
+static uint64_t ElapsedCycles()
+{
+	return (uint64_t)(CpuCycles(avrOpCounts, 0, AVR_OP_COUNT) / (1.0f - refreshShare)) + waitCycles;
+}
+
+unsigned long micros()
+{
+	return ElapsedCycles() / (AVR_CLOCK_HZ / 1000000);
+}
+
+unsigned long millis()
+{
+	return ElapsedCycles() / (AVR_CLOCK_HZ / 1000);
+}
+
+void delay(unsigned long ms)
+{
+	waitCycles += (uint64_t)ms * (AVR_CLOCK_HZ / 1000);
+}
+
+// ------------------------------------------------------------
+
+HardwareSerial Serial;
+
+void HardwareSerial::begin(unsigned long baud)
+{
+	this->baud = baud;
+	txQueued = 0;
+	lastDrainAt = ElapsedCycles();
+}
+
+void HardwareSerial::DrainTxBuffer()
+{
+	uint64_t now = ElapsedCycles();
+	float cyclesPerByte = (float)AVR_CLOCK_HZ * SERIAL_BITS_PER_BYTE / baud;
+	txQueued -= (now - lastDrainAt) / cyclesPerByte;
+	if (txQueued < 0)
+		txQueued = 0;
+	lastDrainAt = now;
+}
+
+// Like the real one, returns once the text fits in the transmit buffer
+size_t HardwareSerial::Send(const char *text, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		if (text[i] != '\r')
+			putchar(text[i]);
+	}
+	if (baud == 0)
+		return length;
+
+	DrainTxBuffer();
+	float overflow = txQueued + length - SERIAL_TX_BUFFER_SIZE;
+	if (overflow > 0)
+	{
+		waitCycles += (uint64_t)(overflow * AVR_CLOCK_HZ * SERIAL_BITS_PER_BYTE / baud);
+		DrainTxBuffer();
+	}
+	txQueued += length;
+	return length;
+}
+
+size_t HardwareSerial::print(const char *text)
+{
+	return Send(text, strlen(text));
+}
+
+size_t HardwareSerial::print(long value)
+{
+	char text[16];
+	return Send(text, snprintf(text, sizeof(text), "%ld", value));
+}
+
+size_t HardwareSerial::print(unsigned long value)
+{
+	char text[16];
+	return Send(text, snprintf(text, sizeof(text), "%lu", value));
+}
+
+size_t HardwareSerial::println(const char *text)
+{
+	return print(text) + println();
+}
+
+size_t HardwareSerial::println(long value)
+{
+	return print(value) + println();
+}
+
+size_t HardwareSerial::println(unsigned long value)
+{
+	return print(value) + println();
+}
+
+// ------------------------------------------------------------
+
+static FILE *dumpFile; // --dump=PATH, swapped frames as a stream of binary PPMs
+static int dumpEvery = 1;
+static int swapCount;
+
+RGBmatrixPanel::RGBmatrixPanel(uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t sclk, uint8_t latch,
+							   uint8_t oe, bool dbuf, uint8_t width)
+	: panelWidth(width), panelHeight(32), doubleBuffered(dbuf), backIndex(0)
+{
+	buffers[0] = (uint16_t *)calloc(panelWidth * panelHeight, sizeof(uint16_t));
+	buffers[1] = dbuf ? (uint16_t *)calloc(panelWidth * panelHeight, sizeof(uint16_t)) : buffers[0];
+}
+
+RGBmatrixPanel::~RGBmatrixPanel()
+{
+	if (doubleBuffered)
+		free(buffers[1]);
+	free(buffers[0]);
+}
+
+void RGBmatrixPanel::begin()
+{
+}
+
+void RGBmatrixPanel::drawPixel(int16_t x, int16_t y, uint16_t c)
+{
+	AvrCount(AVR_OP_DRAW_PIXEL);
+	if (x < 0 || y < 0 || x >= panelWidth || y >= panelHeight)
+		return;
+	buffers[backIndex][y * panelWidth + x] = c;
+}
+
+void RGBmatrixPanel::fillScreen(uint16_t c)
+{
+	// The library only has a fast path for colors that are the same in every bitplane
+	if (c != 0x0000 && c != 0xffff)
+	{
+		for (int16_t y = 0; y < panelHeight; y++)
+		{
+			for (int16_t x = 0; x < panelWidth; x++)
+			{
+				drawPixel(x, y, c);
+			}
+		}
+		return;
+	}
+	AvrCount(AVR_OP_FILL_SCREEN);
+	for (int i = 0; i < panelWidth * panelHeight; i++)
+	{
+		buffers[backIndex][i] = c;
+	}
+}
+
+void RGBmatrixPanel::swapBuffers(bool copy)
+{
+	if (doubleBuffered)
+	{
+		backIndex = 1 - backIndex;
+		if (copy)
+			memcpy(buffers[backIndex], buffers[1 - backIndex], panelWidth * panelHeight * sizeof(uint16_t));
+	}
+
+	if (dumpFile == NULL || swapCount++ % dumpEvery != 0)
+		return;
+	const uint16_t *shown = buffers[doubleBuffered ? 1 - backIndex : 0];
+	fprintf(dumpFile, "P6\n%d %d\n255\n", panelWidth, panelHeight);
+	for (int i = 0; i < panelWidth * panelHeight; i++)
+	{
+		// 5/6/5 back up to 8 bits per channel
+		uint8_t rgb[3] = {(uint8_t)((shown[i] >> 11) * 255 / 31), (uint8_t)(((shown[i] >> 5) & 0x3f) * 255 / 63),
+						  (uint8_t)((shown[i] & 0x1f) * 255 / 31)};
+		fwrite(rgb, 1, 3, dumpFile);
+	}
+}
+
+uint16_t RGBmatrixPanel::Color333(uint8_t r, uint8_t g, uint8_t b)
+{
+	// Same packing as the library: 3 bits per channel spread over 5/6/5
+	return ((r & 0x7) << 13) | ((r & 0x6) << 10) | ((g & 0x7) << 8) | ((g & 0x7) << 5) | ((b & 0x7) << 2) |
+		   ((b & 0x6) >> 1);
+}
+
+// ------------------------------------------------------------
+
+// What the frames since the last report cost, per frame
+static void PrintCostReport(const char *label, const uint64_t *counts, uint64_t waited, int frames)
+{
+	float cyclesPerMs = AVR_CLOCK_HZ / 1000.0f;
+	float floatMs = CpuCycles(counts, 0, AVR_FLOAT_OP_COUNT) / (1.0f - refreshShare) / cyclesPerMs / frames;
+	float panelMs = CpuCycles(counts, AVR_FLOAT_OP_COUNT, AVR_OP_COUNT) / (1.0f - refreshShare) / cyclesPerMs / frames;
+	float waitMs = waited / cyclesPerMs / frames;
+	float totalMs = floatMs + panelMs + waitMs;
+	fprintf(stderr, "%s: %.2f ms a frame at %lu MHz (%.0f fps): float %.2f, panel %.2f, serial waits %.2f\n", label,
+			totalMs, AVR_CLOCK_HZ / 1000000, totalMs > 0 ? 1000.0f / totalMs : 0.0f, floatMs, panelMs, waitMs);
+	fprintf(stderr, "   ");
+	for (int op = 0; op < AVR_OP_COUNT; op++)
+	{
+		if (counts[op] > 0)
+			fprintf(stderr, " %s %.1f", avrOpCosts[op].name, (float)counts[op] / frames);
+	}
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int frames = DEFAULT_FRAMES;
+	int reportInterval = DEFAULT_REPORT_INTERVAL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--frames=", 9) == 0)
+			frames = atoi(argv[i] + 9);
+		else if (strncmp(argv[i], "--report-every=", 15) == 0)
+			reportInterval = atoi(argv[i] + 15);
+		else if (strncmp(argv[i], "--refresh-share=", 16) == 0)
+			refreshShare = atof(argv[i] + 16);
+		else if (strncmp(argv[i], "--dump=", 7) == 0)
+			dumpFile = fopen(argv[i] + 7, "wb");
+		else if (strncmp(argv[i], "--dump-every=", 13) == 0)
+			dumpEvery = atoi(argv[i] + 13);
+		else
+		{
+			fprintf(stderr,
+					"Usage: %s [--frames=N] [--report-every=N] [--refresh-share=F] [--dump=PATH] [--dump-every=N]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+	if (reportInterval < 1 || dumpEvery < 1 || refreshShare < 0 || refreshShare >= 1)
+	{
+		fprintf(stderr, "Bad option value\n");
+		return 1;
+	}
+
+	// The sketch's globals are already set up, and that is counted as part of setup
+	setup();
+	uint64_t mark[AVR_OP_COUNT];
+	memcpy(mark, avrOpCounts, sizeof(mark));
+	uint64_t waitMark = waitCycles;
+	PrintCostReport("setup", mark, waitMark, 1);
+
+	for (int frame = 1; frame <= frames; frame++)
+	{
+		loop();
+		if (frame % reportInterval != 0 && frame != frames)
+			continue;
+
+		uint64_t counts[AVR_OP_COUNT];
+		for (int op = 0; op < AVR_OP_COUNT; op++)
+		{
+			counts[op] = avrOpCounts[op] - mark[op];
+		}
+		char label[32];
+		int framesSince = (frame - 1) % reportInterval + 1;
+		snprintf(label, sizeof(label), "frames %d-%d", frame - framesSince + 1, frame);
+		PrintCostReport(label, counts, waitCycles - waitMark, framesSince);
+		memcpy(mark, avrOpCounts, sizeof(mark));
+		waitMark = waitCycles;
+	}
+
+	if (dumpFile != NULL)
+		fclose(dumpFile);
+	return 0;
+}
@@ -0,0 +1,66 @@
+// Host stand-in for the Arduino core, enough of it for src/main.cpp to build and run on Linux.
+// Time is the Mega's, not the host's: millis() and micros() follow the cycles the sketch would
+// have spent so far (see avr-cost.h), so its governor settles where it would on the board.
+// Serial writes to stdout and blocks like the real one once its transmit buffer is full.
+#ifndef Arduino_h
+#define Arduino_h
+
+// Everything the sketch includes has to come in before float is redefined below
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avr-float.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// Mega pin numbers
+#define A0 54
+#define A1 55
+#define A2 56
+#define A3 57
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+class HardwareSerial
+{
+public:
+	void begin(unsigned long baud);
+	size_t print(const char *text);
+	size_t print(long value);
+	size_t print(unsigned long value);
+	size_t print(int value) { return print((long)value); }
+	size_t print(unsigned int value) { return print((unsigned long)value); }
+	size_t println(const char *text);
+	size_t println(long value);
+	size_t println(unsigned long value);
+	size_t println(int value) { return println((long)value); }
+	size_t println(unsigned int value) { return println((unsigned long)value); }
+	size_t println() { return print("\r\n"); }
+
+private:
+	size_t Send(const char *text, size_t length);
+	void DrainTxBuffer();
+
+	unsigned long baud = 0;
+	float txQueued = 0;		  // Bytes still waiting to go out
+	uint64_t lastDrainAt = 0; // Cycle count txQueued was last brought up to date at
+};
+extern HardwareSerial Serial;
+
+#ifndef AVR_HOST_RUNTIME
+// Like the AVR core's, which is why the sketch can hand it a float
+#define abs(x) ((x) > 0 ? (x) : -(x))
+
+#define float AvrFloat
+#define double AvrFloat
+#endif
+
+#endif
@@ -0,0 +1,35 @@
+// Host stand-in for Adafruit's RGBmatrixPanel. There is no panel: pixels go into a pair of
+// buffers in the library's 5/6/5 format, drawPixel() and fillScreen() are counted for the AVR
+// cost model, and swapped frames can be written out with --dump.
+#ifndef RGBMATRIXPANEL_H
+#define RGBMATRIXPANEL_H
+
+#include <stdint.h>
+
+class RGBmatrixPanel
+{
+public:
+	RGBmatrixPanel(uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t sclk, uint8_t latch, uint8_t oe, bool dbuf,
+				   uint8_t width = 32);
+	~RGBmatrixPanel();
+
+	void begin();
+	int16_t width() const { return panelWidth; }
+	int16_t height() const { return panelHeight; }
+
+	void drawPixel(int16_t x, int16_t y, uint16_t c);
+	void fillScreen(uint16_t c);
+	// With copy, the new back buffer starts out as a copy of what is now being shown
+	void swapBuffers(bool copy = true);
+
+	uint16_t Color333(uint8_t r, uint8_t g, uint8_t b);
+
+private:
+	int16_t panelWidth;
+	int16_t panelHeight;
+	bool doubleBuffered;
+	uint16_t *buffers[2];
+	uint8_t backIndex;
+};
+
+#endif
@@ -0,0 +1,49 @@
+// What the host build counts to estimate how long the sketch would take on the Mega. Cycle
+// costs are ballpark figures for avr-libc's soft-float routines and the RGBmatrixPanel calls;
+// calibrate them against a real board before trusting small differences.
+#ifndef AVR_COST_H
+#define AVR_COST_H
+
+#include <stdint.h>
+
+#define AVR_CLOCK_HZ 16000000UL
+
+enum AvrOp
+{
+	// Soft-float, see avr-float.h
+	AVR_OP_ADD, // Subtraction too
+	AVR_OP_MUL,
+	AVR_OP_DIV,
+	AVR_OP_COMPARE,
+	AVR_OP_NEGATE,
+	AVR_OP_TO_INT,
+	AVR_OP_SQRT,
+	AVR_OP_FMAX_FMIN,
+	AVR_OP_FABS,
+	AVR_OP_FLOOR,
+	AVR_OP_FMOD,
+	AVR_OP_EXP,
+	AVR_OP_LOG,
+	// RGBmatrixPanel
+	AVR_OP_DRAW_PIXEL,
+	AVR_OP_FILL_SCREEN,
+	AVR_OP_COUNT
+};
+#define AVR_FLOAT_OP_COUNT AVR_OP_DRAW_PIXEL
+
+struct AvrOpCost
+{
+	const char *name;
+	uint32_t cycles;
+};
+extern const AvrOpCost avrOpCosts[AVR_OP_COUNT];
+
+// Since the host started
+extern uint64_t avrOpCounts[AVR_OP_COUNT];
+
+inline void AvrCount(AvrOp op)
+{
+	avrOpCounts[op]++;
+}
+
+#endif
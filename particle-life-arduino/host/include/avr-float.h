@@ -0,0 +1,111 @@
+// A float that counts the soft-float calls the AVR would make for it. The host Arduino.h
+// turns the sketch's float and double into AvrFloat (double is 32 bits on the AVR anyway).
+// Constant expressions are counted as well, so estimates err a little high where avr-gcc
+// would have folded them, and int to float conversions aren't counted for the same reason.
+#ifndef AVR_FLOAT_H
+#define AVR_FLOAT_H
+
+#include "avr-cost.h"
+
+#include <math.h>
+#include <type_traits>
+
+template <typename T>
+using AvrArithmetic = typename std::enable_if<std::is_arithmetic<T>::value, int>::type;
+template <typename T>
+using AvrIntegral = typename std::enable_if<std::is_integral<T>::value, int>::type;
+
+struct AvrFloat
+{
+	float value;
+
+	AvrFloat() = default;
+	template <typename T, AvrArithmetic<T> = 0>
+	AvrFloat(T v) : value((float)v) {}
+
+	operator float() const { return value; }
+	template <typename T, AvrIntegral<T> = 0>
+	operator T() const
+	{
+		AvrCount(std::is_same<T, bool>::value ? AVR_OP_COMPARE : AVR_OP_TO_INT);
+		return (T)value;
+	}
+
+	AvrFloat &operator+=(AvrFloat b);
+	AvrFloat &operator-=(AvrFloat b);
+	AvrFloat &operator*=(AvrFloat b);
+	AvrFloat &operator/=(AvrFloat b);
+};
+
+inline AvrFloat operator-(AvrFloat a)
+{
+	AvrCount(AVR_OP_NEGATE);
+	return -a.value;
+}
+
+#define AVR_FLOAT_BINARY(result, sym, op)                                  \
+	inline result operator sym(AvrFloat a, AvrFloat b)                     \
+	{                                                                      \
+		AvrCount(op);                                                      \
+		return a.value sym b.value;                                        \
+	}                                                                      \
+	template <typename T, AvrArithmetic<T> = 0>                            \
+	inline result operator sym(AvrFloat a, T b) { return a sym AvrFloat(b); } \
+	template <typename T, AvrArithmetic<T> = 0>                            \
+	inline result operator sym(T a, AvrFloat b) { return AvrFloat(a) sym b; }
+
+AVR_FLOAT_BINARY(AvrFloat, +, AVR_OP_ADD)
+AVR_FLOAT_BINARY(AvrFloat, -, AVR_OP_ADD)
+AVR_FLOAT_BINARY(AvrFloat, *, AVR_OP_MUL)
+AVR_FLOAT_BINARY(AvrFloat, /, AVR_OP_DIV)
+AVR_FLOAT_BINARY(bool, <, AVR_OP_COMPARE)
+AVR_FLOAT_BINARY(bool, <=, AVR_OP_COMPARE)
+AVR_FLOAT_BINARY(bool, >, AVR_OP_COMPARE)
+AVR_FLOAT_BINARY(bool, >=, AVR_OP_COMPARE)
+AVR_FLOAT_BINARY(bool, ==, AVR_OP_COMPARE)
+AVR_FLOAT_BINARY(bool, !=, AVR_OP_COMPARE)
+#undef AVR_FLOAT_BINARY
+
+inline AvrFloat &AvrFloat::operator+=(AvrFloat b) { return *this = *this + b; }
+inline AvrFloat &AvrFloat::operator-=(AvrFloat b) { return *this = *this - b; }
+inline AvrFloat &AvrFloat::operator*=(AvrFloat b) { return *this = *this * b; }
+inline AvrFloat &AvrFloat::operator/=(AvrFloat b) { return *this = *this / b; }
+
+// libm, in both spellings since they are the same function on the AVR
+#define AVR_FLOAT_UNARY(name, op, impl) \
+	inline AvrFloat name(AvrFloat a)    \
+	{                                   \
+		AvrCount(op);                   \
+		return impl(a.value);           \
+	}
+#define AVR_FLOAT_BINARY_CALL(name, op, impl)                                \
+	inline AvrFloat name(AvrFloat a, AvrFloat b)                             \
+	{                                                                        \
+		AvrCount(op);                                                        \
+		return impl(a.value, b.value);                                       \
+	}                                                                        \
+	template <typename T, AvrArithmetic<T> = 0>                              \
+	inline AvrFloat name(AvrFloat a, T b) { return name(a, AvrFloat(b)); }   \
+	template <typename T, AvrArithmetic<T> = 0>                              \
+	inline AvrFloat name(T a, AvrFloat b) { return name(AvrFloat(a), b); }
+
+AVR_FLOAT_UNARY(sqrt, AVR_OP_SQRT, sqrtf)
+AVR_FLOAT_UNARY(sqrtf, AVR_OP_SQRT, sqrtf)
+AVR_FLOAT_UNARY(fabs, AVR_OP_FABS, fabsf)
+AVR_FLOAT_UNARY(fabsf, AVR_OP_FABS, fabsf)
+AVR_FLOAT_UNARY(floor, AVR_OP_FLOOR, floorf)
+AVR_FLOAT_UNARY(floorf, AVR_OP_FLOOR, floorf)
+AVR_FLOAT_UNARY(exp, AVR_OP_EXP, expf)
+AVR_FLOAT_UNARY(expf, AVR_OP_EXP, expf)
+AVR_FLOAT_UNARY(log, AVR_OP_LOG, logf)
+AVR_FLOAT_UNARY(logf, AVR_OP_LOG, logf)
+AVR_FLOAT_BINARY_CALL(fmax, AVR_OP_FMAX_FMIN, fmaxf)
+AVR_FLOAT_BINARY_CALL(fmaxf, AVR_OP_FMAX_FMIN, fmaxf)
+AVR_FLOAT_BINARY_CALL(fmin, AVR_OP_FMAX_FMIN, fminf)
+AVR_FLOAT_BINARY_CALL(fminf, AVR_OP_FMAX_FMIN, fminf)
+AVR_FLOAT_BINARY_CALL(fmod, AVR_OP_FMOD, fmodf)
+AVR_FLOAT_BINARY_CALL(fmodf, AVR_OP_FMOD, fmodf)
+#undef AVR_FLOAT_UNARY
+#undef AVR_FLOAT_BINARY_CALL
+
+#endif
@@ -9,15 +9,31 @@
 
 #define CANVAS_WIDTH SCREEN_WIDTH
 #define CANVAS_HEIGHT SCREEN_HEIGHT
-#define CANVAS_ASPECT_RATIO (CANVAS_WIDTH / CANVAS_HEIGHT)
+#define CANVAS_ASPECT_RATIO ((float)CANVAS_WIDTH / CANVAS_HEIGHT)
 
-#define CELL_GRID_WIDTH 4
 #define CELL_GRID_HEIGHT 2
-#define MAX_PARTICLES_PER_CELL 80
+#define CELL_GRID_WIDTH (CELL_GRID_HEIGHT * CANVAS_WIDTH / CANVAS_HEIGHT) // Rounds down so cells are never narrower than they are tall
+#define MAX_PARTICLES_PER_CELL MAX_PARTICLES // Every particle could land in one cell, but no more
 
-#define MAX_PARTICLES 12
+#define MAX_PARTICLES 24 // Room in the pool. The governor decides how much of it is in use.
+#define START_PARTICLES 12
+#define MIN_PARTICLES 4
 #define MAX_COLOR_GROUPS 2
 
+#define STATS_PRINT_INTERVAL 100 // Frames between printing SimStats over serial
+
+// How a step turns forces into motion
+#define INTEGRATOR_SYMPLECTIC_EULER 0 // Velocity first, then position with the new velocity
+#define INTEGRATOR_VELOCITY_VERLET 1  // Second order, still one force pass per step, 8 more bytes per particle
+#define INTEGRATOR_EXPONENTIAL 2	  // Friction and force integrated exactly over the step
+// Frames here are long, and the exponential one holds up best to long steps
+#define INTEGRATOR INTEGRATOR_EXPONENTIAL
+
+// The governor grows the particle count while a frame fits in 1 / TARGET_FPS and shrinks it when it doesn't
+#define TARGET_FPS 25
+#define GOVERNOR_INTERVAL 10 // Frames to wait after a change before judging it
+#define FADE_STEP 64		 // Fade change per frame. The panel only has 3 bits per channel, so a few steps will do.
+
 #define CLK 11 // USE THIS ON ARDUINO MEGA
 #define OE 9
 #define LAT 10
@@ -76,16 +92,31 @@ struct Particle
 	Vector2 position;
 	Vector2 velocity;
 	ColorGroup colorGroup;
+	uint8_t fade; // Brightness, ramps up when the governor adds the particle and down when it retires it
+#if INTEGRATOR == INTEGRATOR_VELOCITY_VERLET
+	Vector2 halfKick; // The half of the last step's kick still to be applied
+#endif
 };
 
 Particle particles[MAX_PARTICLES];
+// Particles [0, activeParticleCount) are simulated and drawn, the rest of the pool waits.
+// The ones from retireFrom up are fading out on their way back into the pool.
+uint8_t activeParticleCount = START_PARTICLES;
+uint8_t retireFrom = START_PARTICLES;
 
 // In worldspace, the radius of the sphere of influence for each particle.
 const float maxDistance = 0.25; // Please let 2 be evenly divisible by this number, for cellSize's sake
 const float dt = 0.01;
-const float frictionFactor = 0.99;
+const float frictionFactor = 0.99; // How much velocity is left after one frame at TARGET_FPS
 const float forceFactor = 10.0;
 
+// Size of the area the particles live in. It wraps around at the edges.
+const float worldWidth = CANVAS_ASPECT_RATIO;
+const float worldHeight = 1.0;
+
+// Friction is applied per second, so the motion doesn't change with the frame rate
+const float damping = -logf(frictionFactor) * TARGET_FPS;
+
 struct Cell
 {
 	uint16_t particleIndices[MAX_PARTICLES_PER_CELL];
@@ -101,9 +132,25 @@ struct CellWrap
 	bool wrappedBottom;
 };
 
+// What the last frame actually did. Cheap enough to always be on.
+#define OCCUPANCY_BUCKETS 8 // Cells holding 0, 1, 2-3, 4-7, ... 64 or more particles
+struct SimStats
+{
+	uint32_t candidatePairs; // Pairs the force loop looked at
+	uint32_t pairsInRange;	 // Pairs close enough to push or pull
+	uint16_t droppedParticles; // Left out of the grid because their cell was full
+	uint32_t wrapShifts;	   // Pairs where the other particle was shifted across an edge
+	uint8_t maxCellOccupancy;
+	float meanCellOccupancy;
+	uint8_t occupancyHistogram[OCCUPANCY_BUCKETS];
+};
+SimStats frameStats;
+
 // Divide the area into cells whos size is the
 // diameter of the circle of influence for every particle
 const float cellSize = maxDistance * 2.0;
+const float cellWidth = worldWidth / CELL_GRID_WIDTH;
+const float cellHeight = worldHeight / CELL_GRID_HEIGHT;
 // Each grid cell contains a list of particles within its bounds.
 Cell grid[CELL_GRID_HEIGHT][CELL_GRID_WIDTH];
 
@@ -320,6 +367,15 @@ PanelColor PanelColorMultiply(PanelColor color, float value)
 		(uint8_t)(color.b * value)};
 }
 
+// Same as PanelColorMultiply with value = fade / 256, but without floats
+PanelColor PanelColorFade(PanelColor color, uint8_t fade)
+{
+	return {
+		(uint8_t)(((uint16_t)color.r * fade) >> 8),
+		(uint8_t)(((uint16_t)color.g * fade) >> 8),
+		(uint8_t)(((uint16_t)color.b * fade) >> 8)};
+}
+
 // Draws a point on the screen at a sub-pixel level, unlike DrawPixel.
 // If the point is in-between screen pixels, it will be rendered using
 // its neighboring pixels.
@@ -378,6 +434,18 @@ float AttractionForceMag(float distance, float attractionFactor)
 	}
 }
 
+// Keeps a coordinate within [0, extent) while preserving how far past the edge it went
+float WrapCoordinate(float value, float extent)
+{
+	value = fmodf(value, extent);
+	if (value < 0)
+		value += extent;
+	// A tiny negative value can round up to exactly extent
+	if (value >= extent)
+		value = 0;
+	return value;
+}
+
 void UpdateGrid()
 {
 	// Clear the list of particles for each cell
@@ -390,28 +458,61 @@ void UpdateGrid()
 	}
 
 	// Add each particle to the list of particles for its corresponding cell
-	for (int i = 0; i < MAX_PARTICLES; i++)
+	for (int i = 0; i < activeParticleCount; i++)
 	{
 
-		int cell_row = (int)(particles[i].position.y / cellSize);
-		int cell_col = (int)(particles[i].position.x / cellSize);
+		int cell_row = (int)(particles[i].position.y / cellHeight);
+		int cell_col = (int)(particles[i].position.x / cellWidth);
 		// DebugPrintf("[%d, %d]\n", cell_row, cell_col);
-		//  if (cell_row > CELL_GRID_HEIGHT - 1)
-		//  	continue;
-		//  if (cell_col > CELL_GRID_WIDTH - 1)
-		//  	continue;
-		// Cell* cell = &grid[cell_row][cell_col];
-		//  if (cell->particleCount < MAX_PARTICLES_PER_CELL)
-		//  {
-		//  	cell->particleIndices[cell->particleCount] = i;
-		//  	cell->particleCount++;
-		//  }
+		// Rounding can put a particle sitting right on the far edge one cell too far
+		if (cell_row > CELL_GRID_HEIGHT - 1)
+			cell_row = CELL_GRID_HEIGHT - 1;
+		if (cell_col > CELL_GRID_WIDTH - 1)
+			cell_col = CELL_GRID_WIDTH - 1;
 		if (grid[cell_row][cell_col].particleCount < MAX_PARTICLES_PER_CELL)
 		{
 			grid[cell_row][cell_col].particleIndices[grid[cell_row][cell_col].particleCount] = i;
 			grid[cell_row][cell_col].particleCount++;
 		}
+		else
+		{
+			frameStats.droppedParticles++;
+		}
+	}
+
+	uint16_t occupiedTotal = 0;
+	for (int i = 0; i < CELL_GRID_HEIGHT; i++)
+	{
+		for (int j = 0; j < CELL_GRID_WIDTH; j++)
+		{
+			uint8_t count = grid[i][j].particleCount;
+			occupiedTotal += count;
+			if (count > frameStats.maxCellOccupancy)
+				frameStats.maxCellOccupancy = count;
+			uint8_t bucket = 0;
+			while (count > 0 && bucket < OCCUPANCY_BUCKETS - 1)
+			{
+				count >>= 1;
+				bucket++;
+			}
+			frameStats.occupancyHistogram[bucket]++;
+		}
 	}
+	frameStats.meanCellOccupancy = (float)occupiedTotal / (CELL_GRID_WIDTH * CELL_GRID_HEIGHT);
+}
+
+void PrintStats()
+{
+	// avr-libc's printf has no %f, so the mean is printed in tenths
+	DebugPrintf("pairs %lu, in range %lu, dropped %u, wrap shifts %lu\n",
+				frameStats.candidatePairs, frameStats.pairsInRange, frameStats.droppedParticles, frameStats.wrapShifts);
+	DebugPrintf("cells max %u, mean %u.%u, occupancy", frameStats.maxCellOccupancy,
+				(unsigned)frameStats.meanCellOccupancy, (unsigned)(frameStats.meanCellOccupancy * 10) % 10);
+	for (uint8_t b = 0; b < OCCUPANCY_BUCKETS; b++)
+	{
+		DebugPrintf(" %u", frameStats.occupancyHistogram[b]);
+	}
+	DebugPrintf("\n");
 }
 
 void randomizeAttractionFactorMatrix()
@@ -436,6 +537,10 @@ static void Initialize()
 		particles[i].velocity = {0.0, 0.0};
 
 		particles[i].colorGroup = (ColorGroup)RandByte(GROUP_RED, MAX_COLOR_GROUPS - 1);
+		particles[i].fade = 255;
+#if INTEGRATOR == INTEGRATOR_VELOCITY_VERLET
+		particles[i].halfKick = {0.0, 0.0};
+#endif
 	}
 
 	// randomizeAttractionFactorMatrix();
@@ -445,6 +550,115 @@ static void Initialize()
 	attractionFactorMatrix[1][1] = 0.0;
 }
 
+// Live particles are packed into [0, activeParticleCount) with the retiring ones at the end.
+// Spawning and despawning are O(1) and never allocate. Only do either between steps: the
+// grid holds particle indices and gets rebuilt from the pool at the start of the next step.
+
+// Takes a particle out of the pool, dark so it fades in, with no velocity, for the caller to place.
+// Returns NULL when the pool is used up.
+Particle *SpawnParticle()
+{
+	if (activeParticleCount == MAX_PARTICLES)
+		return NULL;
+	uint8_t slot = activeParticleCount++;
+	// Keep the retiring particles at the end by moving the first of them behind the new one
+	if (retireFrom < slot)
+	{
+		particles[slot] = particles[retireFrom];
+		slot = retireFrom;
+	}
+	retireFrom++;
+
+	Particle *p = &particles[slot];
+	p->velocity = {0.0, 0.0};
+	p->fade = 0;
+#if INTEGRATOR == INTEGRATOR_VELOCITY_VERLET
+	p->halfKick = {0.0, 0.0};
+#endif
+	return p;
+}
+
+// Somewhere random, in a random group
+void SpawnRandomParticle()
+{
+	Particle *p = SpawnParticle();
+	if (p == NULL)
+		return;
+	p->position = {RandFloat(0, worldWidth), RandFloat(0, worldHeight)};
+	p->colorGroup = (ColorGroup)RandByte(GROUP_RED, MAX_COLOR_GROUPS - 1);
+}
+
+// Puts particle i straight back in the pool by moving another one into its slot.
+// Loops that despawn as they go should look at slot i again afterwards.
+void DespawnParticle(uint8_t i)
+{
+	if (i < retireFrom)
+	{
+		// Fill the hole from the last particle that isn't retiring, which leaves the hole at the start of the retiring ones
+		particles[i] = particles[--retireFrom];
+		i = retireFrom;
+	}
+	particles[i] = particles[--activeParticleCount];
+}
+
+// Starts the last count particles fading out. UpdateFades() despawns them once they are dark.
+void RetireParticles(uint8_t count)
+{
+	retireFrom = (count < retireFrom) ? retireFrom - count : 0;
+}
+
+// Brings new particles up to full brightness and retiring ones down to nothing
+void UpdateFades()
+{
+	for (uint8_t i = 0; i < retireFrom; i++)
+	{
+		particles[i].fade = particles[i].fade > 255 - FADE_STEP ? 255 : particles[i].fade + FADE_STEP;
+	}
+
+	if (retireFrom == activeParticleCount)
+		return;
+	bool allDark = true;
+	for (uint8_t i = retireFrom; i < activeParticleCount; i++)
+	{
+		particles[i].fade = particles[i].fade < FADE_STEP ? 0 : particles[i].fade - FADE_STEP;
+		allDark = allDark && particles[i].fade == 0;
+	}
+	if (allDark)
+		activeParticleCount = retireFrom;
+}
+
+struct Governor
+{
+	uint32_t averageCost; // Smoothed microseconds a frame takes
+	uint8_t framesUntilChange;
+};
+Governor governor = {0, GOVERNOR_INTERVAL};
+
+// One particle at a time, the pool is small enough that it never takes long
+void UpdateGovernor(uint32_t frameCost)
+{
+	const uint32_t budget = 1000000UL / TARGET_FPS;
+	governor.averageCost = governor.averageCost - governor.averageCost / 8 + frameCost / 8;
+	if (governor.framesUntilChange > 0)
+	{
+		governor.framesUntilChange--;
+		return;
+	}
+	if (retireFrom != activeParticleCount)
+		return;
+
+	if (governor.averageCost > budget && activeParticleCount > MIN_PARTICLES)
+	{
+		RetireParticles(1);
+		governor.framesUntilChange = GOVERNOR_INTERVAL;
+	}
+	else if (governor.averageCost < budget / 4 * 3 && activeParticleCount < MAX_PARTICLES)
+	{
+		SpawnRandomParticle();
+		governor.framesUntilChange = GOVERNOR_INTERVAL;
+	}
+}
+
 void FrameBufferClear(PanelColor color)
 {
 	matrix.fillScreen(PanelColor333(color));
@@ -470,6 +684,45 @@ void setup()
 	matrix.begin();
 }
 
+// What a step costs to set up for the integrator, worked out once per frame instead of per particle
+struct IntegratorStep
+{
+	float deltaTime;
+	float decay;	  // How much velocity is left after deltaTime of friction
+	float settle;	  // Integral of decay over the step, in seconds
+	float driftScale; // Turns a force into how far it moves a particle during the step
+};
+
+IntegratorStep PrepareIntegratorStep(float deltaTime)
+{
+	IntegratorStep step;
+	step.deltaTime = deltaTime;
+	step.decay = expf(-damping * deltaTime);
+	step.settle = (damping > 0.0f) ? (1.0f - step.decay) / damping : deltaTime;
+	step.driftScale = (damping > 0.0f) ? (deltaTime - step.settle) / damping : 0.5f * deltaTime * deltaTime;
+	return step;
+}
+
+// Moves a particle on by one step given the force on it now. Doesn't wrap it.
+void IntegrateParticle(Particle *p, Vector2 force, const IntegratorStep &step)
+{
+#if INTEGRATOR == INTEGRATOR_VELOCITY_VERLET
+	// Finish the last step's kick now that the new force is known, then drift and start this step's kick
+	p->velocity = Vector2Add(p->velocity, Vector2Add(p->halfKick, Vector2Scale(force, 0.5f * step.deltaTime)));
+	p->velocity = Vector2Scale(p->velocity, step.decay);
+	p->position = Vector2Add(p->position, Vector2Add(Vector2Scale(p->velocity, step.deltaTime), Vector2Scale(force, 0.5f * step.deltaTime * step.deltaTime)));
+	p->halfKick = Vector2Scale(force, 0.5f * step.deltaTime);
+#elif INTEGRATOR == INTEGRATOR_EXPONENTIAL
+	// Exact when the force holds still over the step: velocity slides from where it was toward force / damping
+	p->position = Vector2Add(p->position, Vector2Add(Vector2Scale(p->velocity, step.settle), Vector2Scale(force, step.driftScale)));
+	p->velocity = Vector2Add(Vector2Scale(p->velocity, step.decay), Vector2Scale(force, step.settle));
+#else
+	p->velocity = Vector2Scale(p->velocity, step.decay);
+	p->velocity = Vector2Add(p->velocity, Vector2Scale(force, step.deltaTime));
+	p->position = Vector2Add(p->position, Vector2Scale(p->velocity, step.deltaTime));
+#endif
+}
+
 void loop()
 {
 	Serial.println("hi");
@@ -478,6 +731,8 @@ void loop()
 	static uint16_t frameCount = 0;
 	frameCount++;
 
+	unsigned long frameStart = micros();
+
 	// Update time
 	static unsigned long prevMillis = 0;
 	unsigned long currentMillis = millis();
@@ -486,6 +741,8 @@ void loop()
 
 	FrameBufferClear({0, 0, 0});
 
+	memset(&frameStats, 0, sizeof(frameStats));
+	const IntegratorStep step = PrepareIntegratorStep(deltaTime);
 	UpdateGrid();
 
 	// Update each particle, one cell at a time
@@ -507,6 +764,12 @@ void loop()
 				// Go through each neighboring cell
 				for (int n = 0; n < 9; n++)
 				{
+					frameStats.candidatePairs += neighborCells[n]->particleCount;
+					if (neighborCellWraps[n].wrappedLeft || neighborCellWraps[n].wrappedRight ||
+						neighborCellWraps[n].wrappedTop || neighborCellWraps[n].wrappedBottom)
+					{
+						frameStats.wrapShifts += neighborCells[n]->particleCount;
+					}
 					// Go through every particle in this cell (as objects)
 					for (int pJ = 0; pJ < neighborCells[n]->particleCount; pJ++)
 					{
@@ -518,20 +781,19 @@ void loop()
 						// Offset location if it's wrapped
 						if (neighborCellWraps[n].wrappedLeft)
 						{
-							// TODO: let these not be constants. Should be aspect ratio (width of field in particle's float coord system)
-							particleObjPercievedPos.x -= CANVAS_ASPECT_RATIO;
+							particleObjPercievedPos.x -= worldWidth;
 						}
 						if (neighborCellWraps[n].wrappedRight)
 						{
-							particleObjPercievedPos.x += CANVAS_ASPECT_RATIO;
+							particleObjPercievedPos.x += worldWidth;
 						}
 						if (neighborCellWraps[n].wrappedTop)
 						{
-							particleObjPercievedPos.y -= 1.0;
+							particleObjPercievedPos.y -= worldHeight;
 						}
 						if (neighborCellWraps[n].wrappedBottom)
 						{
-							particleObjPercievedPos.y += 1.0;
+							particleObjPercievedPos.y += worldHeight;
 						}
 
 						// Only deal with neighbors within sphere of influence
@@ -546,28 +808,18 @@ void loop()
 							// Normalize then scale by force magnitude
 							Vector2 force = Vector2Scale(delta, -1.0 / distance * forceMag);
 							totalForce = Vector2Add(totalForce, force);
+							frameStats.pairsInRange++;
 						}
 					}
 				}
 
 				totalForce = Vector2Scale(totalForce, maxDistance * forceFactor);
 
-				particles[i].velocity = Vector2Scale(particles[i].velocity, frictionFactor);
-				particles[i].velocity = Vector2Add(particles[i].velocity, Vector2Scale(totalForce, deltaTime));
-
-				// Update the particle's position based on its velocity
-				particles[i].position.x += particles[i].velocity.x * deltaTime;
-				particles[i].position.y += particles[i].velocity.y * deltaTime;
+				IntegrateParticle(&particles[i], totalForce, step);
 
 				// If the particle goes off the screen, wrap it around to the other side
-				if (particles[i].position.x < 0.01)
-					particles[i].position.x = 1.99;
-				if (particles[i].position.x > 2)
-					particles[i].position.x = 0.01;
-				if (particles[i].position.y < 0.01)
-					particles[i].position.y = 0.99;
-				if (particles[i].position.y > 1)
-					particles[i].position.y = 0.01;
+				particles[i].position.x = WrapCoordinate(particles[i].position.x, worldWidth);
+				particles[i].position.y = WrapCoordinate(particles[i].position.y, worldHeight);
 			}
 		}
 	}
@@ -616,7 +868,7 @@ void loop()
 	// }
 
 	// Draw each particle
-	for (int i = 0; i < MAX_PARTICLES; i++)
+	for (int i = 0; i < activeParticleCount; i++)
 	{
 		// Scale from world space to screen space
 		Vector2 posOnScreen = {particles[i].position.x * CANVAS_WIDTH / (CANVAS_ASPECT_RATIO), particles[i].position.y * CANVAS_HEIGHT};
@@ -624,7 +876,15 @@ void loop()
 		// char report[64];
 		// sprintf(report, "%d: %d, %d; ",  i, (int)posOnScreen.x, (int)posOnScreen.y);
 		// Serial.println(report);
-		matrix.drawPixel(posOnScreen.x, posOnScreen.y, PanelColor333(ColorGroupColors[particles[i].colorGroup]));
+		matrix.drawPixel(posOnScreen.x, posOnScreen.y, PanelColor333(PanelColorFade(ColorGroupColors[particles[i].colorGroup], particles[i].fade)));
+	}
+
+	UpdateFades();
+
+	if (frameCount % STATS_PRINT_INTERVAL == 0)
+	{
+		PrintStats();
+		DebugPrintf("%u particles, frame %lu us\n", activeParticleCount, governor.averageCost);
 	}
 
 	// if (frameCount % 20 == 0)
@@ -640,5 +900,7 @@ void loop()
 	// 	DebugPrintf("\n");
 	// }
 
+	UpdateGovernor(micros() - frameStart);
+
 	matrix.swapBuffers(false);
 }
@@ -0,0 +1,150 @@
+// Reads the frames particle-life publishes with --export-frames and prints what came with
+// each one. --dump=PATH writes the pixels out as a stream of binary PPMs. Doubles as a test of
+// the ring: it counts the frames it missed and the reads it had to retry because the writer
+// came back around to the slot while it was reading.
+#include "frame-ring.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define DEFAULT_FRAMES 10 // Change with --frames=N, 0 to read until the writer stops
+#define WRITER_GONE_AFTER 2000000000 // Nanoseconds without a new frame before giving up
+
+int64_t nanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = FRAME_RING_DEFAULT_NAME;
+    long frames = DEFAULT_FRAMES;
+    FILE *dumpFile = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--ring=", 7) == 0)
+            name = argv[i] + 7;
+        else if (strncmp(argv[i], "--frames=", 9) == 0)
+            frames = atol(argv[i] + 9);
+        else if (strncmp(argv[i], "--dump=", 7) == 0)
+        {
+            dumpFile = fopen(argv[i] + 7, "wb");
+            if (dumpFile == NULL)
+            {
+                perror(argv[i] + 7);
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--ring=NAME] [--frames=N] [--dump=PATH]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        perror(name);
+        fprintf(stderr, "Is particle-life running with --export-frames?\n");
+        return 1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(FrameRingHeader))
+    {
+        fprintf(stderr, "%s is too small to be a frame ring\n", name);
+        close(fd);
+        return 1;
+    }
+    void *memory = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    const FrameRingHeader *ring = (const FrameRingHeader *)memory;
+
+    // The writer fills in the header just after making the ring
+    int64_t start = nanos();
+    while (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != FRAME_RING_MAGIC)
+    {
+        if (nanos() - start > WRITER_GONE_AFTER)
+        {
+            fprintf(stderr, "%s never got set up\n", name);
+            return 1;
+        }
+        usleep(1000);
+    }
+    if (ring->version != FRAME_RING_VERSION || ring->slotCount != FRAME_RING_SLOTS ||
+        FrameRingSize(ring->width, ring->height) > (size_t)info.st_size)
+    {
+        fprintf(stderr, "%s is a version %u ring, this reader only knows version %d\n", name, ring->version, FRAME_RING_VERSION);
+        return 1;
+    }
+    printf("%s: %ux%u, %u slots\n", name, ring->width, ring->height, ring->slotCount);
+
+    size_t pixelBytes = (size_t)ring->width * ring->height * 3;
+    std::vector<uint8_t> pixels(pixelBytes);
+    uint64_t lastFrame = FrameRingLatest(ring);
+    long framesRead = 0;
+    long framesMissed = 0;
+    long retries = 0;
+    int64_t lastNewFrame = nanos();
+    while (frames == 0 || framesRead < frames)
+    {
+        uint64_t latest = FrameRingLatest(ring);
+        if (latest == lastFrame)
+        {
+            if (nanos() - lastNewFrame > WRITER_GONE_AFTER)
+            {
+                printf("No new frame for %.0f s, stopping\n", WRITER_GONE_AFTER / 1e9);
+                break;
+            }
+            usleep(500);
+            continue;
+        }
+
+        // Copy the frame out, then make sure the writer wasn't in the slot while we did
+        const FrameRingSlot *slot = FrameRingSlotAt(ring, latest);
+        uint32_t sequence = FrameRingReadBegin(slot);
+        FrameRingSlot frame = *slot;
+        memcpy(&pixels[0], FrameRingPixels(slot), pixelBytes);
+        if (!FrameRingReadValid(slot, sequence) || frame.frameNumber != latest)
+        {
+            retries++;
+            continue;
+        }
+        int64_t now = nanos();
+
+        if (lastFrame != 0)
+            framesMissed += latest - lastFrame - 1;
+        lastFrame = latest;
+        lastNewFrame = now;
+        framesRead++;
+        printf("frame %llu: %u particles, work %.3f ms, interval %.3f ms, read %.3f ms after it was finished\n",
+               (unsigned long long)frame.frameNumber, frame.particleCount, frame.frameWork / 1e6, frame.frameInterval / 1e6,
+               (now - frame.finishedAt) / 1e6);
+
+        if (dumpFile != NULL)
+        {
+            fprintf(dumpFile, "P6\n%u %u\n255\n", ring->width, ring->height);
+            fwrite(&pixels[0], 1, pixelBytes, dumpFile);
+        }
+    }
+
+    printf("%ld frames read, %ld missed, %ld reads retried\n", framesRead, framesMissed, retries);
+    if (dumpFile != NULL)
+        fclose(dumpFile);
+    munmap(memory, info.st_size);
+    return 0;
+}
@@ -0,0 +1,98 @@
+// Layout of the shared-memory ring particle-life publishes its frames into with
+// --export-frames, for status dashboards and recorders on the same Pi. The writer draws
+// straight into a slot as it draws the canvas and never makes a syscall per frame. Readers
+// map the ring read-only and check each slot's sequence around whatever they read, like a
+// seqlock: odd means the writer is in the slot, and a change means they lost the race and
+// should try again. frame-reader.cc is an example.
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FRAME_RING_DEFAULT_NAME "/particle-life-frames"
+#define FRAME_RING_MAGIC 0x52464c50 // "PLFR"
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_SLOTS 4 // Readers have the time of SLOTS - 1 frames to read one before it is reused
+
+struct FrameRingHeader
+{
+    uint32_t magic; // Written last, so a reader that sees it sees the rest
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t slotCount;
+    uint32_t slotSize;    // Bytes from one slot to the next
+    uint64_t latestFrame; // Number of the last finished frame, 0 until there is one
+};
+
+struct FrameRingSlot
+{
+    uint32_t sequence; // Odd while the writer is in the slot
+    uint32_t particleCount;
+    uint64_t frameNumber;   // Counts from 1
+    int64_t finishedAt;     // CLOCK_MONOTONIC nanoseconds
+    int64_t frameWork;      // Nanoseconds the frame took before waiting for the panel
+    int64_t frameInterval;  // Nanoseconds since the frame before started
+    // width * height pixels of red, green and blue bytes follow
+};
+
+inline size_t FrameRingSlotSize(uint32_t width, uint32_t height)
+{
+    size_t size = sizeof(FrameRingSlot) + (size_t)width * height * 3;
+    return (size + 63) & ~(size_t)63; // Keep slots on their own cache lines
+}
+
+inline size_t FrameRingSize(uint32_t width, uint32_t height)
+{
+    return ((sizeof(FrameRingHeader) + 63) & ~(size_t)63) + FRAME_RING_SLOTS * FrameRingSlotSize(width, height);
+}
+
+inline FrameRingSlot *FrameRingSlotAt(const FrameRingHeader *ring, uint64_t frameNumber)
+{
+    size_t first = (sizeof(FrameRingHeader) + 63) & ~(size_t)63;
+    return (FrameRingSlot *)((char *)ring + first + (frameNumber % ring->slotCount) * ring->slotSize);
+}
+
+inline uint8_t *FrameRingPixels(const FrameRingSlot *slot)
+{
+    return (uint8_t *)(slot + 1);
+}
+
+// Writer side. The slot for a frame is held odd from BeginFrame until EndFrame.
+
+inline FrameRingSlot *FrameRingBeginFrame(FrameRingHeader *ring, uint64_t frameNumber)
+{
+    FrameRingSlot *slot = FrameRingSlotAt(ring, frameNumber);
+    __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELAXED);
+    // Keeps the writes to the slot after the sequence going odd
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->frameNumber = frameNumber;
+    return slot;
+}
+
+inline void FrameRingEndFrame(FrameRingHeader *ring, FrameRingSlot *slot)
+{
+    __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->latestFrame, slot->frameNumber, __ATOMIC_RELEASE);
+}
+
+// Reader side. Read what you need between these two, and only use it if the second says so.
+
+inline uint64_t FrameRingLatest(const FrameRingHeader *ring)
+{
+    return __atomic_load_n(&ring->latestFrame, __ATOMIC_ACQUIRE);
+}
+
+inline uint32_t FrameRingReadBegin(const FrameRingSlot *slot)
+{
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+}
+
+inline bool FrameRingReadValid(const FrameRingSlot *slot, uint32_t sequence)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (sequence & 1) == 0 && __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+#endif
@@ -0,0 +1,25 @@
+// Host stand-in for rpi-rgb-led-matrix's canvas.h. Only what particle-life.cc needs,
+// with the same names and signatures as the real library.
+#ifndef RPI_CANVAS_H
+#define RPI_CANVAS_H
+
+#include <stdint.h>
+
+namespace rgb_matrix
+{
+
+// Something pixels can be drawn on
+class Canvas
+{
+public:
+    virtual ~Canvas() {}
+    virtual int width() const = 0;
+    virtual int height() const = 0;
+    virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) = 0;
+    virtual void Clear() = 0;
+    virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) = 0;
+};
+
+} // namespace rgb_matrix
+
+#endif
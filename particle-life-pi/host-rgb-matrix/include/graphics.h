@@ -0,0 +1,52 @@
+// Host stand-in for rpi-rgb-led-matrix's graphics.h: Color, BDF fonts and DrawText.
+#ifndef RPI_GRAPHICS_H
+#define RPI_GRAPHICS_H
+
+#include "canvas.h"
+
+#include <stdint.h>
+#include <map>
+
+namespace rgb_matrix
+{
+
+struct Color
+{
+    Color() : r(0), g(0), b(0) {}
+    Color(uint8_t rr, uint8_t gg, uint8_t bb) : r(rr), g(gg), b(bb) {}
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+};
+
+// A bitmap font loaded from a BDF file, like the ones that ship with the real library
+class Font
+{
+public:
+    Font();
+    ~Font();
+
+    bool LoadFont(const char *path);
+    int height() const { return fontHeight; }
+    int baseline() const { return fontBaseline; }
+    // -1 if the font has no such character
+    int CharacterWidth(uint32_t unicodeCodepoint) const;
+    // Draws one character with its baseline at y and returns how far to move along
+    int DrawGlyph(Canvas *c, int x, int y, const Color &color, uint32_t unicodeCodepoint) const;
+
+private:
+    struct Glyph;
+    std::map<uint32_t, Glyph *> glyphs;
+    int fontHeight;
+    int fontBaseline;
+
+    Font(const Font &);
+    Font &operator=(const Font &);
+};
+
+// Draws utf8Text with its baseline at y and returns how wide it was
+int DrawText(Canvas *c, const Font &font, int x, int y, const Color &color, const char *utf8Text);
+
+} // namespace rgb_matrix
+
+#endif
@@ -0,0 +1,122 @@
+// Host stand-in for rpi-rgb-led-matrix's led-matrix.h, so the Pi frontend builds and runs on
+// any Linux box. There is no panel: drawing goes into memory, SwapOnVSync() sleeps the way the
+// refresh thread would make it wait, and every frame can be written out. Build with
+// make HOST=1. The flags it takes on top of the usual --led-* ones are listed by
+// PrintMatrixFlags().
+#ifndef RPI_RGBMATRIX_H
+#define RPI_RGBMATRIX_H
+
+#include "canvas.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+namespace rgb_matrix
+{
+
+class RGBMatrix;
+
+// A buffer the size of the whole chain of panels
+class FrameCanvas : public Canvas
+{
+public:
+    int width() const { return canvasWidth; }
+    int height() const { return canvasHeight; }
+    void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+    void Clear();
+    void Fill(uint8_t red, uint8_t green, uint8_t blue);
+
+    // Not in the real library. Rows of red, green, blue bytes.
+    const uint8_t *pixels() const { return &rgb[0]; }
+
+private:
+    friend class RGBMatrix;
+    FrameCanvas(RGBMatrix *owner, int width, int height);
+
+    RGBMatrix *matrix;
+    int canvasWidth;
+    int canvasHeight;
+    std::vector<uint8_t> rgb;
+};
+
+struct RuntimeOptions
+{
+    RuntimeOptions();
+    int gpio_slowdown;
+    int daemon;
+    int drop_privileges;
+    bool do_gpio_init;
+};
+
+// What the stand-in counted since the matrix was created
+struct HostMatrixStats
+{
+    long frames;            // SwapOnVSync() calls
+    long setPixelCalls;
+    long offCanvasPixels;   // SetPixel() calls that landed outside the canvas and were ignored
+    long fillCalls;         // Fill() and Clear() calls
+    int64_t vsyncWaitNanos; // Time spent blocked in SwapOnVSync()
+};
+
+class RGBMatrix
+{
+public:
+    struct Options
+    {
+        Options();
+        const char *hardware_mapping;
+        int rows;
+        int cols;
+        int chain_length;
+        int parallel;
+        int pwm_bits;
+        int brightness;
+        int limit_refresh_rate_hz;
+        bool show_refresh_rate;
+
+        // Not in the real library
+        int host_refresh_rate_hz;      // How often the imaginary panel refreshes, --led-host-refresh=HZ
+        const char *host_dump_path;    // Appends every swapped frame as a binary PPM, --led-host-dump=PATH
+        int host_dump_every;           // Only every Nth frame, --led-host-dump-every=N
+        bool host_print_stats;         // Prints HostMatrixStats when the matrix is deleted, --led-host-stats
+    };
+
+    static RGBMatrix *CreateFromOptions(const Options &options, const RuntimeOptions &runtimeOptions);
+    ~RGBMatrix();
+
+    int width() const;
+    int height() const;
+    FrameCanvas *CreateFrameCanvas();
+    // Shows other from the next refresh on, waits for that refresh to start, and hands back the
+    // canvas that was on show before so it can be drawn on
+    FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerateFraction = 1);
+
+    // Not in the real library
+    const HostMatrixStats &hostStats() const { return stats; }
+
+private:
+    friend class FrameCanvas;
+    RGBMatrix(const Options &options);
+    void DumpFrame(const FrameCanvas *frame);
+
+    Options options;
+    std::vector<FrameCanvas *> canvases;
+    FrameCanvas *shown;
+    int64_t refreshPeriod; // Nanoseconds
+    int64_t firstRefresh;  // When the first refresh started, CLOCK_MONOTONIC
+    long refreshesShown;   // Refreshes up to the last swap
+    FILE *dump;
+    HostMatrixStats stats;
+};
+
+// Takes the --led-* flags out of argv and sets the options from them. Flags the real
+// library knows but the stand-in has no use for are accepted and ignored.
+bool ParseOptionsFromFlags(int *argc, char ***argv, RGBMatrix::Options *defaultOptions, RuntimeOptions *runtimeOptions,
+                           bool removeConsumedFlags = true);
+void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &defaults = RGBMatrix::Options(),
+                      const RuntimeOptions &runtimeDefaults = RuntimeOptions());
+
+} // namespace rgb_matrix
+
+#endif
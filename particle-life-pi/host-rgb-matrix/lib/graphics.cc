@@ -0,0 +1,136 @@
+// Host stand-in for the BDF font loader and text drawing. See include/graphics.h.
+
+#include "graphics.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace rgb_matrix
+{
+
+struct Font::Glyph
+{
+    int advance;
+    int width;
+    int height;
+    int xOffset;
+    int yOffset;       // Of the bottom row from the baseline, up is positive
+    uint32_t rows[32]; // Leftmost pixel in the top bit
+};
+
+Font::Font() : fontHeight(-1), fontBaseline(0)
+{
+}
+
+Font::~Font()
+{
+    for (std::map<uint32_t, Glyph *>::iterator it = glyphs.begin(); it != glyphs.end(); ++it)
+        delete it->second;
+}
+
+bool Font::LoadFont(const char *path)
+{
+    FILE *bdf = fopen(path, "r");
+    if (bdf == NULL)
+        return false;
+
+    char line[256];
+    Glyph *glyph = NULL;
+    uint32_t codepoint = 0;
+    int row = -1; // Bitmap row being read, -1 outside a bitmap
+    while (fgets(line, sizeof(line), bdf))
+    {
+        int a, b, c, d;
+        if (row >= 0 && glyph != NULL)
+        {
+            if (strncmp(line, "ENDCHAR", 7) == 0)
+            {
+                delete glyphs[codepoint];
+                glyphs[codepoint] = glyph;
+                glyph = NULL;
+                row = -1;
+            }
+            else if (row < glyph->height && row < 32)
+            {
+                unsigned bits;
+                sscanf(line, "%x", &bits);
+                // Each row is padded out to whole bytes
+                int digits = (int)strspn(line, "0123456789abcdefABCDEF");
+                glyph->rows[row++] = (digits >= 8) ? bits : bits << (32 - 4 * digits);
+            }
+        }
+        else if (sscanf(line, "FONTBOUNDINGBOX %d %d %d %d", &a, &b, &c, &d) == 4)
+        {
+            fontHeight = b;
+            fontBaseline = b + d;
+        }
+        else if (strncmp(line, "STARTCHAR", 9) == 0)
+        {
+            delete glyph;
+            glyph = new Glyph();
+        }
+        else if (glyph != NULL && sscanf(line, "ENCODING %d", &a) == 1)
+            codepoint = a;
+        else if (glyph != NULL && sscanf(line, "DWIDTH %d", &a) == 1)
+            glyph->advance = a;
+        else if (glyph != NULL && sscanf(line, "BBX %d %d %d %d", &a, &b, &c, &d) == 4)
+        {
+            glyph->width = a;
+            glyph->height = b;
+            glyph->xOffset = c;
+            glyph->yOffset = d;
+        }
+        else if (glyph != NULL && strncmp(line, "BITMAP", 6) == 0)
+            row = 0;
+    }
+    delete glyph;
+    fclose(bdf);
+    return fontHeight > 0 && !glyphs.empty();
+}
+
+int Font::CharacterWidth(uint32_t unicodeCodepoint) const
+{
+    std::map<uint32_t, Glyph *>::const_iterator it = glyphs.find(unicodeCodepoint);
+    return (it == glyphs.end()) ? -1 : it->second->advance;
+}
+
+int Font::DrawGlyph(Canvas *c, int x, int y, const Color &color, uint32_t unicodeCodepoint) const
+{
+    std::map<uint32_t, Glyph *>::const_iterator it = glyphs.find(unicodeCodepoint);
+    if (it == glyphs.end())
+        return 0;
+    const Glyph *glyph = it->second;
+    int top = y - glyph->height - glyph->yOffset;
+    for (int row = 0; row < glyph->height && row < 32; row++)
+    {
+        for (int col = 0; col < glyph->width && col < 32; col++)
+        {
+            if (glyph->rows[row] & (0x80000000u >> col))
+                c->SetPixel(x + glyph->xOffset + col, top + row, color.r, color.g, color.b);
+        }
+    }
+    return glyph->advance;
+}
+
+int DrawText(Canvas *c, const Font &font, int x, int y, const Color &color, const char *utf8Text)
+{
+    const int start = x;
+    const unsigned char *text = (const unsigned char *)utf8Text;
+    while (*text)
+    {
+        uint32_t codepoint = *text++;
+        int continuation = (codepoint >= 0xf0) ? 3 : (codepoint >= 0xe0) ? 2 : (codepoint >= 0xc0) ? 1 : 0;
+        codepoint &= (continuation == 0) ? 0x7f : (0x3f >> continuation);
+        while (continuation-- > 0 && (*text & 0xc0) == 0x80)
+            codepoint = (codepoint << 6) | (*text++ & 0x3f);
+
+        int advance = font.DrawGlyph(c, x, y, color, codepoint);
+        // Like the real library, fall back to a question mark
+        if (advance == 0)
+            advance = font.DrawGlyph(c, x, y, color, '?');
+        x += advance;
+    }
+    return x - start;
+}
+
+} // namespace rgb_matrix
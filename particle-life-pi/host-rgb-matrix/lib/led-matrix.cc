@@ -0,0 +1,248 @@
+// Host stand-in for the matrix and its refresh thread. See include/led-matrix.h.
+
+#include "led-matrix.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+namespace rgb_matrix
+{
+
+static int64_t Nanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void SleepUntil(int64_t deadline)
+{
+    struct timespec until = {(time_t)(deadline / 1000000000), (long)(deadline % 1000000000)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+    {
+    }
+}
+
+RuntimeOptions::RuntimeOptions() : gpio_slowdown(1), daemon(0), drop_privileges(1), do_gpio_init(true)
+{
+}
+
+RGBMatrix::Options::Options()
+    : hardware_mapping("regular"), rows(32), cols(32), chain_length(1), parallel(1), pwm_bits(11), brightness(100),
+      limit_refresh_rate_hz(0), show_refresh_rate(false), host_refresh_rate_hz(120), host_dump_path(NULL), host_dump_every(1),
+      host_print_stats(false)
+{
+}
+
+FrameCanvas::FrameCanvas(RGBMatrix *owner, int width, int height)
+    : matrix(owner), canvasWidth(width), canvasHeight(height), rgb((size_t)width * height * 3, 0)
+{
+}
+
+void FrameCanvas::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue)
+{
+    matrix->stats.setPixelCalls++;
+    // The real library drops these too
+    if (x < 0 || y < 0 || x >= canvasWidth || y >= canvasHeight)
+    {
+        matrix->stats.offCanvasPixels++;
+        return;
+    }
+    uint8_t *pixel = &rgb[((size_t)y * canvasWidth + x) * 3];
+    pixel[0] = red;
+    pixel[1] = green;
+    pixel[2] = blue;
+}
+
+void FrameCanvas::Clear()
+{
+    Fill(0, 0, 0);
+}
+
+void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue)
+{
+    matrix->stats.fillCalls++;
+    for (size_t i = 0; i < rgb.size(); i += 3)
+    {
+        rgb[i] = red;
+        rgb[i + 1] = green;
+        rgb[i + 2] = blue;
+    }
+}
+
+RGBMatrix::RGBMatrix(const Options &options) : options(options), dump(NULL)
+{
+    memset(&stats, 0, sizeof(stats));
+    int refreshRate = options.host_refresh_rate_hz;
+    if (options.limit_refresh_rate_hz > 0 && options.limit_refresh_rate_hz < refreshRate)
+        refreshRate = options.limit_refresh_rate_hz;
+    refreshPeriod = 1000000000 / refreshRate;
+    // The refresh thread starts right away, showing the matrix's own canvas
+    shown = CreateFrameCanvas();
+    firstRefresh = Nanos();
+    refreshesShown = 0;
+}
+
+RGBMatrix *RGBMatrix::CreateFromOptions(const Options &options, const RuntimeOptions &runtimeOptions)
+{
+    if (options.rows < 1 || options.cols < 1 || options.chain_length < 1 || options.parallel < 1 || options.host_refresh_rate_hz < 1 ||
+        options.host_dump_every < 1)
+    {
+        fprintf(stderr, "host matrix: rows, cols, chain, parallel, refresh rate and dump interval all need to be at least 1\n");
+        return NULL;
+    }
+    RGBMatrix *matrix = new RGBMatrix(options);
+    if (options.host_dump_path != NULL)
+    {
+        matrix->dump = fopen(options.host_dump_path, "wb");
+        if (matrix->dump == NULL)
+        {
+            fprintf(stderr, "host matrix: can't write %s (%s)\n", options.host_dump_path, strerror(errno));
+            delete matrix;
+            return NULL;
+        }
+    }
+    return matrix;
+}
+
+RGBMatrix::~RGBMatrix()
+{
+    if (options.host_print_stats)
+    {
+        fprintf(stderr, "host matrix: %ld frames, %ld SetPixel calls (%ld off the canvas), %ld fills, %.3f ms average vsync wait\n",
+                stats.frames, stats.setPixelCalls, stats.offCanvasPixels, stats.fillCalls,
+                (stats.frames > 0) ? stats.vsyncWaitNanos / 1e6 / stats.frames : 0.0);
+    }
+    if (dump != NULL)
+        fclose(dump);
+    for (size_t i = 0; i < canvases.size(); i++)
+        delete canvases[i];
+}
+
+int RGBMatrix::width() const
+{
+    return options.cols * options.chain_length;
+}
+
+int RGBMatrix::height() const
+{
+    return options.rows * options.parallel;
+}
+
+FrameCanvas *RGBMatrix::CreateFrameCanvas()
+{
+    FrameCanvas *canvas = new FrameCanvas(this, width(), height());
+    canvases.push_back(canvas);
+    return canvas;
+}
+
+FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other, unsigned framerateFraction)
+{
+    if (framerateFraction < 1)
+        framerateFraction = 1;
+    int64_t start = Nanos();
+    // The new canvas goes up at the start of the next refresh, but the one on show stays
+    // up for at least framerateFraction refreshes
+    long refresh = (start - firstRefresh) / refreshPeriod + 1;
+    if (refresh < refreshesShown + (long)framerateFraction)
+        refresh = refreshesShown + framerateFraction;
+    SleepUntil(firstRefresh + refresh * refreshPeriod);
+    stats.vsyncWaitNanos += Nanos() - start;
+    refreshesShown = refresh;
+
+    FrameCanvas *previous = shown;
+    shown = other;
+    if (dump != NULL && stats.frames % options.host_dump_every == 0)
+        DumpFrame(other);
+    stats.frames++;
+    return previous;
+}
+
+// One binary PPM after another. ffmpeg -f image2pipe -c:v ppm -i PATH turns them into a video.
+void RGBMatrix::DumpFrame(const FrameCanvas *frame)
+{
+    fprintf(dump, "P6\n%d %d\n255\n", frame->width(), frame->height());
+    fwrite(frame->pixels(), 3, (size_t)frame->width() * frame->height(), dump);
+}
+
+// Reads the number after a flag's '=' into value. False if it isn't one.
+static bool FlagNumber(const char *arg, const char *flag, int *value, bool *bad)
+{
+    size_t length = strlen(flag);
+    if (strncmp(arg, flag, length) != 0 || arg[length] != '=')
+        return false;
+    char *end;
+    *value = strtol(arg + length + 1, &end, 10);
+    if (*end != '\0' || end == arg + length + 1)
+    {
+        fprintf(stderr, "%s needs a number\n", flag);
+        *bad = true;
+    }
+    return true;
+}
+
+bool ParseOptionsFromFlags(int *argc, char ***argv, RGBMatrix::Options *options, RuntimeOptions *runtimeOptions,
+                           bool removeConsumedFlags)
+{
+    bool bad = false;
+    int kept = 1;
+    for (int i = 1; i < *argc; i++)
+    {
+        const char *arg = (*argv)[i];
+        if (strncmp(arg, "--led-", 6) != 0)
+        {
+            (*argv)[kept++] = (*argv)[i];
+            continue;
+        }
+
+        if (FlagNumber(arg, "--led-rows", &options->rows, &bad) || FlagNumber(arg, "--led-cols", &options->cols, &bad) ||
+            FlagNumber(arg, "--led-chain", &options->chain_length, &bad) || FlagNumber(arg, "--led-parallel", &options->parallel, &bad) ||
+            FlagNumber(arg, "--led-pwm-bits", &options->pwm_bits, &bad) || FlagNumber(arg, "--led-brightness", &options->brightness, &bad) ||
+            FlagNumber(arg, "--led-limit-refresh", &options->limit_refresh_rate_hz, &bad) ||
+            FlagNumber(arg, "--led-slowdown-gpio", &runtimeOptions->gpio_slowdown, &bad) ||
+            FlagNumber(arg, "--led-host-refresh", &options->host_refresh_rate_hz, &bad) ||
+            FlagNumber(arg, "--led-host-dump-every", &options->host_dump_every, &bad))
+        {
+        }
+        else if (strcmp(arg, "--led-daemon") == 0)
+            runtimeOptions->daemon = 1;
+        else if (strncmp(arg, "--led-host-dump=", 16) == 0)
+            options->host_dump_path = arg + 16;
+        else if (strcmp(arg, "--led-host-stats") == 0)
+            options->host_print_stats = true;
+        else if (strcmp(arg, "--led-show-refresh") == 0)
+            options->show_refresh_rate = true;
+        else if (strcmp(arg, "--led-no-drop-privs") == 0)
+            runtimeOptions->drop_privileges = 0;
+        else if (strncmp(arg, "--led-gpio-mapping=", 19) == 0)
+            options->hardware_mapping = arg + 19;
+        // Everything else the real library knows about only matters to real hardware
+
+        if (!removeConsumedFlags)
+            (*argv)[kept++] = (*argv)[i];
+    }
+    *argc = kept;
+    (*argv)[kept] = NULL;
+    return !bad;
+}
+
+void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &defaults, const RuntimeOptions &runtimeDefaults)
+{
+    fprintf(out,
+            "\t--led-rows=<rows>           : Panel rows (default %d)\n"
+            "\t--led-cols=<cols>           : Panel columns (default %d)\n"
+            "\t--led-chain=<panels>        : Panels chained together (default %d)\n"
+            "\t--led-parallel=<chains>     : Chains in parallel (default %d)\n"
+            "\t--led-limit-refresh=<Hz>    : Refresh no faster than this, 0 for no limit (default %d)\n"
+            "\t--led-host-refresh=<Hz>     : How often the imaginary panel refreshes (default %d)\n"
+            "\t--led-host-dump=<path>      : Write swapped frames to path as binary PPMs\n"
+            "\t--led-host-dump-every=<N>   : Only dump every Nth frame (default %d)\n"
+            "\t--led-host-stats            : Print what was drawn when the matrix is deleted\n"
+            "\tOther --led-* flags are accepted and ignored.\n",
+            defaults.rows, defaults.cols, defaults.chain_length, defaults.parallel, defaults.limit_refresh_rate_hz,
+            defaults.host_refresh_rate_hz, defaults.host_dump_every);
+}
+
+} // namespace rgb_matrix
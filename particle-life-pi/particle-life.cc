@@ -1,26 +1,85 @@
 #include "led-matrix.h"
 #include "graphics.h"
+#include "frame-ring.h"
 
 #include <unistd.h>
 #include <math.h>
 #include <stdio.h>
 #include <signal.h>
-#include <sys/time.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 #define SCREEN_WIDTH 64
 #define SCREEN_HEIGHT 32
 
 #define CANVAS_WIDTH SCREEN_WIDTH
 #define CANVAS_HEIGHT SCREEN_HEIGHT
-#define CANVAS_ASPECT_RATIO (CANVAS_WIDTH / CANVAS_HEIGHT)
-
-#define CELL_GRID_WIDTH 4
-#define CELL_GRID_HEIGHT 2
-#define MAX_PARTICLES_PER_CELL 80
-
-#define MAX_PARTICLES 12
+#define CANVAS_ASPECT_RATIO ((float)CANVAS_WIDTH / CANVAS_HEIGHT)
+
+// How many rows of cells to use is picked at startup, see AutoTune(). Cells shorter than
+// maxDistance get a wider stencil of neighbors, see SetGridHeight().
+#define MIN_CELL_GRID_HEIGHT 2
+#define MAX_CELL_GRID_HEIGHT 8
+#define MAX_CELL_GRID_WIDTH (MAX_CELL_GRID_HEIGHT * CANVAS_WIDTH / CANVAS_HEIGHT)
+// Cells as small as maxDistance / 2 need neighbors up to two cells away
+#define MAX_STENCIL_REACH 2
+#define MAX_STENCIL_CELLS ((2 * MAX_STENCIL_REACH + 1) * (2 * MAX_STENCIL_REACH + 1))
+#define MAX_CELLS (MAX_CELL_GRID_HEIGHT * MAX_CELL_GRID_WIDTH)
+#ifndef MAX_PARTICLES_PER_CELL
+#define MAX_PARTICLES_PER_CELL 255 // The most a byte can count. A particle left out of a full cell feels no force.
+#endif
+
+#ifndef MAX_PARTICLES
+#define MAX_PARTICLES 400 // Room in the pool. The governor decides how much of it is in use.
+#endif
+#define START_PARTICLES 12
+#define MIN_PARTICLES 4
 #define MAX_COLOR_GROUPS 2
 
+#define STATS_PRINT_INTERVAL 100 // Frames between printing SimStats when run with --stats
+
+#define DEFAULT_TARGET_FPS 100 // Change with --fps=N, 0 to run as fast as the panel allows
+#define JITTER_BUCKETS 8
+
+// The governor grows the particle count while a frame's work fits in this share of the
+// frame period, and shrinks it when it doesn't. --particles=N turns it off.
+#define GOVERNOR_BUDGET_SHARE 0.5
+#define GOVERNOR_HEADROOM 0.75 // Only grow while under this share of the budget, so the count doesn't flap
+#define GOVERNOR_INTERVAL 25   // Frames to wait after a change before judging it
+#define FADE_STEP 17           // Fade change per frame, 15 frames from black to full
+
+// --realtime runs the sim threads under SCHED_FIFO. The matrix library refreshes the
+// panel from its own SCHED_FIFO thread at priority 99, so stay below that. --sim-cpu=2 pins
+// the main sim thread to CPU 2 and each worker to another, --sim-cpu=2,0,1 names them all.
+#define DEFAULT_SIM_PRIORITY 50
+#define STACK_PREFAULT_SIZE (256 * 1024)
+
+// The matrix library keeps one core busy refreshing the panel, so use at most the other three
+#ifndef MAX_SIM_THREADS
+#define MAX_SIM_THREADS 3
+#endif
+#define TASKS_PER_THREAD 8 // Work stealing splits cells until no task holds more than 1 / (threads * this) of the pairs
+#define DEFAULT_TUNE_CACHE "particle-life.tune" // Change with --tune-cache=PATH
+#define TUNE_WARMUP_STEPS 5
+#define TUNE_STEPS 20
+#define TUNE_KEEP 3    // Configs each stage of tuning hands on to the next
+#define TUNE_REPEATS 5 // Timings of each finalist, keeping the best
+#define MAX_TUNE_CANDIDATES (TUNE_KEEP * MAX_SIM_THREADS * 2 * SCHEDULE_COUNT + MAX_CELL_GRID_HEIGHT * KERNEL_COUNT)
+
 // Pin defines
 #define SW 29   // wPi assignment
 
@@ -30,6 +89,113 @@ RGBMatrix *matrix;
 FrameCanvas *canvas;
 Font font;
 
+// --export-frames publishes every frame into a shared-memory ring, see frame-ring.h
+FrameRingHeader *frameRing;
+FrameRingSlot *frameSlot; // The slot this frame is being drawn into, NULL when not exporting
+uint64_t exportedFrames;
+
+// --send=HOST:PORT sends every frame to a Pi running with --receive=PORT, which only shows
+// them. One UDP datagram a frame, this header and then the pixels as red, green and blue bytes.
+// The fields are in network byte order.
+#define FRAME_PACKET_MAGIC 0x504c4650 // "PLFP"
+#define FRAME_PACKET_VERSION 1
+#define MAX_FRAME_PACKET 65507 // The most a UDP datagram can carry
+#define RECEIVE_BUFFER_SIZE (1024 * 1024)
+#define RECEIVER_STALL 250000000 // Nanoseconds without a new frame that count as a stall
+#define RECEIVER_SWITCH_AFTER 8  // Packets in a row from another stream that make the receiver switch to it
+struct FramePacketHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t width;
+    uint16_t height;
+    uint16_t particleCount;
+    uint32_t streamId; // Picked by the sender at startup, so a restarted one isn't mistaken for an old one
+    uint32_t sequence; // One more every frame
+};
+
+struct FrameSender
+{
+    int socket; // -1 when not sending
+    uint32_t streamId;
+    uint32_t sequence;
+    long sent;
+    long failed; // Mostly a full socket buffer, the frame is dropped rather than waited on
+};
+FrameSender frameSender = {-1, 0, 0, 0, 0};
+
+// --record=PATH writes every frame to a file that --play=PATH can show again later without
+// the sim. Every RECORDING_KEYFRAME_INTERVAL frames a keyframe holds the whole picture as runs
+// of equal pixels. The frames in between hold what changed since the frame before: runs of
+// unchanged pixels to skip, and the changed ones XORed with what was there. The index after
+// the last frame says where each frame starts, and each frame says how far back its keyframe
+// is, so playback can start from any frame after two lookups.
+#define RECORDING_MAGIC 0x43524c50 // "PLRC"
+#define RECORDING_VERSION 1
+#define RECORDING_KEYFRAME_INTERVAL 100
+#define RECORDING_INDEX_START 65536  // Frames the index has room for before it grows
+#define PLAYBACK_LATE 2000000        // Nanoseconds past its time a frame has to be to count as late
+struct RecordingHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t keyframeInterval;
+    uint16_t width;
+    uint16_t height;
+    uint32_t reserved;
+    uint64_t frameCount;  // 0 until the recording is closed
+    uint64_t indexOffset; // Where the index starts, 0 until the recording is closed
+};
+struct RecordedFrame
+{
+    uint32_t size;          // Bytes of pixel runs that follow
+    uint16_t sinceKeyframe; // 0 for a keyframe
+    uint16_t particleCount;
+    int64_t time; // Nanoseconds since the recording started
+};
+
+// A file read or written on a thread of its own through a ring of bytes, so the frame loop
+// never waits on the disk. The owner puts bytes in or takes them out, the thread does the rest.
+#define FILE_STREAM_SIZE (4 * 1024 * 1024)
+#define FILE_STREAM_CHUNK (64 * 1024) // Most the thread reads or writes at once
+struct FileStream
+{
+    FILE *file; // NULL when not in use
+    bool writing;
+    uint8_t *ring;
+    size_t head;      // Bytes put into the ring so far
+    size_t tail;      // Bytes taken out so far
+    size_t remaining; // Reading: bytes of the file still to read
+    bool closing;     // The owner is done with it
+    bool ended;       // Reading: the thread has read all it is going to
+    bool failed;      // Writing: something didn't make it to the file
+    long waits;       // Reading: times the owner had to wait for the disk
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+struct Recorder
+{
+    FileStream stream;
+    const char *path;
+    uint8_t *previous;  // The last frame recorded
+    uint8_t *encoded;   // Room for the biggest a frame can get
+    uint64_t *index;
+    uint64_t indexCapacity;
+    uint64_t frameCount;
+    uint64_t offset;    // Where the next frame will start in the file
+    int sinceKeyframe;  // -1 when the next frame has to be a keyframe
+    int64_t startedAt;
+    long dropped;       // Left out because the disk had fallen behind
+};
+Recorder recorder;
+
+// This frame's pixels as they are drawn, for the export ring, the sender and the recorder.
+// NULL when none of them want them.
+uint8_t *framePixels;
+uint8_t *localFramePixels; // Drawn into when there is no export ring slot to draw into
+
 enum ProgramState
 {
     MENU,
@@ -64,21 +230,76 @@ struct Particle
     Vector2 position;
     Vector2 velocity;
     ColorGroup colorGroup;
+    uint8_t fade; // Brightness, ramps up when the governor adds the particle and down when it retires it
+    Vector2 force;    // Left by the force pass for the move pass
+    Vector2 halfKick; // Velocity Verlet only: the half of the last step's kick still to be applied
 };
 
 Particle particles[MAX_PARTICLES];
+// Particles [0, activeParticleCount) are simulated and drawn, the rest of the pool waits.
+// The ones from retireFrom up are fading out on their way back into the pool.
+int activeParticleCount = START_PARTICLES;
+int retireFrom = START_PARTICLES;
 
 // In worldspace, the radius of the sphere of influence for each particle.
 const float maxDistance = 0.25; // Please let 2 be evenly divisible by this number, for cellSize's sake
 const float dt = 0.01;
-const float frictionFactor = 0.99;
+const float frictionFactor = 0.99; // How much velocity is left after one frame at FRICTION_REFERENCE_FPS
 const float forceFactor = 10.0;
+// Friction is applied per second, so the motion doesn't change with --fps
+#define FRICTION_REFERENCE_FPS DEFAULT_TARGET_FPS
+const float damping = -logf(frictionFactor) * FRICTION_REFERENCE_FPS;
+
+// How a step turns forces into motion. Pick with --integrator=NAME.
+enum Integrator
+{
+    INTEGRATOR_SYMPLECTIC_EULER, // Velocity first, then position with the new velocity
+    INTEGRATOR_VELOCITY_VERLET,  // Second order, still one force pass per step
+    INTEGRATOR_EXPONENTIAL,      // Friction and force integrated exactly over the step
+    INTEGRATOR_COUNT
+};
+const char *integratorNames[INTEGRATOR_COUNT] = {"euler", "verlet", "exponential"};
+Integrator integrator = INTEGRATOR_SYMPLECTIC_EULER;
+
+// Size of the area the particles live in. It wraps around at the edges.
+const float worldWidth = CANVAS_ASPECT_RATIO;
+const float worldHeight = 1.0;
+
+// --compact keeps the particles in compactParticles instead of particles: positions in 16-bit
+// fixed point across the world, velocities in 16 bits and the group in a byte, a quarter of a
+// Particle. The force pass reads each particle once per neighbor, so that is what it walks. The
+// force, the Verlet half kick and the fade go in compactColds, which the force pass never reads.
+// Floats only live in registers, while a particle is being worked on. --bench-compact shows what
+// it saves, --check-trace on a trace made without it shows how far 16-bit state drifts.
+#define COMPACT_POSITION_STEPS 65536 // Across the world on each axis, so a position wraps by itself
+#define COMPACT_VELOCITY_RANGE 16.0f // World units per second either way. Runs stay under 8.
+#define COMPACT_VELOCITY_STEPS 32767
+struct CompactParticle
+{
+    uint16_t x;
+    uint16_t y;
+    int16_t velocityX;
+    int16_t velocityY;
+    uint8_t colorGroup;
+};
+struct ColdParticle
+{
+    Vector2 force;    // Left by the force pass for the move pass
+    Vector2 halfKick; // Velocity Verlet only
+    uint8_t fade;
+};
+CompactParticle compactParticles[MAX_PARTICLES];
+ColdParticle compactColds[MAX_PARTICLES];
+bool compactState = false;
 
 
 struct Cell
 {
     uint16_t particleIndices[MAX_PARTICLES_PER_CELL];
     uint8_t particleCount;
+    // Smallest box around the particles in the cell this step, for culling cell pairs
+    Vector2 boundsMin;
+    Vector2 boundsMax;
 };
 
 // Used to define which way a neighboring cell is wrapped around the edge of the area
@@ -90,11 +311,94 @@ struct CellWrap
     bool wrappedBottom;
 };
 
-// Divide the area into cells whos size is the
-// diameter of the circle of influence for every particle
-const float cellSize = maxDistance * 2.0;
-// Each grid cell contains a list of particles within its bounds.
-Cell grid[CELL_GRID_HEIGHT][CELL_GRID_WIDTH];
+// What the last frame actually did. Cheap enough to always be on.
+#define OCCUPANCY_BUCKETS 8 // Cells holding 0, 1, 2-3, 4-7, ... 64 or more particles
+struct SimStats
+{
+    long candidatePairs;  // Pairs the force loop looked at
+    long pairsInRange;    // Pairs close enough to push or pull
+    int droppedParticles; // Left out of the grid because their cell was full
+    int wrapShifts;       // Pairs where the other particle was shifted across an edge
+    int culledCellPairs;  // Stencil cells skipped for being empty or out of reach
+    int maxCellOccupancy;
+    float meanCellOccupancy;
+    int occupancyHistogram[OCCUPANCY_BUCKETS];
+    int forceThreads;                      // Threads that shared the force pass
+    int64_t forcePassTime;                 // Nanoseconds from handing the force pass out to the last thread finishing
+    int64_t threadBusy[MAX_SIM_THREADS];   // Nanoseconds each thread worked on it
+    int forceTasks;                        // Work stealing only: tasks the pass was cut into
+    int stolenTasks;                       // Work stealing only: tasks a thread took from another
+};
+SimStats frameStats;
+bool printStats = false;
+
+// Divide the area into cells. Set by SetGridHeight().
+int cellGridWidth;
+int cellGridHeight;
+float cellWidth;
+float cellHeight;
+// Each grid cell contains a list of particles within its bounds. They are stored in the
+// order cellSlots says, which is also the order the force pass walks them in.
+Cell cells[MAX_CELLS];
+uint16_t cellSlots[MAX_CELL_GRID_HEIGHT][MAX_CELL_GRID_WIDTH];
+// Where the cell in each slot is on the grid
+uint8_t slotRows[MAX_CELLS];
+uint8_t slotCols[MAX_CELLS];
+int cellCount;
+
+// Where the cells that can hold a particle within maxDistance of a cell are, relative to it.
+// Set by SetGridHeight().
+struct StencilOffset
+{
+    int8_t rows;
+    int8_t cols;
+};
+StencilOffset stencil[MAX_STENCIL_CELLS];
+int stencilSize;
+
+// Ways to work out the forces, all giving the same motion. AutoTune() picks one.
+enum ForceKernel
+{
+    KERNEL_WRAP_FLAGS,
+    KERNEL_CELL_SHIFT,
+    KERNEL_COUNT
+};
+const char *kernelNames[KERNEL_COUNT] = {"wrap-flags", "cell-shift"};
+
+// Orders to keep the cells in. Along a Morton (Z-order) curve, the cells around the one being
+// worked on are mostly close by in memory, and the next cell shares most of its neighbors.
+enum CellLayout
+{
+    LAYOUT_ROW_MAJOR,
+    LAYOUT_MORTON,
+    LAYOUT_COUNT
+};
+const char *layoutNames[LAYOUT_COUNT] = {"row-major", "morton"};
+
+// Ways to share the force pass between threads. A static split hands each thread the same
+// number of cells, which leaves threads idle once the particles clump up. Work stealing cuts
+// the pass into tasks sized by how many pairs they hold, and threads that run out take tasks
+// from the others. See BuildForceTasks().
+enum ForceSchedule
+{
+    SCHEDULE_STATIC,
+    SCHEDULE_STEALING,
+    SCHEDULE_COUNT
+};
+const char *scheduleNames[SCHEDULE_COUNT] = {"static", "stealing"};
+
+// Everything about how a step is done that doesn't change what it does
+struct SimConfig
+{
+    int gridHeight;
+    ForceKernel kernel;
+    int threads;
+    CellLayout layout;
+    bool sortParticles; // Reorder the particles every step so each cell's are next to each other
+    bool parallelGrid;  // Share building the grid between the threads too, see UpdateGrid()
+    ForceSchedule schedule;
+};
+SimConfig simConfig = {2, KERNEL_WRAP_FLAGS, 1, LAYOUT_ROW_MAJOR, false, false, SCHEDULE_STATIC};
 
 
 volatile bool interrupt_received = false;
@@ -103,6 +407,25 @@ static void InterruptHandler(int signo) {
 }
 
 
+// Nanoseconds on a clock that only moves forward, even when NTP sets the time
+int64_t nanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void SleepUntil(int64_t deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    // Sleeping until an absolute time means a signal can't make us drift
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !interrupt_received)
+    {
+    }
+}
+
 // If there is an overflow, return 255
 uint8_t AddClamp(uint8_t a, uint8_t b)
 {
@@ -126,65 +449,30 @@ Color ColorAdd(Color a, Color b)
         AddClamp(a.b, b.b)};
 }
 
-void InitCellWraps(CellWrap *neighborCellWraps, uint8_t size)
-{
-    for (uint8_t i = 0; i < size; i++)
-    {
-        neighborCellWraps[i].wrappedLeft = false;
-        neighborCellWraps[i].wrappedRight = false;
-        neighborCellWraps[i].wrappedTop = false;
-        neighborCellWraps[i].wrappedBottom = false;
-    }
-}
-
-void GetNeighborCells(Cell **listToPopulate, int row, int col, CellWrap *wrapList)
+// Fills in the cells the stencil reaches around [row][col], with which way each one is
+// wrapped around the edge of the area, and returns how many there are
+int GetNeighborCells(Cell **listToPopulate, int row, int col, CellWrap *wrapList)
 {
-    uint8_t left = (col == 0) ? CELL_GRID_WIDTH - 1 : col - 1;
-    uint8_t right = (col + 1) % CELL_GRID_WIDTH;
-    uint8_t above = (row == 0) ? CELL_GRID_HEIGHT - 1 : row - 1;
-    uint8_t below = (row + 1) % CELL_GRID_HEIGHT;
-    /*
-    012
-    345
-    678
-    */
-    listToPopulate[0] = &grid[above][left];
-    listToPopulate[1] = &grid[above][col];
-    listToPopulate[2] = &grid[above][right];
-    listToPopulate[3] = &grid[row][left];
-    listToPopulate[4] = &grid[row][col];
-    listToPopulate[5] = &grid[row][right];
-    listToPopulate[6] = &grid[below][left];
-    listToPopulate[7] = &grid[below][col];
-    listToPopulate[8] = &grid[below][right];
-
-    // Which way are the cells wrapped?
-    if (col == 0)
-    {
-        // If the leftmost column, the left neighbors are all wrapped
-        wrapList[0].wrappedLeft = true;
-        wrapList[3].wrappedLeft = true;
-        wrapList[6].wrappedLeft = true;
-    }
-    else if (col == CELL_GRID_WIDTH - 1)
-    {
-        // If the rightmost column, the right neighbors are all wrapped
-        wrapList[2].wrappedRight = true;
-        wrapList[5].wrappedRight = true;
-        wrapList[8].wrappedRight = true;
-    }
-    if (row == 0)
-    {
-        wrapList[0].wrappedTop = true;
-        wrapList[1].wrappedTop = true;
-        wrapList[2].wrappedTop = true;
-    }
-    else if (row == CELL_GRID_HEIGHT - 1)
+    for (int n = 0; n < stencilSize; n++)
     {
-        wrapList[6].wrappedBottom = true;
-        wrapList[7].wrappedBottom = true;
-        wrapList[8].wrappedBottom = true;
+        int r = row + stencil[n].rows;
+        int c = col + stencil[n].cols;
+        wrapList[n].wrappedLeft = c < 0;
+        wrapList[n].wrappedRight = c >= cellGridWidth;
+        wrapList[n].wrappedTop = r < 0;
+        wrapList[n].wrappedBottom = r >= cellGridHeight;
+        // The stencil never reaches further than the grid is wide, so one wrap is enough
+        if (c < 0)
+            c += cellGridWidth;
+        else if (c >= cellGridWidth)
+            c -= cellGridWidth;
+        if (r < 0)
+            r += cellGridHeight;
+        else if (r >= cellGridHeight)
+            r -= cellGridHeight;
+        listToPopulate[n] = &cells[cellSlots[r][c]];
     }
+    return stencilSize;
 }
 
 
@@ -260,6 +548,88 @@ Color ColorMultiply(Color color, float value)
         (uint8_t)(color.b * value)};
 }
 
+// Everything drawn goes through these two, so an exported frame is written as it is drawn
+void SetCanvasPixel(int x, int y, Color color)
+{
+    canvas->SetPixel(x, y, color.r, color.g, color.b);
+    if (framePixels == NULL || x < 0 || y < 0 || x >= canvas->width() || y >= canvas->height())
+        return;
+    uint8_t *pixel = framePixels + (y * canvas->width() + x) * 3;
+    pixel[0] = color.r;
+    pixel[1] = color.g;
+    pixel[2] = color.b;
+}
+
+void FillCanvas(Color color)
+{
+    canvas->Fill(color.r, color.g, color.b);
+    if (framePixels == NULL)
+        return;
+    uint8_t *pixel = framePixels;
+    for (int i = 0; i < canvas->width() * canvas->height(); i++, pixel += 3)
+    {
+        pixel[0] = color.r;
+        pixel[1] = color.g;
+        pixel[2] = color.b;
+    }
+}
+
+// Sends the frame in pixels without waiting. A frame that doesn't go out is dropped.
+void SendFrame(const uint8_t *pixels, int particleCount)
+{
+    FramePacketHeader header;
+    header.magic = htonl(FRAME_PACKET_MAGIC);
+    header.version = htons(FRAME_PACKET_VERSION);
+    header.width = htons(canvas->width());
+    header.height = htons(canvas->height());
+    header.particleCount = htons(particleCount);
+    header.streamId = htonl(frameSender.streamId);
+    header.sequence = htonl(++frameSender.sequence);
+    // Straight from wherever the frame was drawn
+    struct iovec parts[2] = {{&header, sizeof(header)}, {(void *)pixels, (size_t)canvas->width() * canvas->height() * 3}};
+    struct msghdr message = {};
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    if (sendmsg(frameSender.socket, &message, MSG_DONTWAIT) < 0)
+        frameSender.failed++;
+    else
+        frameSender.sent++;
+}
+
+void RecordFrame(const uint8_t *pixels, int particleCount, int64_t frameStart);
+void CloseRecording();
+
+// Points framePixels at wherever this frame needs to end up, if anywhere
+void BeginFramePixels()
+{
+    if (frameRing != NULL)
+    {
+        frameSlot = FrameRingBeginFrame(frameRing, ++exportedFrames);
+        framePixels = FrameRingPixels(frameSlot);
+    }
+    else
+        framePixels = localFramePixels;
+}
+
+void FinishFramePixels(int particleCount, int64_t frameStart, int64_t frameWork, int64_t frameInterval)
+{
+    if (frameSlot != NULL)
+    {
+        frameSlot->particleCount = particleCount;
+        frameSlot->finishedAt = frameStart + frameWork;
+        frameSlot->frameWork = frameWork;
+        frameSlot->frameInterval = frameInterval;
+        FrameRingEndFrame(frameRing, frameSlot);
+        frameSlot = NULL;
+    }
+    // The slot stays as it is until the ring comes back around, so it can still be sent from
+    if (frameSender.socket >= 0)
+        SendFrame(framePixels, particleCount);
+    if (recorder.stream.file != NULL)
+        RecordFrame(framePixels, particleCount, frameStart);
+    framePixels = NULL;
+}
+
 // Draws a point on the screen at a sub-pixel level, unlike DrawPixel.
 // If the point is in-between screen pixels, it will be rendered using
 // its neighboring pixels.
@@ -292,10 +662,10 @@ void DrawPoint(Vector2 position, Color color)
     // FrameBufferAddPixV(pixelCornerTopRight, colorTopRight);
     // FrameBufferAddPixV(pixelCornerBottomLeft, colorBottomLeft);
     // FrameBufferAddPixV(pixelCornerBottomRight, colorBottomRight);
-    canvas->SetPixel(pixelCornerTopLeft.x, pixelCornerTopLeft.y, colorTopLeft.r, colorTopLeft.g, colorTopLeft.b);
-    canvas->SetPixel(pixelCornerTopRight.x, pixelCornerTopRight.y, colorTopRight.r, colorTopRight.g, colorTopRight.b);
-    canvas->SetPixel(pixelCornerBottomLeft.x, pixelCornerBottomLeft.y, colorBottomLeft.r, colorBottomLeft.g, colorBottomLeft.b);
-    canvas->SetPixel(pixelCornerBottomRight.x, pixelCornerBottomRight.y, colorBottomRight.r, colorBottomRight.g, colorBottomRight.b);
+    SetCanvasPixel(pixelCornerTopLeft.x, pixelCornerTopLeft.y, colorTopLeft);
+    SetCanvasPixel(pixelCornerTopRight.x, pixelCornerTopRight.y, colorTopRight);
+    SetCanvasPixel(pixelCornerBottomLeft.x, pixelCornerBottomLeft.y, colorBottomLeft);
+    SetCanvasPixel(pixelCornerBottomRight.x, pixelCornerBottomRight.y, colorBottomRight);
 }
 
 float AttractionForceMag(float distance, float attractionFactor)
@@ -319,224 +689,3254 @@ float AttractionForceMag(float distance, float attractionFactor)
 }
 
 
-void UpdateGrid()
+// Keeps a coordinate within [0, extent) while preserving how far past the edge it went
+float WrapCoordinate(float value, float extent)
+{
+    value = fmodf(value, extent);
+    if (value < 0)
+        value += extent;
+    // A tiny negative value can round up to exactly extent
+    if (value >= extent)
+        value = 0;
+    return value;
+}
+
+// Rounds a coordinate to the nearest of COMPACT_POSITION_STEPS across extent, wrapping it
+uint16_t CompactCoordinate(float value, float extent)
+{
+    return (uint16_t)lrintf(value * (COMPACT_POSITION_STEPS / extent));
+}
+
+int16_t CompactVelocity(float value)
+{
+    float steps = value * (COMPACT_VELOCITY_STEPS / COMPACT_VELOCITY_RANGE);
+    return (int16_t)lrintf(fmaxf(-COMPACT_VELOCITY_STEPS, fminf(COMPACT_VELOCITY_STEPS, steps)));
+}
+
+// Rounds particle i into compactParticles and compactColds. Anything that sets particles up
+// the float way calls this, or PackParticles(), afterwards when compactState is on.
+void PackParticle(int i)
+{
+    const Particle *p = &particles[i];
+    compactParticles[i] = {CompactCoordinate(p->position.x, worldWidth), CompactCoordinate(p->position.y, worldHeight),
+                           CompactVelocity(p->velocity.x), CompactVelocity(p->velocity.y), p->colorGroup};
+    compactColds[i] = {p->force, p->halfKick, p->fade};
+}
+
+// Particles [0, count)
+void PackParticles(int count)
+{
+    for (int i = 0; i < count; i++)
+        PackParticle(i);
+}
+
+Vector2 ParticlePosition(int i)
+{
+    if (!compactState)
+        return particles[i].position;
+    return {compactParticles[i].x * (worldWidth / COMPACT_POSITION_STEPS), compactParticles[i].y * (worldHeight / COMPACT_POSITION_STEPS)};
+}
+
+Vector2 ParticleVelocity(int i)
+{
+    if (!compactState)
+        return particles[i].velocity;
+    const float velocityStep = COMPACT_VELOCITY_RANGE / COMPACT_VELOCITY_STEPS;
+    return {compactParticles[i].velocityX * velocityStep, compactParticles[i].velocityY * velocityStep};
+}
+
+uint8_t *ParticleFade(int i)
+{
+    return compactState ? &compactColds[i].fade : &particles[i].fade;
+}
+
+ColorGroup ParticleGroup(int i)
+{
+    return compactState ? (ColorGroup)compactParticles[i].colorGroup : particles[i].colorGroup;
+}
+
+// Moves particle from into slot to, whichever way they are kept
+void MoveParticle(int to, int from)
+{
+    if (compactState)
+    {
+        compactParticles[to] = compactParticles[from];
+        compactColds[to] = compactColds[from];
+    }
+    else
+        particles[to] = particles[from];
+}
+
+// The slot of the cell a position is in
+int CellSlotOf(Vector2 position)
+{
+    int cell_row = (int)(position.y / cellHeight);
+    int cell_col = (int)(position.x / cellWidth);
+    // Rounding can put a particle sitting right on the far edge one cell too far
+    if (cell_row > cellGridHeight - 1)
+        cell_row = cellGridHeight - 1;
+    if (cell_col > cellGridWidth - 1)
+        cell_col = cellGridWidth - 1;
+    return cellSlots[cell_row][cell_col];
+}
+
+// Fills in the cells one particle at a time. A cell keeps the first MAX_PARTICLES_PER_CELL
+// particles that land in it, in the order they are in the pool.
+void FillCellsSerial()
 {
     // Clear the list of particles for each cell
-    for (int i = 0; i < CELL_GRID_HEIGHT; i++)
+    for (int slot = 0; slot < cellCount; slot++)
     {
-        for (int j = 0; j < CELL_GRID_WIDTH; j++)
-        {
-            grid[i][j].particleCount = 0;
-        }
+        cells[slot].particleCount = 0;
     }
 
     // Add each particle to the list of particles for its corresponding cell
-    for (int i = 0; i < MAX_PARTICLES; i++)
+    for (int i = 0; i < activeParticleCount; i++)
     {
+        Cell *cell = &cells[CellSlotOf(ParticlePosition(i))];
+        if (cell->particleCount < MAX_PARTICLES_PER_CELL)
+        {
+            cell->particleIndices[cell->particleCount] = i;
+            cell->particleCount++;
+        }
+        else
+        {
+            frameStats.droppedParticles++;
+        }
+    }
+}
 
-        int cell_row = (int)(particles[i].position.y / cellSize);
-        int cell_col = (int)(particles[i].position.x / cellSize);
-        // DebugPrintf("[%d, %d]\n", cell_row, cell_col);
-        //  if (cell_row > CELL_GRID_HEIGHT - 1)
-        //      continue;
-        //  if (cell_col > CELL_GRID_WIDTH - 1)
-        //      continue;
-        // Cell* cell = &grid[cell_row][cell_col];
-        //  if (cell->particleCount < MAX_PARTICLES_PER_CELL)
-        //  {
-        //      cell->particleIndices[cell->particleCount] = i;
-        //      cell->particleCount++;
-        //  }
-        if (grid[cell_row][cell_col].particleCount < MAX_PARTICLES_PER_CELL)
+// Works out the box around the particles in the cells in slots [firstSlot, endSlot)
+void UpdateCellBounds(int firstSlot, int endSlot)
+{
+    for (int slot = firstSlot; slot < endSlot; slot++)
+    {
+        Cell *cell = &cells[slot];
+        cell->boundsMin = {worldWidth, worldHeight};
+        cell->boundsMax = {0.0, 0.0};
+        for (int p = 0; p < cell->particleCount; p++)
         {
-            grid[cell_row][cell_col].particleIndices[grid[cell_row][cell_col].particleCount] = i;
-            grid[cell_row][cell_col].particleCount++;
+            Vector2 position = ParticlePosition(cell->particleIndices[p]);
+            cell->boundsMin = {fminf(cell->boundsMin.x, position.x), fminf(cell->boundsMin.y, position.y)};
+            cell->boundsMax = {fmaxf(cell->boundsMax.x, position.x), fmaxf(cell->boundsMax.y, position.y)};
         }
     }
 }
 
+// Room for SortParticlesByCell() to work in
+Particle sortedParticles[MAX_PARTICLES];
+CompactParticle sortedCompactParticles[MAX_PARTICLES];
+ColdParticle sortedCompactColds[MAX_PARTICLES];
+uint16_t newIndices[MAX_PARTICLES];
 
-void randomizeAttractionFactorMatrix()
+// Moves the particles around so the ones in each cell sit next to each other, in the order the
+// cells are stored, and points the cells at their new indices. The retiring ones stay at the
+// end for UpdateFades(), in the order they were in.
+void SortParticlesByCell()
 {
-    for (int i = 0; i < MAX_COLOR_GROUPS; i++)
+    const uint16_t unplaced = UINT16_MAX;
+    for (int i = 0; i < retireFrom; i++)
+        newIndices[i] = unplaced;
+    for (int i = retireFrom; i < activeParticleCount; i++)
+        newIndices[i] = i;
+
+    int next = 0;
+    for (int slot = 0; slot < cellCount; slot++)
     {
-        for (int j = 0; j < MAX_COLOR_GROUPS; j++)
+        for (int p = 0; p < cells[slot].particleCount; p++)
         {
-            attractionFactorMatrix[j][i] = RandFloat(-1.0, 1.0);
+            uint16_t i = cells[slot].particleIndices[p];
+            if (i < retireFrom)
+                newIndices[i] = next++;
+        }
+    }
+    // Whatever didn't fit in its cell still needs a place
+    for (int i = 0; i < retireFrom; i++)
+    {
+        if (newIndices[i] == unplaced)
+            newIndices[i] = next++;
+    }
+
+    if (compactState)
+    {
+        for (int i = 0; i < retireFrom; i++)
+        {
+            sortedCompactParticles[newIndices[i]] = compactParticles[i];
+            sortedCompactColds[newIndices[i]] = compactColds[i];
         }
+        memcpy(compactParticles, sortedCompactParticles, retireFrom * sizeof(CompactParticle));
+        memcpy(compactColds, sortedCompactColds, retireFrom * sizeof(ColdParticle));
+    }
+    else
+    {
+        for (int i = 0; i < retireFrom; i++)
+            sortedParticles[newIndices[i]] = particles[i];
+        memcpy(particles, sortedParticles, retireFrom * sizeof(Particle));
+    }
+    for (int slot = 0; slot < cellCount; slot++)
+    {
+        for (int p = 0; p < cells[slot].particleCount; p++)
+            cells[slot].particleIndices[p] = newIndices[cells[slot].particleIndices[p]];
     }
 }
 
-static void initialize()
+// Cells stay as close to square as the panel allows
+void SetGridHeight(int height)
 {
-    // Initialize the particles with random positions, velocities, and colors
-    for (int i = 0; i < MAX_PARTICLES; i++)
+    cellGridHeight = height;
+    cellGridWidth = height * CANVAS_WIDTH / CANVAS_HEIGHT; // Rounds down so cells are never narrower than they are tall
+    cellWidth = worldWidth / cellGridWidth;
+    cellHeight = worldHeight / cellGridHeight;
+    cellCount = cellGridWidth * cellGridHeight;
+
+    // Hand out the slots in layout order. The Morton curve covers a power of two square, so
+    // skip the codes that land off the grid.
+    int slot = 0;
+    int side = 1;
+    while (side < cellGridWidth || side < cellGridHeight)
+        side *= 2;
+    for (int order = 0; order < side * side && slot < cellCount; order++)
     {
-        particles[i].position = {RandFloat(0, CANVAS_ASPECT_RATIO), RandFloat(0, 1)};
-        particles[i].velocity = {RandFloat(-10, 10), RandFloat(-10, 10)};
-        //particles[i].velocity = {RandFloat(-1, 1), RandFloat(-1, 1)};
-        //particles[i].velocity = {0.0, 0.0};
-
-        particles[i].colorGroup = (ColorGroup)RandByte(GROUP_RED, MAX_COLOR_GROUPS - 1);
+        int row = order / side;
+        int col = order % side;
+        if (simConfig.layout == LAYOUT_MORTON)
+        {
+            row = col = 0;
+            for (int bit = 0; (1 << bit) < side; bit++)
+            {
+                col |= ((order >> (2 * bit)) & 1) << bit;
+                row |= ((order >> (2 * bit + 1)) & 1) << bit;
+            }
+        }
+        if (row >= cellGridHeight || col >= cellGridWidth)
+            continue;
+        cellSlots[row][col] = slot;
+        slotRows[slot] = row;
+        slotCols[slot] = col;
+        slot++;
     }
 
-    // randomizeAttractionFactorMatrix();
-    attractionFactorMatrix[0][0] = 1.0;
-    attractionFactorMatrix[0][1] = -1.0;
-    attractionFactorMatrix[1][0] = 0.2;
-    attractionFactorMatrix[1][1] = 0.0;
+    // Every cell that has a point within maxDistance of some point in the middle cell
+    int reachRows = (int)ceilf(maxDistance / cellHeight);
+    int reachCols = (int)ceilf(maxDistance / cellWidth);
+    stencilSize = 0;
+    for (int r = -reachRows; r <= reachRows; r++)
+    {
+        for (int c = -reachCols; c <= reachCols; c++)
+        {
+            float gapX = (abs(c) > 1) ? (abs(c) - 1) * cellWidth : 0.0f;
+            float gapY = (abs(r) > 1) ? (abs(r) - 1) * cellHeight : 0.0f;
+            if (gapX * gapX + gapY * gapY < maxDistance * maxDistance)
+                stencil[stencilSize++] = {(int8_t)r, (int8_t)c};
+        }
+    }
 }
 
-int millis(){
-    struct timeval tp;
-    gettimeofday(&tp, NULL);
-    return (int)(tp.tv_sec * 1000 + tp.tv_usec / 1000);
+void PrintStats()
+{
+    float rejected = (frameStats.candidatePairs > 0) ? 1.0 - (float)frameStats.pairsInRange / frameStats.candidatePairs : 0.0;
+    printf("pairs %ld, in range %ld (%.0f%% rejected), dropped %d, wrap shifts %d\n",
+           frameStats.candidatePairs, frameStats.pairsInRange, rejected * 100, frameStats.droppedParticles, frameStats.wrapShifts);
+    printf("cells %dx%d, stencil %d, cell pairs culled %d of %d\n", cellGridWidth, cellGridHeight, stencilSize,
+           frameStats.culledCellPairs, cellGridWidth * cellGridHeight * stencilSize);
+    printf("cells max %d, mean %.1f, occupancy", frameStats.maxCellOccupancy, frameStats.meanCellOccupancy);
+    for (int b = 0; b < OCCUPANCY_BUCKETS; b++)
+    {
+        printf(" %d", frameStats.occupancyHistogram[b]);
+    }
+    printf("\n");
+    if (frameStats.forceThreads > 1)
+    {
+        int64_t busy = 0;
+        printf("force pass %.3f ms on %d threads (%s", frameStats.forcePassTime / 1e6, frameStats.forceThreads, scheduleNames[simConfig.schedule]);
+        if (simConfig.schedule == SCHEDULE_STEALING)
+            printf(", %d tasks, %d stolen", frameStats.forceTasks, frameStats.stolenTasks);
+        printf("), busy");
+        for (int t = 0; t < frameStats.forceThreads; t++)
+        {
+            printf(" %.3f", frameStats.threadBusy[t] / 1e6);
+            busy += frameStats.threadBusy[t];
+        }
+        printf(" ms, %.0f%% used\n", frameStats.forcePassTime > 0 ? 100.0 * busy / frameStats.forcePassTime / frameStats.forceThreads : 0.0);
+    }
 }
 
-void loop()
+// Counted by each thread walking the pairs, then merged into frameStats
+struct PairCounters
 {
-    // Update time
-    static unsigned long prevMillis = 0;
-    unsigned long currentMillis = millis();
-    float deltaTime = (currentMillis - prevMillis) / 1000.0f;
-    prevMillis = currentMillis;
+    long candidatePairs;
+    long pairsInRange;
+    long wrapShifts;
+    long culledCellPairs;
+};
 
-    canvas->Fill(0, 10, 60);
+// --deterministic adds up each particle's forces in fixed point, so the total comes out the same
+// whatever order the pairs are visited in. In float the last bits of the total depend on the
+// order, which changes with the grid size, the cell layout and sorting the particles, and a
+// world that differs in the last bits goes its own way within a few hundred steps. Threads
+// don't change the order either way: each particle's pairs are walked by one thread in order.
+#define FORCE_FIXED_ONE 4294967296.0 // 2^32. Each pair's force is rounded to a multiple of 1 / this.
+bool deterministicForces = false;
 
-    //canvas->SetPixel(0, 0, 255, 255, 255);
+struct ForceSum
+{
+    Vector2 total;
+    int64_t fixedX;
+    int64_t fixedY;
+};
 
-    UpdateGrid();
+void AddPairForce(ForceSum *sum, Vector2 force)
+{
+    if (deterministicForces)
+    {
+        sum->fixedX += llrint(force.x * FORCE_FIXED_ONE);
+        sum->fixedY += llrint(force.y * FORCE_FIXED_ONE);
+    }
+    else
+    {
+        sum->total = Vector2Add(sum->total, force);
+    }
+}
 
-    // Update each particle, one cell at a time
-    for (int r = 0; r < CELL_GRID_HEIGHT; r++)
-    {
-     for (int c = 0; c < CELL_GRID_WIDTH; c++)
-     {
-         // Get list of the 8 neighboring cells and itself
-         Cell *neighborCells[9];
-         CellWrap neighborCellWraps[9];
-         InitCellWraps(neighborCellWraps, 9);
-         GetNeighborCells(neighborCells, r, c, neighborCellWraps);
-
-         // Go through every particle in this cell (as subjects)
-         for (int pI = 0; pI < grid[r][c].particleCount; pI++)
-         {
-             uint16_t i = grid[r][c].particleIndices[pI];
-             // Vector2 totalForce = {0.0, 0.0}; // Will be accumulated when looping through neighbors
-             // // Go through each neighboring cell
-             // for (int n = 0; n < 9; n++)
-             // {
-             //  // Go through every particle in this cell (as objects)
-             //  for (int pJ = 0; pJ < neighborCells[n]->particleCount; pJ++)
-             //  {
-             //      uint16_t j = neighborCells[n]->particleIndices[pJ];
-             //      if (&particles[j] == &particles[i])
-             //          continue;
-
-             //      Vector2 particleObjPercievedPos = particles[j].position;
-             //      // Offset location if it's wrapped
-             //      if (neighborCellWraps[n].wrappedLeft)
-             //      {
-             //          // TODO: let these not be constants. Should be aspect ratio (width of field in particle's float coord system)
-             //          particleObjPercievedPos.x -= CANVAS_ASPECT_RATIO;
-             //      }
-             //      if (neighborCellWraps[n].wrappedRight)
-             //      {
-             //          particleObjPercievedPos.x += CANVAS_ASPECT_RATIO;
-             //      }
-             //      if (neighborCellWraps[n].wrappedTop)
-             //      {
-             //          particleObjPercievedPos.y -= 1.0;
-             //      }
-             //      if (neighborCellWraps[n].wrappedBottom)
-             //      {
-             //          particleObjPercievedPos.y += 1.0;
-             //      }
-
-             //      // Only deal with neighbors within sphere of influence
-             //      Vector2 delta = Vector2Subtract(particles[i].position, particleObjPercievedPos);
-             //      float distance = Vector2Length(delta);
-             //      if (distance > 0.0 && distance < maxDistance)
-             //      {
-             //          // How hard do I need to move?
-             //          float forceMag = AttractionForceMag(distance / maxDistance, attractionFactorMatrix[particles[i].colorGroup][particles[j].colorGroup]);
-
-             //          // Where do I need to move?
-             //          // Normalize then scale by force magnitude
-             //          Vector2 force = Vector2Scale(delta, -1.0 / distance * forceMag);
-             //          totalForce = Vector2Add(totalForce, force);
-             //      }
-             //  }
-             // }
-
-             // totalForce = Vector2Scale(totalForce, maxDistance * forceFactor);
-
-             // particles[i].velocity = Vector2Scale(particles[i].velocity, frictionFactor);
-             // particles[i].velocity = Vector2Add(particles[i].velocity, Vector2Scale(totalForce, deltaTime));
-
-             // Update the particle's position based on its velocity
-             particles[i].position.x += particles[i].velocity.x * deltaTime;
-             particles[i].position.y += particles[i].velocity.y * deltaTime;
-
-             // If the particle goes off the screen, wrap it around to the other side
-             if (particles[i].position.x < 0.01)
-                 particles[i].position.x = 1.99;
-             if (particles[i].position.x > 2)
-                 particles[i].position.x = 0.01;
-             if (particles[i].position.y < 0.01)
-                 particles[i].position.y = 0.99;
-             if (particles[i].position.y > 1)
-                 particles[i].position.y = 0.01;
-         }
-     }
+Vector2 ForceSumTotal(const ForceSum &sum)
+{
+    if (!deterministicForces)
+        return sum.total;
+    return {(float)(sum.fixedX / FORCE_FIXED_ONE), (float)(sum.fixedY / FORCE_FIXED_ONE)};
+}
+
+// The original kernel: every pair checks which way its cell is wrapped
+Vector2 ForceWrapFlags(uint16_t i, Cell **neighborCells, CellWrap *neighborCellWraps, int neighborCount, PairCounters *counters)
+{
+    ForceSum totalForce = {};
+    // Go through each neighboring cell
+    for (int n = 0; n < neighborCount; n++)
+    {
+        counters->candidatePairs += neighborCells[n]->particleCount;
+        // Go through every particle in this cell (as objects)
+        for (int pJ = 0; pJ < neighborCells[n]->particleCount; pJ++)
+        {
+            uint16_t j = neighborCells[n]->particleIndices[pJ];
+            if (j == i)
+                continue;
+
+            Vector2 particleObjPercievedPos = particles[j].position;
+            // Offset location if it's wrapped
+            if (neighborCellWraps[n].wrappedLeft)
+            {
+                particleObjPercievedPos.x -= worldWidth;
+            }
+            if (neighborCellWraps[n].wrappedRight)
+            {
+                particleObjPercievedPos.x += worldWidth;
+            }
+            if (neighborCellWraps[n].wrappedTop)
+            {
+                particleObjPercievedPos.y -= worldHeight;
+            }
+            if (neighborCellWraps[n].wrappedBottom)
+            {
+                particleObjPercievedPos.y += worldHeight;
+            }
+
+            // Only deal with neighbors within sphere of influence
+            Vector2 delta = Vector2Subtract(particles[i].position, particleObjPercievedPos);
+            float distance = Vector2Length(delta);
+            if (distance > 0.0 && distance < maxDistance)
+            {
+                // How hard do I need to move?
+                float forceMag = AttractionForceMag(distance / maxDistance, attractionFactorMatrix[particles[i].colorGroup][particles[j].colorGroup]);
+
+                // Where do I need to move?
+                // Normalize then scale by force magnitude
+                Vector2 force = Vector2Scale(delta, -1.0 / distance * forceMag);
+                AddPairForce(&totalForce, force);
+                counters->pairsInRange++;
+            }
+        }
     }
+    return ForceSumTotal(totalForce);
+}
 
-    // Draw each particle
-    for (int i = 0; i < MAX_PARTICLES; i++)
+// Shifts each neighbor cell once instead of checking flags per pair, and only takes
+// the square root for pairs that turn out to be in range
+Vector2 ForceCellShift(uint16_t i, Cell **neighborCells, const Vector2 *shifts, int neighborCount, PairCounters *counters)
+{
+    const float maxDistanceSquared = maxDistance * maxDistance;
+    Vector2 subjectPos = particles[i].position;
+    const float *attractionRow = attractionFactorMatrix[particles[i].colorGroup];
+    ForceSum totalForce = {};
+    for (int n = 0; n < neighborCount; n++)
     {
-     // Scale from world space to screen space
-     Vector2 posOnScreen = {particles[i].position.x * CANVAS_WIDTH / (CANVAS_ASPECT_RATIO), particles[i].position.y * CANVAS_HEIGHT};
-     DrawPoint(posOnScreen, ColorGroupColors[particles[i].colorGroup]);
-     // char report[64];
-     // sprintf(report, "%d: %d, %d; ",  i, (int)posOnScreen.x, (int)posOnScreen.y);
-     // Serial.println(report);
-     //Color color = ColorGroupColors[particles[i].colorGroup];
-     //canvas->SetPixel(posOnScreen.x, posOnScreen.y, color.r, color.g, color.b);
+        Cell *neighbor = neighborCells[n];
+        counters->candidatePairs += neighbor->particleCount;
+        for (int pJ = 0; pJ < neighbor->particleCount; pJ++)
+        {
+            uint16_t j = neighbor->particleIndices[pJ];
+            Vector2 objectPos = {particles[j].position.x + shifts[n].x, particles[j].position.y + shifts[n].y};
+            Vector2 delta = Vector2Subtract(subjectPos, objectPos);
+            float distanceSquared = delta.x * delta.x + delta.y * delta.y;
+            // Also skips the subject itself, which is the only particle at distance 0 that matters
+            if (distanceSquared > 0.0f && distanceSquared < maxDistanceSquared)
+            {
+                float distance = sqrtf(distanceSquared);
+                float forceMag = AttractionForceMag(distance / maxDistance, attractionRow[particles[j].colorGroup]);
+                AddPairForce(&totalForce, Vector2Scale(delta, -1.0 / distance * forceMag));
+                counters->pairsInRange++;
+            }
+        }
     }
+    return ForceSumTotal(totalForce);
+}
 
-   
-    canvas = matrix->SwapOnVSync(canvas);
+// ForceCellShift() on compactParticles, whichever kernel was tuned. The distances are worked
+// out in whole steps, which is exact, and only turned into floats once they are known.
+Vector2 ForceCompact(uint16_t i, Cell **neighborCells, const Vector2 *shifts, int neighborCount, PairCounters *counters)
+{
+    const float stepX = worldWidth / COMPACT_POSITION_STEPS;
+    const float stepY = worldHeight / COMPACT_POSITION_STEPS;
+    const float maxDistanceSquared = maxDistance * maxDistance;
+    const CompactParticle subject = compactParticles[i];
+    const float *attractionRow = attractionFactorMatrix[subject.colorGroup];
+    ForceSum totalForce = {};
+    for (int n = 0; n < neighborCount; n++)
+    {
+        Cell *neighbor = neighborCells[n];
+        counters->candidatePairs += neighbor->particleCount;
+        // The wrap moves the neighbor by a whole world, so its particles are that many steps further
+        int32_t subjectX = subject.x - (shifts[n].x > 0.0f ? COMPACT_POSITION_STEPS : (shifts[n].x < 0.0f ? -COMPACT_POSITION_STEPS : 0));
+        int32_t subjectY = subject.y - (shifts[n].y > 0.0f ? COMPACT_POSITION_STEPS : (shifts[n].y < 0.0f ? -COMPACT_POSITION_STEPS : 0));
+        for (int pJ = 0; pJ < neighbor->particleCount; pJ++)
+        {
+            const CompactParticle object = compactParticles[neighbor->particleIndices[pJ]];
+            Vector2 delta = {(subjectX - object.x) * stepX, (subjectY - object.y) * stepY};
+            float distanceSquared = delta.x * delta.x + delta.y * delta.y;
+            if (distanceSquared > 0.0f && distanceSquared < maxDistanceSquared)
+            {
+                float distance = sqrtf(distanceSquared);
+                float forceMag = AttractionForceMag(distance / maxDistance, attractionRow[object.colorGroup]);
+                AddPairForce(&totalForce, Vector2Scale(delta, -1.0 / distance * forceMag));
+                counters->pairsInRange++;
+            }
+        }
+    }
+    return ForceSumTotal(totalForce);
 }
 
-int main(int argc, char *argv[]) {
-    RGBMatrix::Options matrix_options;
-    RuntimeOptions runtime_opt;
-    if (!ParseOptionsFromFlags(&argc, &argv,
-                                         &matrix_options, &runtime_opt)) {
-        return 1;
+// Works out the force on particles [firstParticle, endParticle) of the cell in slot.
+// Only reads positions, so threads can do this for different particles at the same time.
+void AccumulateCellForces(int slot, int firstParticle, int endParticle, PairCounters *counters)
+{
+    int r = slotRows[slot];
+    int c = slotCols[slot];
+    Cell *cell = &cells[slot];
+    // A cell split between tasks is only counted once
+    bool countCulled = firstParticle == 0;
+    if (cell->particleCount == 0)
+    {
+        counters->culledCellPairs += stencilSize;
+        return;
     }
-  
-    matrix = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
-    if (matrix == NULL)
+
+    // Get list of the neighboring cells and itself
+    Cell *neighborCells[MAX_STENCIL_CELLS];
+    CellWrap neighborCellWraps[MAX_STENCIL_CELLS];
+    int stencilCells = GetNeighborCells(neighborCells, r, c, neighborCellWraps);
+
+    // Keep only the neighbors that have a particle within reach of the box around
+    // this cell's particles, packed to the front of the lists
+    Vector2 shifts[MAX_STENCIL_CELLS];
+    int neighborCount = 0;
+    int shiftedParticles = 0;
+    for (int n = 0; n < stencilCells; n++)
     {
-        return 1;
+        Cell *neighbor = neighborCells[n];
+        Vector2 shift;
+        shift.x = neighborCellWraps[n].wrappedLeft ? -worldWidth : (neighborCellWraps[n].wrappedRight ? worldWidth : 0.0f);
+        shift.y = neighborCellWraps[n].wrappedTop ? -worldHeight : (neighborCellWraps[n].wrappedBottom ? worldHeight : 0.0f);
+        float gapX = fmaxf(0.0f, fmaxf(neighbor->boundsMin.x + shift.x - cell->boundsMax.x, cell->boundsMin.x - neighbor->boundsMax.x - shift.x));
+        float gapY = fmaxf(0.0f, fmaxf(neighbor->boundsMin.y + shift.y - cell->boundsMax.y, cell->boundsMin.y - neighbor->boundsMax.y - shift.y));
+        if (neighbor->particleCount == 0 || gapX * gapX + gapY * gapY >= maxDistance * maxDistance)
+        {
+            if (countCulled)
+                counters->culledCellPairs++;
+            continue;
+        }
+        neighborCells[neighborCount] = neighbor;
+        neighborCellWraps[neighborCount] = neighborCellWraps[n];
+        shifts[neighborCount] = shift;
+        neighborCount++;
+        if (shift.x != 0.0f || shift.y != 0.0f)
+            shiftedParticles += neighbor->particleCount;
     }
-    canvas = matrix->CreateFrameCanvas();
 
+    // Go through this task's particles in this cell (as subjects)
+    for (int pI = firstParticle; pI < endParticle; pI++)
+    {
+        uint16_t i = cell->particleIndices[pI];
+        Vector2 totalForce;
+        if (compactState)
+            totalForce = ForceCompact(i, neighborCells, shifts, neighborCount, counters);
+        else if (simConfig.kernel == KERNEL_CELL_SHIFT)
+            totalForce = ForceCellShift(i, neighborCells, shifts, neighborCount, counters);
+        else
+            totalForce = ForceWrapFlags(i, neighborCells, neighborCellWraps, neighborCount, counters);
+        counters->wrapShifts += shiftedParticles;
+
+        Vector2 force = Vector2Scale(totalForce, maxDistance * forceFactor);
+        if (compactState)
+            compactColds[i].force = force;
+        else
+            particles[i].force = force;
+    }
+}
 
-    // It is always good to set up a signal handler to cleanly exit when we
-    // receive a CTRL-C for instance. The DrawOnCanvas() routine is looking
-    // for that.
-    signal(SIGTERM, InterruptHandler);
-    signal(SIGINT, InterruptHandler);
+// Works out the force on every particle in the cells in slots [firstSlot, endSlot)
+void AccumulateForces(int firstSlot, int endSlot, PairCounters *counters)
+{
+    for (int slot = firstSlot; slot < endSlot; slot++)
+        AccumulateCellForces(slot, 0, cells[slot].particleCount, counters);
+}
 
-    initialize();
-    while (!interrupt_received)
+// What the frame loop uses gets touched before it starts, so its first frames don't wait on page
+// faults even where mlockall() fails. PrefaultMemory() touches the statics it lists and every
+// buffer that was allocated for the loop and handed to AddPrefaultRegion(). A buffer added after
+// that is touched straight away. Threads the loop waits on call PrefaultStack() when they start.
+#define MAX_PREFAULT_REGIONS 16
+struct PrefaultRegion
+{
+    void *start;
+    size_t size;
+};
+struct Prefault
+{
+    PrefaultRegion regions[MAX_PREFAULT_REGIONS];
+    int regionCount;
+    bool done; // PrefaultMemory() has run
+};
+Prefault prefault = {{}, 0, false};
+
+// Reading and writing back keeps the values but forces every page to be mapped
+void TouchPages(void *start, size_t size)
+{
+    volatile uint8_t *bytes = (volatile uint8_t *)start;
+    for (size_t i = 0; i < size; i += 4096)
+        bytes[i] = bytes[i];
+    // The start needn't be on a page boundary, so the loop can stop short of the last page
+    if (size > 0)
+        bytes[size - 1] = bytes[size - 1];
+}
+
+// For buffers that live as long as the program. Call it before another thread uses the buffer.
+void AddPrefaultRegion(void *start, size_t size)
+{
+    if (start == NULL)
+        return;
+    if (prefault.done)
     {
-        loop();
+        TouchPages(start, size);
+        return;
+    }
+    if (prefault.regionCount == MAX_PREFAULT_REGIONS)
+    {
+        fprintf(stderr, "prefault: no room for another buffer, raise MAX_PREFAULT_REGIONS\n");
+        return;
+    }
+    prefault.regions[prefault.regionCount++] = {start, size};
+}
+
+// Touches every page of stack we might use, so it is already mapped (and locked) before the first frame
+void PrefaultStack()
+{
+    unsigned char stack[STACK_PREFAULT_SIZE];
+    memset(stack, 0, sizeof(stack));
+}
+
+// Where the sim threads run. With --realtime and --sim-cpu the main thread is pinned to cpus[0]
+// and worker i to cpus[i]. Set by EnterRealtimeMode(), before any worker is started.
+struct SimPlacement
+{
+    bool realtime; // Running under SCHED_FIFO
+    int cpus[MAX_SIM_THREADS];
+    int cpuCount; // 0 when the threads aren't pinned
+};
+SimPlacement simPlacement = {false, {}, 0};
+
+// Threads that share the force pass with the main thread. They sleep between steps.
+struct SimWorkers
+{
+    pthread_t threads[MAX_SIM_THREADS - 1];
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    long generation; // Bumped for every step handed out
+    long startGeneration[MAX_SIM_THREADS]; // What generation was when each worker was started
+    int pending;     // Workers that haven't finished the current step
+    int threadCount; // Threads sharing the current step, counting the main one
+    void (*job)(int thread, int threadCount); // What each of them does
+    PairCounters counters[MAX_SIM_THREADS]; // Stored once per step, see ForceJob()
+    int64_t busy[MAX_SIM_THREADS]; // Nanoseconds each spent on the force pass
+};
+SimWorkers simWorkers = {{}, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, {}, 0, 1, NULL, {}, {}};
+
+// Cells are split as evenly as they go, in the order they are stored
+int FirstSlotFor(int thread, int threadCount)
+{
+    return thread * cellCount / threadCount;
+}
+
+void *SimWorkerMain(void *arg)
+{
+    int index = (int)(intptr_t)arg;
+    if (prefault.done)
+        PrefaultStack();
+    pthread_mutex_lock(&simWorkers.lock);
+    // Not the current generation: a step may have been handed out before this thread got going
+    long seen = simWorkers.startGeneration[index];
+    while (true)
+    {
+        while (simWorkers.generation == seen)
+            pthread_cond_wait(&simWorkers.wake, &simWorkers.lock);
+        seen = simWorkers.generation;
+        int threadCount = simWorkers.threadCount;
+        void (*job)(int, int) = simWorkers.job;
+        pthread_mutex_unlock(&simWorkers.lock);
+
+        if (index < threadCount)
+            job(index, threadCount);
+
+        pthread_mutex_lock(&simWorkers.lock);
+        if (--simWorkers.pending == 0)
+            pthread_cond_signal(&simWorkers.done);
+    }
+    return NULL;
+}
+
+// Starts enough workers for threadCount threads in total. They inherit our scheduling, and in
+// realtime mode each is pinned to its own CPU from simPlacement, so start them after
+// EnterRealtimeMode. Workers sharing a core with a SCHED_FIFO thread would only run once it blocks.
+void StartSimWorkers(int threadCount)
+{
+    if (simPlacement.cpuCount > 0 && threadCount > simPlacement.cpuCount)
+        threadCount = simPlacement.cpuCount;
+    while (simWorkers.started < threadCount - 1)
+    {
+        int index = simWorkers.started + 1;
+        simWorkers.startGeneration[index] = simWorkers.generation;
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        if (simPlacement.cpuCount > 0)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(simPlacement.cpus[index], &cpus);
+            pthread_attr_setaffinity_np(&attributes, sizeof(cpus), &cpus);
+        }
+        int err = pthread_create(&simWorkers.threads[simWorkers.started], &attributes, SimWorkerMain, (void *)(intptr_t)index);
+        pthread_attr_destroy(&attributes);
+        if (err != 0)
+        {
+            fprintf(stderr, "can't start sim thread %d (%s)\n", index, strerror(err));
+            return;
+        }
+        simWorkers.started++;
+    }
+}
+
+// How many threads a step can share: what simConfig asks for, if there are workers and cells enough
+int SimThreadCount()
+{
+    int threadCount = simConfig.threads;
+    if (threadCount > cellCount)
+        threadCount = cellCount;
+    if (threadCount > simWorkers.started + 1)
+        threadCount = simWorkers.started + 1;
+    return threadCount;
+}
+
+// Runs job on threadCount threads, the main one being thread 0, and waits for all of them
+void RunOnSimThreads(void (*job)(int thread, int threadCount), int threadCount)
+{
+    if (threadCount > 1)
+    {
+        pthread_mutex_lock(&simWorkers.lock);
+        simWorkers.threadCount = threadCount;
+        simWorkers.job = job;
+        simWorkers.pending = simWorkers.started;
+        simWorkers.generation++;
+        pthread_cond_broadcast(&simWorkers.wake);
+        pthread_mutex_unlock(&simWorkers.lock);
+    }
+    job(0, threadCount);
+    if (threadCount > 1)
+    {
+        pthread_mutex_lock(&simWorkers.lock);
+        while (simWorkers.pending > 0)
+            pthread_cond_wait(&simWorkers.done, &simWorkers.lock);
+        pthread_mutex_unlock(&simWorkers.lock);
+    }
+}
+
+void ForceJob(int thread, int threadCount)
+{
+    int64_t start = nanos();
+    // Counted on our own stack. The threads' counters share cache lines, and bumping them once
+    // per pair would have the cores passing those lines back and forth all pass long.
+    PairCounters counters = {};
+    AccumulateForces(FirstSlotFor(thread, threadCount), FirstSlotFor(thread + 1, threadCount), &counters);
+    simWorkers.counters[thread] = counters;
+    simWorkers.busy[thread] = nanos() - start;
+}
+
+// Work stealing. Each cell is a task, and a cell with more than its share of the pairs is split
+// into tasks over runs of its particles. The tasks are dealt out in slot order, so each thread
+// starts with a run of cells next to each other that adds up to an even share of the pairs.
+// A thread works from the front of its own deque, and once that is empty it takes tasks from
+// the back of the others'. No task is added once the pass has started, so a thread that finds
+// every deque empty is done.
+#define MAX_FORCE_TASKS (MAX_CELLS + MAX_SIM_THREADS * TASKS_PER_THREAD)
+struct ForceTask
+{
+    uint16_t slot;
+    uint8_t firstParticle;
+    uint8_t endParticle;
+};
+ForceTask forceTasks[MAX_FORCE_TASKS];
+int forceTaskCount;
+
+// A thread's tasks are forceTasks[front, back). Both are packed into one word, so the owner
+// taking from the front and a thief taking from the back can't both get the last task.
+struct alignas(64) TaskDeque
+{
+    uint64_t range; // front in the low half, back in the high half
+    int stolen;     // Tasks this thread took from others
+};
+TaskDeque taskDeques[MAX_SIM_THREADS];
+
+bool TakeTask(TaskDeque *deque, bool fromFront, ForceTask *task)
+{
+    uint64_t range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+    while (true)
+    {
+        uint32_t front = (uint32_t)range;
+        uint32_t back = (uint32_t)(range >> 32);
+        if (front >= back)
+            return false;
+        uint32_t taken = fromFront ? front : back - 1;
+        uint64_t left = fromFront ? ((uint64_t)back << 32 | (front + 1)) : ((uint64_t)(back - 1) << 32 | front);
+        // On failure range is reloaded, so just go round again
+        if (__atomic_compare_exchange_n(&deque->range, &range, left, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            *task = forceTasks[taken];
+            return true;
+        }
+    }
+}
+
+// Cuts the force pass into tasks and deals them out. Costs are guesses at the candidate pairs:
+// a cell's particles times the particles in its stencil.
+void BuildForceTasks(int threadCount)
+{
+    int costs[MAX_CELLS];
+    int64_t totalCost = 0;
+    for (int slot = 0; slot < cellCount; slot++)
+    {
+        Cell *neighborCells[MAX_STENCIL_CELLS];
+        CellWrap neighborCellWraps[MAX_STENCIL_CELLS];
+        int stencilCells = GetNeighborCells(neighborCells, slotRows[slot], slotCols[slot], neighborCellWraps);
+        int neighbors = 0;
+        for (int n = 0; n < stencilCells; n++)
+            neighbors += neighborCells[n]->particleCount;
+        costs[slot] = cells[slot].particleCount * neighbors;
+        totalCost += costs[slot];
+    }
+
+    // Split anything bigger than this into pieces no bigger, one particle at the least
+    int64_t largest = totalCost / (threadCount * TASKS_PER_THREAD) + 1;
+    forceTaskCount = 0;
+    int thread = 0;
+    int64_t dealt = 0;
+    taskDeques[0].range = 0;
+    for (int slot = 0; slot < cellCount; slot++)
+    {
+        int count = cells[slot].particleCount;
+        if (count == 0)
+            continue;
+        int pieces = (int)((costs[slot] + largest - 1) / largest);
+        if (pieces > count)
+            pieces = count;
+        if (pieces < 1)
+            pieces = 1;
+        for (int piece = 0; piece < pieces; piece++)
+        {
+            // Move on to the next thread's deque once this one has its share
+            while (thread < threadCount - 1 && dealt >= (thread + 1) * totalCost / threadCount)
+            {
+                taskDeques[thread].range |= (uint64_t)forceTaskCount << 32;
+                thread++;
+                taskDeques[thread].range = forceTaskCount;
+            }
+            forceTasks[forceTaskCount++] = {(uint16_t)slot, (uint8_t)(piece * count / pieces), (uint8_t)((piece + 1) * count / pieces)};
+            dealt += costs[slot] / pieces;
+        }
+    }
+    taskDeques[thread].range |= (uint64_t)forceTaskCount << 32;
+    while (++thread < threadCount)
+        taskDeques[thread].range = (uint64_t)forceTaskCount << 32 | forceTaskCount;
+    for (int t = 0; t < threadCount; t++)
+        taskDeques[t].stolen = 0;
+}
+
+void StealingForceJob(int thread, int threadCount)
+{
+    int64_t start = nanos();
+    PairCounters counters = {}; // On our own stack, like ForceJob()
+    ForceTask task;
+    while (true)
+    {
+        bool found = TakeTask(&taskDeques[thread], true, &task);
+        for (int v = 1; v < threadCount && !found; v++)
+        {
+            found = TakeTask(&taskDeques[(thread + v) % threadCount], false, &task);
+            if (found)
+                taskDeques[thread].stolen++;
+        }
+        if (!found)
+            break;
+        AccumulateCellForces(task.slot, task.firstParticle, task.endParticle, &counters);
+    }
+    simWorkers.counters[thread] = counters;
+    simWorkers.busy[thread] = nanos() - start;
+}
+
+// Building the grid on every thread is a counting sort, in four passes with a wait for all the
+// threads between each. Each thread takes an even share of the particles, in pool order, and
+// counts how many of its share land in each cell. Then, a share of the cells each, the threads
+// add those counts up in thread order to get where each thread's particles start in each cell.
+// Then each thread puts its particles in. Last, a share of the cells each, the bounds. The cells
+// end up holding the same particles in the same order as FillCellsSerial() leaves them.
+struct alignas(64) GridShare
+{
+    uint16_t counts[MAX_CELLS];  // This thread's particles in each cell
+    uint16_t offsets[MAX_CELLS]; // Where the next of them goes in the cell
+    int dropped;
+};
+GridShare gridShares[MAX_SIM_THREADS];
+uint16_t particleSlots[MAX_PARTICLES]; // The cell each particle is in this step
+
+int FirstParticleFor(int thread, int threadCount)
+{
+    return thread * activeParticleCount / threadCount;
+}
+
+void GridCountJob(int thread, int threadCount)
+{
+    GridShare *share = &gridShares[thread];
+    memset(share->counts, 0, cellCount * sizeof(share->counts[0]));
+    share->dropped = 0;
+    int end = FirstParticleFor(thread + 1, threadCount);
+    for (int i = FirstParticleFor(thread, threadCount); i < end; i++)
+    {
+        int slot = CellSlotOf(ParticlePosition(i));
+        particleSlots[i] = slot;
+        share->counts[slot]++;
+    }
+}
+
+void GridOffsetJob(int thread, int threadCount)
+{
+    int end = FirstSlotFor(thread + 1, threadCount);
+    for (int slot = FirstSlotFor(thread, threadCount); slot < end; slot++)
+    {
+        int total = 0;
+        for (int t = 0; t < threadCount; t++)
+        {
+            gridShares[t].offsets[slot] = total;
+            total += gridShares[t].counts[slot];
+        }
+        if (total > MAX_PARTICLES_PER_CELL)
+        {
+            gridShares[thread].dropped += total - MAX_PARTICLES_PER_CELL;
+            total = MAX_PARTICLES_PER_CELL;
+        }
+        cells[slot].particleCount = total;
+    }
+}
+
+void GridScatterJob(int thread, int threadCount)
+{
+    GridShare *share = &gridShares[thread];
+    int end = FirstParticleFor(thread + 1, threadCount);
+    for (int i = FirstParticleFor(thread, threadCount); i < end; i++)
+    {
+        int slot = particleSlots[i];
+        int p = share->offsets[slot]++;
+        // Past the end means an earlier particle got the last place
+        if (p < MAX_PARTICLES_PER_CELL)
+            cells[slot].particleIndices[p] = i;
+    }
+}
+
+void GridBoundsJob(int thread, int threadCount)
+{
+    UpdateCellBounds(FirstSlotFor(thread, threadCount), FirstSlotFor(thread + 1, threadCount));
+}
+
+void FillCellsParallel(int threadCount)
+{
+    RunOnSimThreads(GridCountJob, threadCount);
+    RunOnSimThreads(GridOffsetJob, threadCount);
+    RunOnSimThreads(GridScatterJob, threadCount);
+    RunOnSimThreads(GridBoundsJob, threadCount);
+    for (int t = 0; t < threadCount; t++)
+        frameStats.droppedParticles += gridShares[t].dropped;
+}
+
+void UpdateGrid()
+{
+    int threadCount = SimThreadCount();
+    if (simConfig.parallelGrid && threadCount > 1)
+    {
+        FillCellsParallel(threadCount);
+    }
+    else
+    {
+        FillCellsSerial();
+        UpdateCellBounds(0, cellCount);
+    }
+
+    int occupiedTotal = 0;
+    for (int slot = 0; slot < cellCount; slot++)
+    {
+        int count = cells[slot].particleCount;
+        occupiedTotal += count;
+        if (count > frameStats.maxCellOccupancy)
+            frameStats.maxCellOccupancy = count;
+        int bucket = 0;
+        while (count > 0 && bucket < OCCUPANCY_BUCKETS - 1)
+        {
+            count >>= 1;
+            bucket++;
+        }
+        frameStats.occupancyHistogram[bucket]++;
+    }
+    frameStats.meanCellOccupancy = (float)occupiedTotal / cellCount;
+}
+
+// What a step costs to set up for the chosen integrator, worked out once per step instead of per particle
+struct IntegratorStep
+{
+    float deltaTime;
+    float decay;     // How much velocity is left after deltaTime of friction
+    float settle;     // Integral of decay over the step, in seconds
+    float driftScale; // Turns a force into how far it moves a particle during the step
+};
+
+IntegratorStep PrepareIntegratorStep(float deltaTime)
+{
+    IntegratorStep step;
+    step.deltaTime = deltaTime;
+    step.decay = expf(-damping * deltaTime);
+    step.settle = (damping > 0.0f) ? (1.0f - step.decay) / damping : deltaTime;
+    step.driftScale = (damping > 0.0f) ? (deltaTime - step.settle) / damping : 0.5f * deltaTime * deltaTime;
+    return step;
+}
+
+// Moves a particle on by one step given the force on it now. Doesn't wrap it.
+void IntegrateParticle(Particle *p, Vector2 force, const IntegratorStep &step)
+{
+    switch (integrator)
+    {
+    case INTEGRATOR_VELOCITY_VERLET:
+        // Finish the last step's kick now that the new force is known, then drift and start this step's kick
+        p->velocity = Vector2Add(p->velocity, Vector2Add(p->halfKick, Vector2Scale(force, 0.5f * step.deltaTime)));
+        p->velocity = Vector2Scale(p->velocity, step.decay);
+        p->position = Vector2Add(p->position, Vector2Add(Vector2Scale(p->velocity, step.deltaTime), Vector2Scale(force, 0.5f * step.deltaTime * step.deltaTime)));
+        p->halfKick = Vector2Scale(force, 0.5f * step.deltaTime);
+        break;
+    case INTEGRATOR_EXPONENTIAL:
+        // Exact when the force holds still over the step: velocity slides from where it was toward force / damping
+        p->position = Vector2Add(p->position, Vector2Add(Vector2Scale(p->velocity, step.settle), Vector2Scale(force, step.driftScale)));
+        p->velocity = Vector2Add(Vector2Scale(p->velocity, step.decay), Vector2Scale(force, step.settle));
+        break;
+    default:
+        p->velocity = Vector2Scale(p->velocity, step.decay);
+        p->velocity = Vector2Add(p->velocity, Vector2Scale(force, step.deltaTime));
+        p->position = Vector2Add(p->position, Vector2Scale(p->velocity, step.deltaTime));
+        break;
+    }
+}
+
+// The move pass on the compact state. A particle is turned into floats in registers, moved by
+// IntegrateParticle() and rounded straight back. A position past an edge comes round by itself.
+void IntegrateCompact(const IntegratorStep &step)
+{
+    const float stepX = worldWidth / COMPACT_POSITION_STEPS;
+    const float stepY = worldHeight / COMPACT_POSITION_STEPS;
+    const float velocityStep = COMPACT_VELOCITY_RANGE / COMPACT_VELOCITY_STEPS;
+    for (int i = 0; i < activeParticleCount; i++)
+    {
+        CompactParticle *c = &compactParticles[i];
+        ColdParticle *cold = &compactColds[i];
+        Particle p;
+        p.position = {c->x * stepX, c->y * stepY};
+        p.velocity = {c->velocityX * velocityStep, c->velocityY * velocityStep};
+        p.halfKick = cold->halfKick;
+        IntegrateParticle(&p, cold->force, step);
+        c->x = CompactCoordinate(p.position.x, worldWidth);
+        c->y = CompactCoordinate(p.position.y, worldHeight);
+        c->velocityX = CompactVelocity(p.velocity.x);
+        c->velocityY = CompactVelocity(p.velocity.y);
+        cold->halfKick = p.halfKick;
+    }
+}
+
+// Moves every particle forward by deltaTime
+void StepParticles(float deltaTime)
+{
+    memset(&frameStats, 0, sizeof(frameStats));
+    UpdateGrid();
+    if (simConfig.sortParticles)
+        SortParticlesByCell();
+    // Anything that didn't fit in its cell gets left out of the force pass, so make sure it coasts
+    for (int i = 0; i < activeParticleCount; i++)
+    {
+        if (compactState)
+            compactColds[i].force = {0.0, 0.0};
+        else
+            particles[i].force = {0.0, 0.0};
+    }
+
+    // All the forces first, so no thread reads a position that another one has already moved
+    int threadCount = SimThreadCount();
+    memset(simWorkers.counters, 0, sizeof(simWorkers.counters));
+    int64_t forceStart = nanos();
+    if (simConfig.schedule == SCHEDULE_STEALING && threadCount > 1)
+    {
+        BuildForceTasks(threadCount);
+        RunOnSimThreads(StealingForceJob, threadCount);
+        frameStats.forceTasks = forceTaskCount;
+        for (int t = 0; t < threadCount; t++)
+            frameStats.stolenTasks += taskDeques[t].stolen;
+    }
+    else
+    {
+        RunOnSimThreads(ForceJob, threadCount);
+    }
+    frameStats.forcePassTime = nanos() - forceStart;
+    frameStats.forceThreads = threadCount;
+    memcpy(frameStats.threadBusy, simWorkers.busy, threadCount * sizeof(simWorkers.busy[0]));
+    for (int t = 0; t < threadCount; t++)
+    {
+        frameStats.candidatePairs += simWorkers.counters[t].candidatePairs;
+        frameStats.pairsInRange += simWorkers.counters[t].pairsInRange;
+        frameStats.wrapShifts += simWorkers.counters[t].wrapShifts;
+        frameStats.culledCellPairs += simWorkers.counters[t].culledCellPairs;
+    }
+
+    const IntegratorStep step = PrepareIntegratorStep(deltaTime);
+    if (compactState)
+    {
+        IntegrateCompact(step);
+        return;
+    }
+    for (int i = 0; i < activeParticleCount; i++)
+    {
+        IntegrateParticle(&particles[i], particles[i].force, step);
+
+        // If the particle goes off the screen, wrap it around to the other side
+        particles[i].position.x = WrapCoordinate(particles[i].position.x, worldWidth);
+        particles[i].position.y = WrapCoordinate(particles[i].position.y, worldHeight);
+    }
+}
+
+
+void randomizeAttractionFactorMatrix()
+{
+    for (int i = 0; i < MAX_COLOR_GROUPS; i++)
+    {
+        for (int j = 0; j < MAX_COLOR_GROUPS; j++)
+        {
+            attractionFactorMatrix[j][i] = RandFloat(-1.0, 1.0);
+        }
+    }
+}
+
+static void initialize()
+{
+    // Initialize the particles with random positions, velocities, and colors
+    for (int i = 0; i < MAX_PARTICLES; i++)
+    {
+        particles[i].position = {RandFloat(0, CANVAS_ASPECT_RATIO), RandFloat(0, 1)};
+        particles[i].velocity = {RandFloat(-10, 10), RandFloat(-10, 10)};
+        //particles[i].velocity = {RandFloat(-1, 1), RandFloat(-1, 1)};
+        //particles[i].velocity = {0.0, 0.0};
+
+        particles[i].colorGroup = (ColorGroup)RandByte(GROUP_RED, MAX_COLOR_GROUPS - 1);
+        particles[i].fade = 255;
+        particles[i].halfKick = {0.0, 0.0};
+    }
+    if (compactState)
+        PackParticles(MAX_PARTICLES);
+
+    // randomizeAttractionFactorMatrix();
+    attractionFactorMatrix[0][0] = 1.0;
+    attractionFactorMatrix[0][1] = -1.0;
+    attractionFactorMatrix[1][0] = 0.2;
+    attractionFactorMatrix[1][1] = 0.0;
+}
+
+// How far each frame's start landed from where it was scheduled
+struct FrameTiming
+{
+    int64_t framePeriod; // 0 when not pacing
+    long frames;
+    int64_t worstJitter;
+    // Off by less than 50us, 100us, 250us, 500us, 1ms, 2ms, 5ms, and 5ms or more
+    long jitterHistogram[JITTER_BUCKETS];
+};
+FrameTiming frameTiming;
+const int64_t jitterBucketLimits[JITTER_BUCKETS - 1] = {50000, 100000, 250000, 500000, 1000000, 2000000, 5000000};
+
+void RecordFrameInterval(int64_t interval)
+{
+    int64_t jitter = interval - frameTiming.framePeriod;
+    if (jitter < 0)
+        jitter = -jitter;
+    if (jitter > frameTiming.worstJitter)
+        frameTiming.worstJitter = jitter;
+
+    int bucket = 0;
+    while (bucket < JITTER_BUCKETS - 1 && jitter >= jitterBucketLimits[bucket])
+        bucket++;
+    frameTiming.jitterHistogram[bucket]++;
+    frameTiming.frames++;
+}
+
+void PrintFrameTiming()
+{
+    printf("%ld frames, worst jitter %.3f ms, jitter <50us %ld, <100us %ld, <250us %ld, <500us %ld, <1ms %ld, <2ms %ld, <5ms %ld, more %ld\n",
+           frameTiming.frames, frameTiming.worstJitter / 1e6,
+           frameTiming.jitterHistogram[0], frameTiming.jitterHistogram[1], frameTiming.jitterHistogram[2], frameTiming.jitterHistogram[3],
+           frameTiming.jitterHistogram[4], frameTiming.jitterHistogram[5], frameTiming.jitterHistogram[6], frameTiming.jitterHistogram[7]);
+}
+
+// Live particles are packed into [0, activeParticleCount) with the retiring ones at the end.
+// Spawning and despawning are O(1) and never allocate. Only do either between steps: the
+// grid holds particle indices and gets rebuilt from the pool at the start of the next step.
+
+// Takes a particle out of the pool, dark so it fades in, for the caller to place (and pack,
+// with compactState on). Returns NULL when the pool is used up.
+Particle *SpawnParticle()
+{
+    if (activeParticleCount == MAX_PARTICLES)
+        return NULL;
+    int slot = activeParticleCount++;
+    // Keep the retiring particles at the end by moving the first of them behind the new one
+    if (retireFrom < slot)
+    {
+        MoveParticle(slot, retireFrom);
+        slot = retireFrom;
+    }
+    retireFrom++;
+
+    Particle *p = &particles[slot];
+    p->fade = 0;
+    p->halfKick = {0.0, 0.0};
+    return p;
+}
+
+// Somewhere random, moving in a random direction
+void SpawnRandomParticle()
+{
+    Particle *p = SpawnParticle();
+    if (p == NULL)
+        return;
+    p->position = {RandFloat(0, worldWidth), RandFloat(0, worldHeight)};
+    p->velocity = {RandFloat(-10, 10), RandFloat(-10, 10)};
+    p->colorGroup = (ColorGroup)RandByte(GROUP_RED, MAX_COLOR_GROUPS - 1);
+    if (compactState)
+        PackParticle(p - particles);
+}
+
+// Puts particle i straight back in the pool by moving another one into its slot.
+// Loops that despawn as they go should look at slot i again afterwards.
+void DespawnParticle(int i)
+{
+    if (i < retireFrom)
+    {
+        // Fill the hole from the last particle that isn't retiring, which leaves the hole at the start of the retiring ones
+        MoveParticle(i, --retireFrom);
+        i = retireFrom;
+    }
+    MoveParticle(i, --activeParticleCount);
+}
+
+// Starts the last count particles fading out. UpdateFades() despawns them once they are dark.
+void RetireParticles(int count)
+{
+    retireFrom -= count;
+    if (retireFrom < 0)
+        retireFrom = 0;
+}
+
+// Brings new particles up to full brightness and retiring ones down to nothing
+void UpdateFades()
+{
+    for (int i = 0; i < retireFrom; i++)
+    {
+        uint8_t *fade = ParticleFade(i);
+        *fade = *fade > 255 - FADE_STEP ? 255 : *fade + FADE_STEP;
+    }
+
+    if (retireFrom == activeParticleCount)
+        return;
+    bool allDark = true;
+    for (int i = retireFrom; i < activeParticleCount; i++)
+    {
+        uint8_t *fade = ParticleFade(i);
+        *fade = *fade < FADE_STEP ? 0 : *fade - FADE_STEP;
+        allDark = allDark && *fade == 0;
+    }
+    // They went out together, and they're already at the end, so they can go back in the pool together
+    if (allDark)
+        activeParticleCount = retireFrom;
+}
+
+struct Governor
+{
+    bool enabled;
+    int64_t budget;       // Nanoseconds of work a frame may take
+    int64_t averageCost;  // Smoothed nanoseconds spent stepping and drawing
+    int framesUntilChange;
+};
+Governor governor = {false, 0, 0, GOVERNOR_INTERVAL};
+
+void UpdateGovernor(int64_t frameCost)
+{
+    if (!governor.enabled)
+        return;
+    governor.averageCost += (frameCost - governor.averageCost) / 10;
+    if (governor.framesUntilChange > 0)
+    {
+        governor.framesUntilChange--;
+        return;
+    }
+    // Let the last retirement finish before deciding anything else
+    if (retireFrom != activeParticleCount)
+        return;
+
+    // Change by a few percent at a time, so a big pool doesn't take forever to fill
+    int step = activeParticleCount / 32 + 1;
+    if (governor.averageCost > governor.budget && activeParticleCount > MIN_PARTICLES)
+    {
+        if (step > activeParticleCount - MIN_PARTICLES)
+            step = activeParticleCount - MIN_PARTICLES;
+        RetireParticles(step);
+        governor.framesUntilChange = GOVERNOR_INTERVAL;
+    }
+    // A cell that is already full would leave the new ones out of the force pass
+    else if (governor.averageCost < governor.budget * GOVERNOR_HEADROOM && activeParticleCount < MAX_PARTICLES &&
+             frameStats.droppedParticles == 0)
+    {
+        for (int i = 0; i < step; i++)
+        {
+            SpawnRandomParticle();
+        }
+        governor.framesUntilChange = GOVERNOR_INTERVAL;
+    }
+}
+
+// Makes sure nothing the frame loop touches can page fault once it is running. Call it before
+// starting the sim workers, which share the statics.
+void PrefaultMemory()
+{
+    // Every static array the loop uses. Anything new it uses goes in here, or, if it is allocated,
+    // to AddPrefaultRegion().
+    const PrefaultRegion statics[] = {
+        {particles, sizeof(particles)},
+        {compactParticles, sizeof(compactParticles)},
+        {compactColds, sizeof(compactColds)},
+        {sortedParticles, sizeof(sortedParticles)},
+        {sortedCompactParticles, sizeof(sortedCompactParticles)},
+        {sortedCompactColds, sizeof(sortedCompactColds)},
+        {newIndices, sizeof(newIndices)},
+        {particleSlots, sizeof(particleSlots)},
+        {cells, sizeof(cells)},
+        {cellSlots, sizeof(cellSlots)},
+        {slotRows, sizeof(slotRows)},
+        {slotCols, sizeof(slotCols)},
+        {stencil, sizeof(stencil)},
+        {gridShares, sizeof(gridShares)},
+        {forceTasks, sizeof(forceTasks)},
+        {taskDeques, sizeof(taskDeques)},
+        {attractionFactorMatrix, sizeof(attractionFactorMatrix)},
+    };
+    for (size_t r = 0; r < sizeof(statics) / sizeof(statics[0]); r++)
+        TouchPages(statics[r].start, statics[r].size);
+    for (int r = 0; r < prefault.regionCount; r++)
+        TouchPages(prefault.regions[r].start, prefault.regions[r].size);
+    prefault.done = true;
+    canvas->Fill(0, 0, 0);
+    PrefaultStack();
+}
+
+// Makes a fresh ring for readers to find under name. Returns NULL if it can't.
+FrameRingHeader *CreateFrameRing(const char *name, int width, int height)
+{
+    size_t size = FrameRingSize(width, height);
+    // Readers still holding an old ring keep it, and see its frames stop
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        perror("shm_open");
+        return NULL;
+    }
+    if (ftruncate(fd, size) != 0)
+    {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        perror("mmap");
+        shm_unlink(name);
+        return NULL;
+    }
+    // Touches every page, so drawing into the ring never faults
+    memset(memory, 0, size);
+
+    FrameRingHeader *ring = (FrameRingHeader *)memory;
+    ring->version = FRAME_RING_VERSION;
+    ring->width = width;
+    ring->height = height;
+    ring->slotCount = FRAME_RING_SLOTS;
+    ring->slotSize = FrameRingSlotSize(width, height);
+    __atomic_store_n(&ring->magic, FRAME_RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+}
+
+// Reads a comma separated list of CPUs, like "2" or "2,0,1". Returns how many it read, or -1.
+int ParseCpuList(const char *list, int *cpus, int maxCount)
+{
+    int count = 0;
+    while (*list != '\0')
+    {
+        char *end;
+        long cpu = strtol(list, &end, 10);
+        if (end == list || cpu < 0 || cpu >= CPU_SETSIZE || count == maxCount || (*end != ',' && *end != '\0'))
+            return -1;
+        cpus[count++] = (int)cpu;
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+}
+
+// Writes which CPUs the sim threads are pinned to, e.g. "cpus 2,0,1"
+void DescribeSimCpus(char *text, size_t size)
+{
+    if (simPlacement.cpuCount == 0)
+    {
+        snprintf(text, size, "not pinned");
+        return;
+    }
+    int length = snprintf(text, size, "cpus");
+    for (int i = 0; i < simPlacement.cpuCount && length < (int)size; i++)
+        length += snprintf(text + length, size - length, i > 0 ? ",%d" : " %d", simPlacement.cpus[i]);
+}
+
+// Best effort: logs whatever it could not get and carries on without it. The main sim thread goes
+// on cpus[0]. Given just that one, each worker gets its own from the CPUs we may use, leaving out
+// the one the matrix library refreshes the panel from (the last) so it keeps that to itself.
+void EnterRealtimeMode(const int *cpus, int cpuCount, int priority)
+{
+    bool locked = true;
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        fprintf(stderr, "realtime: can't lock memory (%s), pages may still be swapped out\n", strerror(errno));
+        locked = false;
+    }
+    PrefaultMemory();
+
+    if (cpuCount > 0)
+    {
+        for (int i = 0; i < cpuCount; i++)
+            simPlacement.cpus[i] = cpus[i];
+        simPlacement.cpuCount = cpuCount;
+        cpu_set_t allowed;
+        long refreshCpu = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        if (cpuCount == 1 && refreshCpu > 0 && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        {
+            for (int cpu = 0; cpu < refreshCpu && simPlacement.cpuCount < MAX_SIM_THREADS; cpu++)
+            {
+                if (cpu != cpus[0] && CPU_ISSET(cpu, &allowed))
+                    simPlacement.cpus[simPlacement.cpuCount++] = cpu;
+            }
+        }
+
+        cpu_set_t mine;
+        CPU_ZERO(&mine);
+        CPU_SET(cpus[0], &mine);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine);
+        if (err != 0)
+        {
+            fprintf(stderr, "realtime: can't pin to CPU %d (%s)\n", cpus[0], strerror(err));
+            simPlacement.cpuCount = 0;
+        }
+        if (simPlacement.cpuCount > 0 && simPlacement.cpuCount < MAX_SIM_THREADS)
+            fprintf(stderr, "realtime: only %d CPU%s for the sim, so at most %d thread%s\n", simPlacement.cpuCount,
+                    simPlacement.cpuCount == 1 ? "" : "s", simPlacement.cpuCount, simPlacement.cpuCount == 1 ? "" : "s");
+    }
+
+    bool scheduled = false;
+    struct sched_param param;
+    param.sched_priority = priority;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0)
+        fprintf(stderr, "realtime: can't use SCHED_FIFO priority %d (%s), staying on the normal scheduler\n", priority, strerror(err));
+    else
+        scheduled = true;
+    simPlacement.realtime = scheduled;
+
+    if (err == EPERM || !locked)
+        fprintf(stderr, "realtime: run as root with --led-no-drop-privs to get everything\n");
+    char pinning[128];
+    DescribeSimCpus(pinning, sizeof(pinning));
+    printf("realtime: %s, %s, %s\n",
+           scheduled ? "SCHED_FIFO" : "normal scheduling",
+           pinning,
+           locked ? "memory locked" : "memory not locked");
+}
+
+// Names the board, so a cache file copied to a different Pi doesn't get trusted
+void GetCpuModel(char *model, size_t size)
+{
+    snprintf(model, size, "unknown");
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (cpuinfo == NULL)
+        return;
+    char line[256];
+    while (fgets(line, sizeof(line), cpuinfo))
+    {
+        // x86 only has "model name", the Pi also has a "Model" line naming the whole board
+        bool board = strncmp(line, "Model", 5) == 0;
+        if (!board && strncmp(line, "model name", 10) != 0)
+            continue;
+        char *value = strchr(line, ':');
+        if (value == NULL)
+            continue;
+        value += strspn(value, ": ");
+        value[strcspn(value, "\n")] = '\0';
+        snprintf(model, size, "%s", value);
+        if (board)
+            break;
+    }
+    fclose(cpuinfo);
+}
+
+ForceKernel KernelFromName(const char *name)
+{
+    for (int k = 0; k < KERNEL_COUNT; k++)
+    {
+        if (strcmp(name, kernelNames[k]) == 0)
+            return (ForceKernel)k;
+    }
+    return KERNEL_COUNT;
+}
+
+ForceSchedule ScheduleFromName(const char *name)
+{
+    for (int s = 0; s < SCHEDULE_COUNT; s++)
+    {
+        if (strcmp(name, scheduleNames[s]) == 0)
+            return (ForceSchedule)s;
+    }
+    return SCHEDULE_COUNT;
+}
+
+CellLayout LayoutFromName(const char *name)
+{
+    for (int l = 0; l < LAYOUT_COUNT; l++)
+    {
+        if (strcmp(name, layoutNames[l]) == 0)
+            return (CellLayout)l;
+    }
+    return LAYOUT_COUNT;
+}
+
+// Each line of the cache is "<key>\t<grid height> <kernel> <threads> <layout> <sort> <parallel grid> <schedule>".
+// The last match wins. Lines from before the last two were added leave them off.
+bool LoadTuning(const char *path, const char *key, SimConfig *config)
+{
+    FILE *cache = fopen(path, "r");
+    if (cache == NULL)
+        return false;
+    bool found = false;
+    char line[512];
+    while (fgets(line, sizeof(line), cache))
+    {
+        char *tab = strrchr(line, '\t');
+        if (tab == NULL)
+            continue;
+        *tab = '\0';
+        if (strcmp(line, key) != 0)
+            continue;
+        int height, threads, sortParticles;
+        int parallelGrid = 0;
+        char kernelName[32];
+        char layoutName[32];
+        char scheduleName[32] = "static";
+        if (sscanf(tab + 1, "%d %31s %d %31s %d %d %31s", &height, kernelName, &threads, layoutName, &sortParticles, &parallelGrid, scheduleName) < 5)
+            continue;
+        ForceKernel kernel = KernelFromName(kernelName);
+        CellLayout layout = LayoutFromName(layoutName);
+        ForceSchedule schedule = ScheduleFromName(scheduleName);
+        if (height < MIN_CELL_GRID_HEIGHT || height > MAX_CELL_GRID_HEIGHT || kernel == KERNEL_COUNT || threads < 1 || threads > MAX_SIM_THREADS ||
+            layout == LAYOUT_COUNT || schedule == SCHEDULE_COUNT)
+            continue;
+        *config = {height, kernel, threads, layout, sortParticles != 0, parallelGrid != 0, schedule};
+        found = true;
+    }
+    fclose(cache);
+    return found;
+}
+
+void SaveTuning(const char *path, const char *key, const SimConfig &config)
+{
+    FILE *cache = fopen(path, "a");
+    if (cache == NULL)
+    {
+        fprintf(stderr, "tune: can't write %s (%s)\n", path, strerror(errno));
+        return;
+    }
+    fprintf(cache, "%s\t%d %s %d %s %d %d %s\n", key, config.gridHeight, kernelNames[config.kernel], config.threads,
+            layoutNames[config.layout], config.sortParticles ? 1 : 0, config.parallelGrid ? 1 : 0, scheduleNames[config.schedule]);
+    fclose(cache);
+}
+
+void DescribeSimConfig(char *description, size_t size, const SimConfig &config)
+{
+    snprintf(description, size, "cells %dx%d, kernel %s, threads %d, %s%s%s%s", config.gridHeight * CANVAS_WIDTH / CANVAS_HEIGHT, config.gridHeight,
+             kernelNames[config.kernel], config.threads, layoutNames[config.layout], config.sortParticles ? ", sorted" : "",
+             config.parallelGrid ? ", parallel grid" : "", config.schedule == SCHEDULE_STEALING ? ", work stealing" : "");
+}
+
+// How long a step of particleCount particles takes with simConfig, averaged over TUNE_STEPS.
+// Every call starts from the same scattered world. If dropped isn't NULL, it gets how many
+// particles the timed steps left out of full cells.
+int64_t TimeSteps(int particleCount, long *dropped)
+{
+    SetGridHeight(simConfig.gridHeight);
+    activeParticleCount = particleCount;
+    retireFrom = particleCount;
+    srand(1);
+    for (int i = 0; i < particleCount; i++)
+    {
+        particles[i].position = {RandFloat(0, worldWidth), RandFloat(0, worldHeight)};
+        particles[i].velocity = {0.0, 0.0};
+        particles[i].halfKick = {0.0, 0.0};
+        particles[i].colorGroup = (ColorGroup)RandByte(GROUP_RED, MAX_COLOR_GROUPS - 1);
+    }
+    if (compactState)
+        PackParticles(particleCount);
+
+    const float stepTime = 1.0 / DEFAULT_TARGET_FPS;
+    for (int i = 0; i < TUNE_WARMUP_STEPS; i++)
+        StepParticles(stepTime);
+    long droppedTotal = 0;
+    int64_t start = nanos();
+    for (int i = 0; i < TUNE_STEPS; i++)
+    {
+        StepParticles(stepTime);
+        droppedTotal += frameStats.droppedParticles;
+    }
+    int64_t time = (nanos() - start) / TUNE_STEPS;
+    if (dropped != NULL)
+        *dropped = droppedTotal;
+    return time;
+}
+
+struct TuneCandidate
+{
+    SimConfig config;
+    int64_t time;
+    long dropped;
+};
+
+// Times each of candidates, best of repeats, and moves the TUNE_KEEP fastest of them to the
+// front, fastest first. Only the ones that drop as few particles as the best of them count: a
+// coarse grid that leaves particles out of the force pass has less to do, and mustn't win for
+// it. Returns how many were kept.
+int TuneStage(TuneCandidate *candidates, int count, int particleCount, int repeats)
+{
+    char description[128];
+    long fewestDropped = LONG_MAX;
+    for (int c = 0; c < count; c++)
+    {
+        simConfig = candidates[c].config;
+        candidates[c].time = INT64_MAX;
+        for (int run = 0; run < repeats; run++)
+        {
+            int64_t time = TimeSteps(particleCount, &candidates[c].dropped);
+            if (time < candidates[c].time)
+                candidates[c].time = time;
+        }
+        if (candidates[c].dropped < fewestDropped)
+            fewestDropped = candidates[c].dropped;
+        DescribeSimConfig(description, sizeof(description), simConfig);
+        printf("tune: %s: %.3f ms/step", description, candidates[c].time / 1e6);
+        if (candidates[c].dropped > 0)
+            printf(", dropped %ld", candidates[c].dropped);
+        printf("\n");
+    }
+
+    // Insertion sort into the front of the list. Only ever writes where it has already read.
+    int kept = 0;
+    for (int c = 0; c < count; c++)
+    {
+        if (candidates[c].dropped > fewestDropped)
+            continue;
+        TuneCandidate candidate = candidates[c];
+        int k = kept;
+        while (k > 0 && candidates[k - 1].time > candidate.time)
+        {
+            if (k < TUNE_KEEP)
+                candidates[k] = candidates[k - 1];
+            k--;
+        }
+        if (k < TUNE_KEEP)
+        {
+            candidates[k] = candidate;
+            if (kept < TUNE_KEEP)
+                kept++;
+        }
+    }
+    return kept;
+}
+
+// Picks the grid size, force kernel, thread count and cell layout that step a world of
+// particleCount particles fastest on this board, and sets simConfig to it. The answer is cached
+// in cachePath, so this only costs time the first time the program is run with these settings.
+// Leaves the particles scrambled, so initialize() afterwards.
+void AutoTune(int particleCount, const char *cachePath, bool retune)
+{
+    char model[128];
+    GetCpuModel(model, sizeof(model));
+    // Pinned threads can't spread out the way free ones can, so that is tuned for separately
+    char pinning[128];
+    DescribeSimCpus(pinning, sizeof(pinning));
+    char key[384];
+    snprintf(key, sizeof(key), "%s|cpus %ld|particles %d|groups %d|radius %.3f|rows %d-%d|cell cap %d|%s|%s",
+             model, sysconf(_SC_NPROCESSORS_ONLN), particleCount, MAX_COLOR_GROUPS, maxDistance, MIN_CELL_GRID_HEIGHT, MAX_CELL_GRID_HEIGHT,
+             MAX_PARTICLES_PER_CELL, simPlacement.realtime ? "realtime" : "normal", pinning);
+
+    char description[128];
+    if (!retune && LoadTuning(cachePath, key, &simConfig))
+    {
+        StartSimWorkers(simConfig.threads);
+        DescribeSimConfig(description, sizeof(description), simConfig);
+        printf("tune: %s (cached)\n", description);
+        return;
+    }
+
+    // One stage at a time, each trying its choices on the few best of the stage before, rather
+    // than every combination: a single timing is too noisy to rank hundreds of them by.
+    StartSimWorkers(MAX_SIM_THREADS);
+    TuneCandidate candidates[MAX_TUNE_CANDIDATES];
+    TuneCandidate next[MAX_TUNE_CANDIDATES];
+    int count = 0;
+    // The grid and the kernel, on one thread
+    for (int height = MIN_CELL_GRID_HEIGHT; height <= MAX_CELL_GRID_HEIGHT; height++)
+    {
+        for (int kernel = 0; kernel < KERNEL_COUNT; kernel++)
+            candidates[count++].config = {height, (ForceKernel)kernel, 1, LAYOUT_ROW_MAJOR, false, false, SCHEDULE_STATIC};
+    }
+    int kept = TuneStage(candidates, count, particleCount, 1);
+
+    // Where the cells and the particles sit in memory
+    count = 0;
+    for (int k = 0; k < kept; k++)
+    {
+        for (int layout = 0; layout < LAYOUT_COUNT; layout++)
+        {
+            for (int sortParticles = 0; sortParticles < 2; sortParticles++)
+            {
+                next[count].config = candidates[k].config;
+                next[count].config.layout = (CellLayout)layout;
+                next[count++].config.sortParticles = sortParticles != 0;
+            }
+        }
+    }
+    kept = TuneStage(next, count, particleCount, 1);
+
+    // How the step is shared between threads
+    count = 0;
+    for (int k = 0; k < kept; k++)
+    {
+        for (int threads = 1; threads <= MAX_SIM_THREADS && threads <= simWorkers.started + 1; threads++)
+        {
+            // With one thread both ways of building the grid are the same, and so are both schedules
+            for (int parallel = 0; parallel < (threads > 1 ? 2 * SCHEDULE_COUNT : 1); parallel++)
+            {
+                candidates[count].config = next[k].config;
+                candidates[count].config.threads = threads;
+                candidates[count].config.parallelGrid = parallel % 2 != 0;
+                candidates[count++].config.schedule = (ForceSchedule)(parallel / 2);
+            }
+        }
+    }
+    kept = TuneStage(candidates, count, particleCount, 1);
+
+    // The finalists again, a few times each, so the one that gets cached didn't win on noise
+    printf("tune: finalists, best of %d\n", TUNE_REPEATS);
+    TuneStage(candidates, kept, particleCount, TUNE_REPEATS);
+    SimConfig best = candidates[0].config;
+
+    simConfig = best;
+    SaveTuning(cachePath, key, simConfig);
+    DescribeSimConfig(description, sizeof(description), simConfig);
+    printf("tune: picked %s\n", description);
+}
+
+// Steps particleCount particles on the finest grid with each cell layout, with and without
+// sorting the particles, one thread and the cell-shift kernel, and prints what a step costs.
+// Build with -DMAX_PARTICLES=12000 to try a big wall's worth.
+void RunLayoutBench(int particleCount)
+{
+    printf("%d particles, cells %dx%d, kernel %s, 1 thread\n", particleCount, MAX_CELL_GRID_WIDTH, MAX_CELL_GRID_HEIGHT, kernelNames[KERNEL_CELL_SHIFT]);
+    for (int layout = 0; layout < LAYOUT_COUNT; layout++)
+    {
+        for (int sortParticles = 0; sortParticles < 2; sortParticles++)
+        {
+            simConfig = {MAX_CELL_GRID_HEIGHT, KERNEL_CELL_SHIFT, 1, (CellLayout)layout, sortParticles != 0, false, SCHEDULE_STATIC};
+            // Best of a few, the first run also warms up the caches
+            int64_t time = INT64_MAX;
+            for (int run = 0; run < 3; run++)
+            {
+                int64_t runTime = TimeSteps(particleCount, NULL);
+                if (runTime < time)
+                    time = runTime;
+            }
+            printf("%-10s %-9s %8.3f ms/step, dropped %d\n", layoutNames[layout], sortParticles ? "sorted" : "unsorted", time / 1e6, frameStats.droppedParticles);
+        }
+    }
+}
+
+// Builds the grid for particleCount particles on the finest grid on 1 to MAX_SIM_THREADS
+// threads and prints what a build costs and how it scales. Checks every build against
+// FillCellsSerial(). Build with -DMAX_PARTICLES=20000 -DMAX_SIM_THREADS=8 to see it on a
+// desktop.
+void RunGridBench(int particleCount)
+{
+    const int builds = 200;
+    simConfig = {MAX_CELL_GRID_HEIGHT, KERNEL_CELL_SHIFT, 1, LAYOUT_ROW_MAJOR, false, false, SCHEDULE_STATIC};
+    SetGridHeight(simConfig.gridHeight);
+    activeParticleCount = particleCount;
+    retireFrom = particleCount;
+    srand(1);
+    for (int i = 0; i < particleCount; i++)
+        particles[i].position = {RandFloat(0, worldWidth), RandFloat(0, worldHeight)};
+    if (compactState)
+        PackParticles(particleCount);
+
+    // What the serial build makes, to check the others against
+    static Cell serialCells[MAX_CELLS];
+    memset(&frameStats, 0, sizeof(frameStats));
+    UpdateGrid();
+    memcpy(serialCells, cells, sizeof(cells));
+    int serialDropped = frameStats.droppedParticles;
+
+    printf("%d particles, cells %dx%d, %d builds each, dropped %d\n", particleCount, cellGridWidth, cellGridHeight, builds, serialDropped);
+    printf("threads   build      ms   speedup   efficiency   same as serial\n");
+    int64_t serialTime = 0;
+    for (int threads = 1; threads <= simWorkers.started + 1; threads++)
+    {
+        // One thread is the serial build
+        simConfig.threads = threads;
+        simConfig.parallelGrid = threads > 1;
+        // Best of a few, the first run also warms up the caches
+        int64_t time = INT64_MAX;
+        bool same = true;
+        for (int run = 0; run < 3; run++)
+        {
+            int64_t start = nanos();
+            for (int b = 0; b < builds; b++)
+            {
+                memset(&frameStats, 0, sizeof(frameStats));
+                UpdateGrid();
+            }
+            int64_t runTime = (nanos() - start) / builds;
+            if (runTime < time)
+                time = runTime;
+            for (int slot = 0; slot < cellCount; slot++)
+            {
+                const Cell &a = cells[slot];
+                const Cell &b = serialCells[slot];
+                same = same && a.particleCount == b.particleCount &&
+                       memcmp(a.particleIndices, b.particleIndices, a.particleCount * sizeof(a.particleIndices[0])) == 0 &&
+                       memcmp(&a.boundsMin, &b.boundsMin, sizeof(Vector2)) == 0 && memcmp(&a.boundsMax, &b.boundsMax, sizeof(Vector2)) == 0;
+            }
+            same = same && frameStats.droppedParticles == serialDropped;
+        }
+        if (threads == 1)
+            serialTime = time;
+        printf("%7d   %-8s %7.3f   %7.2f   %9.0f%%   %s\n", threads, (threads > 1) ? "parallel" : "serial", time / 1e6,
+               (double)serialTime / time, 100.0 * serialTime / time / threads, same ? "yes" : "NO");
+    }
+}
+
+// Steps a world where most of particleCount particles start in a few tight clumps, on 1 to
+// MAX_SIM_THREADS threads with each schedule, and prints what the force pass costs, how much
+// of the threads' time went on it, and whether the world ended up where one thread left it.
+// Build with -DMAX_PARTICLES=12000 -DMAX_SIM_THREADS=16 to try it on a big desktop.
+void RunScheduleBench(int particleCount)
+{
+    const int clumps = 4;
+    const float clumpRadius = 0.04;
+    const int steps = 100;
+    const float stepTime = 1.0 / DEFAULT_TARGET_FPS;
+    static Vector2 reference[MAX_PARTICLES];
+
+    printf("%d particles, 3/4 in %d clumps, cells %dx%d, kernel %s, %d steps each\n", particleCount, clumps, MAX_CELL_GRID_WIDTH,
+           MAX_CELL_GRID_HEIGHT, kernelNames[KERNEL_CELL_SHIFT], steps);
+    printf("threads   schedule   force ms   used   tasks   stolen   same as 1 thread\n");
+    for (int threads = 1; threads <= simWorkers.started + 1; threads++)
+    {
+        for (int schedule = 0; schedule < (threads > 1 ? SCHEDULE_COUNT : 1); schedule++)
+        {
+            simConfig = {MAX_CELL_GRID_HEIGHT, KERNEL_CELL_SHIFT, threads, LAYOUT_ROW_MAJOR, false, false, (ForceSchedule)schedule};
+            SetGridHeight(simConfig.gridHeight);
+            activeParticleCount = particleCount;
+            retireFrom = particleCount;
+            srand(1);
+            Vector2 centers[clumps];
+            for (int k = 0; k < clumps; k++)
+                centers[k] = {RandFloat(0, worldWidth), RandFloat(0, worldHeight)};
+            for (int i = 0; i < particleCount; i++)
+            {
+                Vector2 position = {RandFloat(0, worldWidth), RandFloat(0, worldHeight)};
+                if (i % 4 != 0)
+                    position = {WrapCoordinate(centers[i % clumps].x + RandFloat(-clumpRadius, clumpRadius), worldWidth),
+                                WrapCoordinate(centers[i % clumps].y + RandFloat(-clumpRadius, clumpRadius), worldHeight)};
+                particles[i].position = position;
+                particles[i].velocity = {0.0, 0.0};
+                particles[i].halfKick = {0.0, 0.0};
+                particles[i].colorGroup = (ColorGroup)RandByte(GROUP_RED, MAX_COLOR_GROUPS - 1);
+            }
+            if (compactState)
+                PackParticles(particleCount);
+
+            int64_t forceTime = 0;
+            int64_t busy = 0;
+            long tasks = 0;
+            long stolen = 0;
+            for (int step = 0; step < steps; step++)
+            {
+                StepParticles(stepTime);
+                forceTime += frameStats.forcePassTime;
+                for (int t = 0; t < frameStats.forceThreads; t++)
+                    busy += frameStats.threadBusy[t];
+                tasks += frameStats.forceTasks;
+                stolen += frameStats.stolenTasks;
+            }
+
+            bool same = true;
+            for (int i = 0; i < particleCount; i++)
+            {
+                Vector2 position = ParticlePosition(i);
+                if (threads == 1)
+                    reference[i] = position;
+                same = same && memcmp(&reference[i], &position, sizeof(Vector2)) == 0;
+            }
+            printf("%7d   %-8s   %8.3f   %3.0f%%   %5ld   %6ld   %s\n", threads, scheduleNames[schedule], forceTime / 1e6 / steps,
+                   100.0 * busy / forceTime / threads, tasks / steps, stolen / steps, same ? "yes" : "NO");
+        }
+    }
+}
+
+// Steps particleCount particles with full and then compact state and prints what a step and
+// its force pass cost, and how many bytes the force pass reads for each particle it looks at.
+// How much the motion changes is for --check-trace to say. Build with -DMAX_PARTICLES=2400 to
+// see a world whose floats outgrow a 32 KB L1 while the compact state still fits.
+void RunCompactBench(int particleCount)
+{
+    printf("%d particles, cells %dx%d, kernel %s, 1 thread\n", particleCount, MAX_CELL_GRID_WIDTH, MAX_CELL_GRID_HEIGHT, kernelNames[KERNEL_CELL_SHIFT]);
+    printf("state     bytes   step ms   force ms\n");
+    for (int compact = 0; compact < 2; compact++)
+    {
+        compactState = compact != 0;
+        simConfig = {MAX_CELL_GRID_HEIGHT, KERNEL_CELL_SHIFT, 1, LAYOUT_ROW_MAJOR, false, false, SCHEDULE_STATIC};
+        // Best of a few, the first run also warms up the caches
+        int64_t time = INT64_MAX;
+        int64_t forceTime = INT64_MAX;
+        for (int run = 0; run < 3; run++)
+        {
+            int64_t runTime = TimeSteps(particleCount, NULL);
+            if (runTime < time)
+                time = runTime;
+            if (frameStats.forcePassTime < forceTime)
+                forceTime = frameStats.forcePassTime;
+        }
+        printf("%-7s   %5d   %7.3f   %8.3f\n", compact ? "compact" : "full", compact ? (int)sizeof(CompactParticle) : (int)sizeof(Particle),
+               time / 1e6, forceTime / 1e6);
+    }
+    compactState = false;
+}
+
+// Golden traces. A trace is a seeded world stepped TRACE_STEPS times at a fixed step, with a
+// hash of the state after every step and the whole state every TRACE_CHECKPOINT_INTERVAL steps.
+// --trace=PATH writes one, --check-trace=PATH steps the same world and says where it parts from
+// the one in the file and by how much. The particles aren't sorted while tracing, so particle i
+// is the same particle in both.
+#define TRACE_MAGIC 0x52544c50 // "PLTR"
+#define TRACE_VERSION 1
+#define TRACE_SEED 1
+#define TRACE_STEPS 1000
+#define TRACE_CHECKPOINT_INTERVAL 100
+#define TRACE_PARTICLES 300 // Change with --particles=N
+struct TraceHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t particleCount;
+    uint32_t steps;
+    uint32_t checkpointInterval;
+    uint8_t integrator;
+    uint8_t deterministic;
+    uint8_t compact;
+    uint8_t reserved[5];
+};
+// A trace has a uint64_t hash per step, each checkpoint's followed by particleCount of these
+struct TraceState
+{
+    Vector2 position;
+    Vector2 velocity;
+};
+
+// Puts particleCount particles where TRACE_SEED says, the same way every time
+void SeedTraceWorld(int particleCount)
+{
+    srand(TRACE_SEED);
+    initialize();
+    activeParticleCount = particleCount;
+    retireFrom = particleCount;
+    SetGridHeight(simConfig.gridHeight);
+}
+
+// Of the positions and velocities of all the particles, whatever order they are in
+uint64_t StateHash()
+{
+    uint64_t hash = 0;
+    for (int i = 0; i < activeParticleCount; i++)
+    {
+        TraceState state = {ParticlePosition(i), ParticleVelocity(i)};
+        const uint8_t *bytes = (const uint8_t *)&state;
+        uint64_t particleHash = 14695981039346656037ull; // FNV-1a
+        for (size_t b = 0; b < sizeof(state); b++)
+            particleHash = (particleHash ^ bytes[b]) * 1099511628211ull;
+        hash += particleHash;
+    }
+    return hash;
+}
+
+int RunTrace(const char *path, bool check, int particleCount)
+{
+    FILE *file = fopen(path, check ? "rb" : "wb");
+    if (file == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, (uint16_t)particleCount, TRACE_STEPS, TRACE_CHECKPOINT_INTERVAL,
+                          (uint8_t)integrator, deterministicForces, compactState, {}};
+    if (check)
+    {
+        TraceHeader recorded;
+        if (fread(&recorded, sizeof(recorded), 1, file) != 1 || recorded.magic != TRACE_MAGIC || recorded.version != TRACE_VERSION)
+        {
+            fprintf(stderr, "%s is not a version %d trace\n", path, TRACE_VERSION);
+            fclose(file);
+            return 1;
+        }
+        if (recorded.particleCount != header.particleCount || recorded.steps != header.steps ||
+            recorded.checkpointInterval != header.checkpointInterval || recorded.integrator != header.integrator)
+        {
+            fprintf(stderr, "%s is a trace of %u particles over %u steps with %s, this run would be %u with %s\n", path,
+                    recorded.particleCount, recorded.steps, integratorNames[recorded.integrator % INTEGRATOR_COUNT],
+                    header.particleCount, integratorNames[integrator]);
+            fclose(file);
+            return 1;
+        }
+        if (recorded.deterministic != header.deterministic)
+            printf("%s was traced %s --deterministic, this run is %s it\n", path, recorded.deterministic ? "with" : "without",
+                   deterministicForces ? "with" : "without");
+        if (recorded.compact != header.compact)
+            printf("%s was traced %s --compact, this run is %s it\n", path, recorded.compact ? "with" : "without",
+                   compactState ? "with" : "without");
+    }
+    else if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        perror(path);
+        fclose(file);
+        return 1;
+    }
+
+    simConfig.sortParticles = false;
+    char description[128];
+    DescribeSimConfig(description, sizeof(description), simConfig);
+    printf("%s %s: %d particles, %d steps, %s, %s%s%s\n", check ? "Checking" : "Tracing", path, particleCount, TRACE_STEPS,
+           integratorNames[integrator], description, deterministicForces ? ", deterministic" : "",
+           compactState ? ", compact" : "");
+    SeedTraceWorld(particleCount);
+    const float stepTime = 1.0 / DEFAULT_TARGET_FPS;
+    static TraceState states[MAX_PARTICLES];
+    long firstDifference = -1;
+    bool failed = false;
+    for (int step = 1; step <= TRACE_STEPS && !failed; step++)
+    {
+        StepParticles(stepTime);
+        uint64_t hash = StateHash();
+        bool checkpoint = step % TRACE_CHECKPOINT_INTERVAL == 0;
+        if (!check)
+        {
+            for (int i = 0; i < particleCount && checkpoint; i++)
+                states[i] = {ParticlePosition(i), ParticleVelocity(i)};
+            failed = fwrite(&hash, sizeof(hash), 1, file) != 1 ||
+                     (checkpoint && fwrite(states, sizeof(TraceState), particleCount, file) != (size_t)particleCount);
+            continue;
+        }
+
+        uint64_t recordedHash;
+        failed = fread(&recordedHash, sizeof(recordedHash), 1, file) != 1 ||
+                 (checkpoint && fread(states, sizeof(TraceState), particleCount, file) != (size_t)particleCount);
+        if (failed)
+            break;
+        if (recordedHash != hash && firstDifference < 0)
+            firstDifference = step;
+        if (!checkpoint)
+            continue;
+        // How far apart the two worlds are, across the wrap where that is shorter
+        double positionError = 0.0;
+        double worstPosition = 0.0;
+        double velocityError = 0.0;
+        for (int i = 0; i < particleCount; i++)
+        {
+            Vector2 position = ParticlePosition(i);
+            float dx = fabsf(position.x - states[i].position.x);
+            float dy = fabsf(position.y - states[i].position.y);
+            dx = fminf(dx, worldWidth - dx);
+            dy = fminf(dy, worldHeight - dy);
+            double distance = sqrt(dx * dx + dy * dy);
+            positionError += distance;
+            worstPosition = fmax(worstPosition, distance);
+            velocityError += Vector2Length(Vector2Subtract(ParticleVelocity(i), states[i].velocity));
+        }
+        printf("step %4d: %s, position error mean %.3g max %.3g, velocity error mean %.3g\n", step,
+               recordedHash == hash ? "same" : "differs", positionError / particleCount, worstPosition,
+               velocityError / particleCount);
+    }
+    fclose(file);
+    if (failed)
+    {
+        fprintf(stderr, "%s: %s\n", path, check ? "the trace ends early" : "couldn't write the trace");
+        return 1;
+    }
+    if (!check)
+        printf("Wrote %d steps\n", TRACE_STEPS);
+    else if (firstDifference < 0)
+        printf("Matches the trace bit for bit\n");
+    else
+        printf("First differs from the trace at step %ld\n", firstDifference);
+    return (check && firstDifference >= 0) ? 2 : 0;
+}
+
+// Steps the trace world once for every way of doing a step that shouldn't change what it does,
+// with float sums and then with --deterministic, and prints the first step each one parts from
+// one thread, serial grid, row-major, unsorted on a 4 row grid. A full cell leaves out whichever
+// particles come last in the pool, so once a cell overflows, the grid size and sorting change
+// which particles feel no force, and no way of adding up can hide that.
+void RunDeterminismCheck(int particleCount)
+{
+    const int steps = TRACE_STEPS;
+    const float stepTime = 1.0 / DEFAULT_TARGET_FPS;
+    static uint64_t reference[TRACE_STEPS];
+    const SimConfig base = {4, KERNEL_CELL_SHIFT, 1, LAYOUT_ROW_MAJOR, false, false, SCHEDULE_STATIC};
+    SimConfig configs[64];
+    int configCount = 0;
+    configs[configCount++] = base;
+    for (int threads = 2; threads <= simWorkers.started + 1; threads++)
+    {
+        for (int parallel = 0; parallel < 2 * SCHEDULE_COUNT; parallel++)
+        {
+            configs[configCount] = base;
+            configs[configCount].threads = threads;
+            configs[configCount].parallelGrid = parallel % 2 != 0;
+            configs[configCount++].schedule = (ForceSchedule)(parallel / 2);
+        }
+    }
+    configs[configCount] = base;
+    configs[configCount++].layout = LAYOUT_MORTON;
+    configs[configCount] = base;
+    configs[configCount++].sortParticles = true;
+    configs[configCount] = base;
+    configs[configCount++].kernel = KERNEL_WRAP_FLAGS;
+    for (int height = MIN_CELL_GRID_HEIGHT; height <= MAX_CELL_GRID_HEIGHT; height++)
+    {
+        if (height == base.gridHeight)
+            continue;
+        configs[configCount] = base;
+        configs[configCount++].gridHeight = height;
+    }
+
+    printf("%d particles, %d steps, %s. First step that differs from the first line:\n", particleCount, steps, integratorNames[integrator]);
+    printf("%-82s %6s %6s %8s\n", "", "float", "fixed", "dropped");
+    long results[64][2];
+    long dropped[64];
+    for (int fixed = 0; fixed < 2; fixed++)
+    {
+        deterministicForces = fixed != 0;
+        for (int c = 0; c < configCount; c++)
+        {
+            simConfig = configs[c];
+            SeedTraceWorld(particleCount);
+            results[c][fixed] = -1;
+            dropped[c] = 0;
+            for (int step = 0; step < steps; step++)
+            {
+                StepParticles(stepTime);
+                dropped[c] += frameStats.droppedParticles;
+                uint64_t hash = StateHash();
+                if (c == 0)
+                    reference[step] = hash;
+                else if (hash != reference[step] && results[c][fixed] < 0)
+                    results[c][fixed] = step + 1;
+            }
+        }
+    }
+    for (int c = 0; c < configCount; c++)
+    {
+        char description[128];
+        DescribeSimConfig(description, sizeof(description), configs[c]);
+        char columns[2][24];
+        for (int fixed = 0; fixed < 2; fixed++)
+            snprintf(columns[fixed], sizeof(columns[fixed]), results[c][fixed] < 0 ? "same" : "%ld", results[c][fixed]);
+        printf("%-82s %6s %6s %8ld\n", description, columns[0], columns[1], dropped[c]);
+    }
+    deterministicForces = false;
+}
+
+void loop()
+{
+    // Update time
+    static int64_t prevNanos = 0;
+    int64_t currentNanos = nanos();
+    if (prevNanos == 0)
+        prevNanos = currentNanos;
+    float deltaTime = (currentNanos - prevNanos) / 1e9f;
+    if (currentNanos != prevNanos)
+        RecordFrameInterval(currentNanos - prevNanos);
+    int64_t frameInterval = currentNanos - prevNanos;
+    prevNanos = currentNanos;
+
+    BeginFramePixels();
+    FillCanvas({0, 10, 60});
+
+    //canvas->SetPixel(0, 0, 255, 255, 255);
+
+    StepParticles(deltaTime);
+
+    // Draw each particle
+    for (int i = 0; i < activeParticleCount; i++)
+    {
+     // Scale from world space to screen space
+     Vector2 position = ParticlePosition(i);
+     Vector2 posOnScreen = {position.x * CANVAS_WIDTH / (CANVAS_ASPECT_RATIO), position.y * CANVAS_HEIGHT};
+     DrawPoint(posOnScreen, ColorMultiply(ColorGroupColors[ParticleGroup(i)], *ParticleFade(i) / 255.0f));
+     // char report[64];
+     // sprintf(report, "%d: %d, %d; ",  i, (int)posOnScreen.x, (int)posOnScreen.y);
+     // Serial.println(report);
+     //Color color = ColorGroupColors[particles[i].colorGroup];
+     //canvas->SetPixel(posOnScreen.x, posOnScreen.y, color.r, color.g, color.b);
+    }
+
+    UpdateFades();
+    // Everything up to here is ours. The swap below waits on the panel, so it isn't counted.
+    int64_t frameWork = nanos() - currentNanos;
+    UpdateGovernor(frameWork);
+    FinishFramePixels(activeParticleCount, currentNanos, frameWork, frameInterval);
+
+    static int frameCount = 0;
+    frameCount++;
+    if (printStats && frameCount % STATS_PRINT_INTERVAL == 0)
+    {
+        PrintStats();
+        PrintFrameTiming();
+        printf("%d particles, frame work %.3f ms\n", activeParticleCount, governor.averageCost / 1e6);
+    }
+
+    canvas = matrix->SwapOnVSync(canvas);
+}
+
+// Sets frameSender up to send to HOST:PORT. Returns false if it can't.
+bool OpenFrameSender(const char *destination)
+{
+    char host[256];
+    const char *colon = strrchr(destination, ':');
+    if (colon == NULL || colon == destination || (size_t)(colon - destination) >= sizeof(host))
+    {
+        fprintf(stderr, "--send wants HOST:PORT, not %s\n", destination);
+        return false;
+    }
+    memcpy(host, destination, colon - destination);
+    host[colon - destination] = '\0';
+    size_t frameBytes = (size_t)canvas->width() * canvas->height() * 3;
+    if (sizeof(FramePacketHeader) + frameBytes > MAX_FRAME_PACKET)
+    {
+        fprintf(stderr, "A %dx%d frame doesn't fit in one datagram\n", canvas->width(), canvas->height());
+        return false;
+    }
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    struct addrinfo *addresses;
+    int error = getaddrinfo(host, colon + 1, &hints, &addresses);
+    if (error != 0)
+    {
+        fprintf(stderr, "%s: %s\n", destination, gai_strerror(error));
+        return false;
+    }
+    int fd = -1;
+    for (struct addrinfo *address = addresses; address != NULL && fd < 0; address = address->ai_next)
+    {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0)
+    {
+        perror(destination);
+        return false;
+    }
+
+    frameSender.socket = fd;
+    frameSender.streamId = (uint32_t)nanos() ^ ((uint32_t)getpid() << 16);
+    return true;
+}
+
+// What --receive has been up to
+struct ReceiverStats
+{
+    long received;   // Frames for a panel this size
+    long shown;
+    long superseded; // Never shown because a newer one arrived with or right after it
+    long stale;      // Older than one already taken from the stream
+    long rejected;   // Not frames, or not for a panel this size
+    long otherStream; // From a stream the receiver didn't switch to
+    long switches;    // Times it switched to another stream
+    long stalls;     // Times no new frame came for RECEIVER_STALL
+    int64_t longestWait; // Between two frames being shown
+};
+ReceiverStats receiverStats;
+
+void PrintReceiverStats()
+{
+    printf("%ld frames shown of %ld received, %ld superseded, %ld stale, %ld rejected, %ld from other streams, %ld switches, "
+           "%ld stalls, longest wait %.1f ms\n",
+           receiverStats.shown, receiverStats.received, receiverStats.superseded, receiverStats.stale, receiverStats.rejected,
+           receiverStats.otherStream, receiverStats.switches, receiverStats.stalls, receiverStats.longestWait / 1e6);
+}
+
+// --receive=PORT. No simulation, the panel shows the newest frame sent to the port with --send.
+// When frames are late the panel goes on refreshing the last one. It follows one stream, and
+// only switches to another once that one stalls or the other has sent RECEIVER_SWITCH_AFTER
+// packets in a row, so a late packet from the last sender or a second sender on the port
+// doesn't make it flap between them.
+int RunReceiver(int port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+    // Room for a burst to queue up while we wait on the panel
+    int bufferSize = RECEIVE_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        perror("bind");
+        close(fd);
+        return 1;
+    }
+
+    size_t packetBytes = sizeof(FramePacketHeader) + (size_t)canvas->width() * canvas->height() * 3;
+    uint8_t *incoming = (uint8_t *)malloc(MAX_FRAME_PACKET);
+    uint8_t *newest = (uint8_t *)malloc(MAX_FRAME_PACKET);
+    AddPrefaultRegion(incoming, MAX_FRAME_PACKET);
+    AddPrefaultRegion(newest, MAX_FRAME_PACKET);
+    bool showing = false;
+    bool following = false;
+    uint32_t followedStream = 0;
+    uint32_t takenSequence = 0; // Newest taken from followedStream. Sequence numbers wrap.
+    uint32_t otherStream = 0;
+    int otherInARow = 0;
+    int64_t lastShownAt = nanos();
+    bool stalled = false;
+    printf("Waiting for %dx%d frames on UDP port %d\n", canvas->width(), canvas->height(), port);
+
+    while (!interrupt_received)
+    {
+        struct pollfd waitFor = {fd, POLLIN, 0};
+        poll(&waitFor, 1, 100);
+
+        // Take everything that has arrived, keeping only the newest
+        int64_t now = nanos();
+        bool haveNewest = false;
+        ssize_t length;
+        while ((length = recv(fd, incoming, MAX_FRAME_PACKET, MSG_DONTWAIT)) >= 0)
+        {
+            const FramePacketHeader *packet = (const FramePacketHeader *)incoming;
+            if ((size_t)length != packetBytes || ntohl(packet->magic) != FRAME_PACKET_MAGIC ||
+                ntohs(packet->version) != FRAME_PACKET_VERSION || ntohs(packet->width) != canvas->width() ||
+                ntohs(packet->height) != canvas->height())
+            {
+                receiverStats.rejected++;
+                continue;
+            }
+            receiverStats.received++;
+            uint32_t stream = ntohl(packet->streamId);
+            uint32_t sequence = ntohl(packet->sequence);
+            if (following && stream != followedStream)
+            {
+                otherInARow = (stream == otherStream) ? otherInARow + 1 : 1;
+                otherStream = stream;
+                if (now - lastShownAt <= RECEIVER_STALL && otherInARow < RECEIVER_SWITCH_AFTER)
+                {
+                    receiverStats.otherStream++;
+                    continue;
+                }
+                receiverStats.switches++;
+                otherInARow = 0;
+            }
+            else if (following && (int32_t)(sequence - takenSequence) <= 0)
+            {
+                receiverStats.stale++;
+                continue;
+            }
+            else
+            {
+                otherInARow = 0;
+            }
+            following = true;
+            followedStream = stream;
+            takenSequence = sequence;
+            if (haveNewest)
+                receiverStats.superseded++;
+            uint8_t *swap = newest;
+            newest = incoming;
+            incoming = swap;
+            haveNewest = true;
+        }
+
+        if (!haveNewest)
+        {
+            if (showing && !stalled && now - lastShownAt > RECEIVER_STALL)
+            {
+                receiverStats.stalls++;
+                stalled = true;
+            }
+            continue;
+        }
+        if (showing && now - lastShownAt > receiverStats.longestWait)
+            receiverStats.longestWait = now - lastShownAt;
+
+        const FramePacketHeader *packet = (const FramePacketHeader *)newest;
+        const uint8_t *pixel = newest + sizeof(FramePacketHeader);
+        BeginFramePixels();
+        for (int y = 0; y < canvas->height(); y++)
+        {
+            for (int x = 0; x < canvas->width(); x++, pixel += 3)
+            {
+                SetCanvasPixel(x, y, {pixel[0], pixel[1], pixel[2]});
+            }
+        }
+        FinishFramePixels(ntohs(packet->particleCount), now, nanos() - now, showing ? now - lastShownAt : 0);
+        canvas = matrix->SwapOnVSync(canvas);
+
+        showing = true;
+        stalled = false;
+        lastShownAt = now;
+        receiverStats.shown++;
+        if (printStats && receiverStats.shown % STATS_PRINT_INTERVAL == 0)
+            PrintReceiverStats();
+    }
+
+    PrintReceiverStats();
+    free(incoming);
+    free(newest);
+    close(fd);
+    return 0;
+}
+
+void *FileStreamMain(void *arg)
+{
+    FileStream *stream = (FileStream *)arg;
+    if (prefault.done)
+        PrefaultStack();
+    pthread_mutex_lock(&stream->lock);
+    while (true)
+    {
+        size_t queued = stream->head - stream->tail;
+        size_t length;
+        if (stream->writing)
+        {
+            if (queued == 0)
+            {
+                if (stream->closing)
+                    break;
+                pthread_cond_wait(&stream->changed, &stream->lock);
+                continue;
+            }
+            length = queued;
+        }
+        else
+        {
+            if (stream->closing || stream->remaining == 0)
+                break;
+            if (queued == FILE_STREAM_SIZE)
+            {
+                pthread_cond_wait(&stream->changed, &stream->lock);
+                continue;
+            }
+            length = FILE_STREAM_SIZE - queued;
+            if (length > stream->remaining)
+                length = stream->remaining;
+        }
+        // One contiguous piece of the ring at a time, and the owner goes on while we're in the syscall
+        size_t start = (stream->writing ? stream->tail : stream->head) % FILE_STREAM_SIZE;
+        if (length > FILE_STREAM_SIZE - start)
+            length = FILE_STREAM_SIZE - start;
+        if (length > FILE_STREAM_CHUNK)
+            length = FILE_STREAM_CHUNK;
+        pthread_mutex_unlock(&stream->lock);
+        size_t done = stream->writing ? fwrite(stream->ring + start, 1, length, stream->file)
+                                      : fread(stream->ring + start, 1, length, stream->file);
+        pthread_mutex_lock(&stream->lock);
+        if (stream->writing)
+        {
+            // What didn't go out is lost either way, so don't hold the owner up with it
+            if (done < length)
+                stream->failed = true;
+            stream->tail += length;
+        }
+        else
+        {
+            stream->head += done;
+            stream->remaining = (done < length) ? 0 : stream->remaining - done;
+        }
+        pthread_cond_broadcast(&stream->changed);
+    }
+    if (stream->writing && fflush(stream->file) != 0)
+        stream->failed = true;
+    stream->ended = true;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+// Starts a thread writing to file, or reading up to readLimit bytes from where it is now
+bool OpenFileStream(FileStream *stream, FILE *file, bool writing, size_t readLimit)
+{
+    stream->ring = (uint8_t *)malloc(FILE_STREAM_SIZE);
+    if (stream->ring == NULL)
+        return false;
+    AddPrefaultRegion(stream->ring, FILE_STREAM_SIZE);
+    stream->writing = writing;
+    stream->head = 0;
+    stream->tail = 0;
+    stream->remaining = readLimit;
+    stream->closing = false;
+    stream->ended = false;
+    stream->failed = false;
+    stream->waits = 0;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->changed, NULL);
+    stream->file = file;
+    if (pthread_create(&stream->thread, NULL, FileStreamMain, stream) != 0)
+    {
+        stream->file = NULL;
+        free(stream->ring);
+        return false;
+    }
+    return true;
+}
+
+// Bytes that can be put in right now without waiting
+size_t FileStreamRoom(FileStream *stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    size_t room = FILE_STREAM_SIZE - (stream->head - stream->tail);
+    pthread_mutex_unlock(&stream->lock);
+    return room;
+}
+
+// Only ever put in what FileStreamRoom said there is room for
+void FileStreamPut(FileStream *stream, const void *data, size_t length)
+{
+    // Only the thread's side of the ring is locked, ours is only touched from here
+    size_t start = stream->head % FILE_STREAM_SIZE;
+    size_t first = (length < FILE_STREAM_SIZE - start) ? length : FILE_STREAM_SIZE - start;
+    memcpy(stream->ring + start, data, first);
+    memcpy(stream->ring, (const uint8_t *)data + first, length - first);
+    pthread_mutex_lock(&stream->lock);
+    stream->head += length;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// Waits for the next length bytes read. Returns false if the file ends first.
+bool FileStreamTake(FileStream *stream, void *data, size_t length)
+{
+    pthread_mutex_lock(&stream->lock);
+    if (stream->head - stream->tail < length && !stream->ended)
+    {
+        stream->waits++;
+        while (stream->head - stream->tail < length && !stream->ended)
+            pthread_cond_wait(&stream->changed, &stream->lock);
+    }
+    bool available = stream->head - stream->tail >= length;
+    pthread_mutex_unlock(&stream->lock);
+    if (!available)
+        return false;
+
+    size_t start = stream->tail % FILE_STREAM_SIZE;
+    size_t first = (length < FILE_STREAM_SIZE - start) ? length : FILE_STREAM_SIZE - start;
+    memcpy(data, stream->ring + start, first);
+    memcpy((uint8_t *)data + first, stream->ring, length - first);
+    pthread_mutex_lock(&stream->lock);
+    stream->tail += length;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+    return true;
+}
+
+// Writes out whatever is still queued and stops the thread. The file stays open.
+void CloseFileStream(FileStream *stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->closing = true;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->thread, NULL);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->changed);
+    free(stream->ring);
+    stream->file = NULL;
+}
+
+// ------------------------------------------------------------
+
+// LEB128: seven bits a byte, low bits first, the top bit set on all but the last byte
+int PutVarint(uint8_t *out, uint32_t value)
+{
+    int length = 0;
+    while (value >= 0x80)
+    {
+        out[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (uint8_t)value;
+    return length;
+}
+
+bool GetVarint(const uint8_t **in, const uint8_t *end, uint32_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 35 && *in < end; shift += 7)
+    {
+        uint8_t byte = *(*in)++;
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool SamePixel(const uint8_t *a, const uint8_t *b)
+{
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+// Runs of equal pixels: the run length, then the pixel. Returns the bytes written.
+uint32_t EncodeKeyframe(const uint8_t *pixels, int pixelCount, uint8_t *out)
+{
+    uint8_t *start = out;
+    for (int i = 0; i < pixelCount;)
+    {
+        const uint8_t *pixel = pixels + i * 3;
+        int run = 1;
+        while (i + run < pixelCount && SamePixel(pixel + run * 3, pixel))
+            run++;
+        out += PutVarint(out, run);
+        out[0] = pixel[0];
+        out[1] = pixel[1];
+        out[2] = pixel[2];
+        out += 3;
+        i += run;
+    }
+    return out - start;
+}
+
+// Pairs of runs: unchanged pixels to skip, then changed pixels as they are XORed with the
+// previous frame. Nothing at all when nothing changed.
+uint32_t EncodeDelta(const uint8_t *pixels, const uint8_t *previous, int pixelCount, uint8_t *out)
+{
+    uint8_t *start = out;
+    int i = 0;
+    while (true)
+    {
+        int skip = 0;
+        while (i + skip < pixelCount && SamePixel(pixels + (i + skip) * 3, previous + (i + skip) * 3))
+            skip++;
+        i += skip;
+        if (i == pixelCount)
+            break;
+        int changed = 1;
+        while (i + changed < pixelCount && !SamePixel(pixels + (i + changed) * 3, previous + (i + changed) * 3))
+            changed++;
+        out += PutVarint(out, skip);
+        out += PutVarint(out, changed);
+        for (int b = i * 3; b < (i + changed) * 3; b++)
+        {
+            *out++ = pixels[b] ^ previous[b];
+        }
+        i += changed;
+    }
+    return out - start;
+}
+
+// Applies a frame to pixels, which hold the frame before it unless this is a keyframe.
+// Returns false if the frame doesn't make sense.
+bool DecodeFrame(const uint8_t *data, uint32_t size, bool keyframe, uint8_t *pixels, int pixelCount)
+{
+    const uint8_t *end = data + size;
+    int i = 0;
+    while (data < end)
+    {
+        uint32_t first, second;
+        if (keyframe)
+        {
+            if (!GetVarint(&data, end, &first) || first > (uint32_t)(pixelCount - i) || end - data < 3)
+                return false;
+            for (uint32_t k = 0; k < first; k++, i++)
+            {
+                memcpy(pixels + i * 3, data, 3);
+            }
+            data += 3;
+        }
+        else
+        {
+            if (!GetVarint(&data, end, &first) || !GetVarint(&data, end, &second) ||
+                first + (uint64_t)second > (uint32_t)(pixelCount - i) || (uint64_t)(end - data) < second * 3)
+                return false;
+            i += first;
+            for (uint32_t b = 0; b < second * 3; b++)
+            {
+                pixels[i * 3 + b] ^= data[b];
+            }
+            data += second * 3;
+            i += second;
+        }
+    }
+    // A keyframe covers every pixel, a delta can stop after the last change
+    return !keyframe || i == pixelCount;
+}
+
+// The most a frame can take up: a keyframe of runs of one pixel each
+size_t MaxEncodedFrameSize(int pixelCount)
+{
+    return (size_t)pixelCount * 4 + 16;
+}
+
+// --record=PATH. Returns false if it can't.
+bool OpenRecording(const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        perror(path);
+        return false;
+    }
+    // The frame count and index are filled in when the recording is closed
+    RecordingHeader header = {};
+    header.magic = RECORDING_MAGIC;
+    header.version = RECORDING_VERSION;
+    header.keyframeInterval = RECORDING_KEYFRAME_INTERVAL;
+    header.width = canvas->width();
+    header.height = canvas->height();
+    int pixelCount = canvas->width() * canvas->height();
+    recorder.previous = (uint8_t *)calloc(pixelCount, 3);
+    recorder.encoded = (uint8_t *)malloc(sizeof(RecordedFrame) + MaxEncodedFrameSize(pixelCount));
+    recorder.indexCapacity = RECORDING_INDEX_START;
+    recorder.index = (uint64_t *)malloc(recorder.indexCapacity * sizeof(uint64_t));
+    AddPrefaultRegion(recorder.previous, pixelCount * 3);
+    AddPrefaultRegion(recorder.encoded, sizeof(RecordedFrame) + MaxEncodedFrameSize(pixelCount));
+    // Growing it later writes the whole new copy, so only the first one needs touching
+    AddPrefaultRegion(recorder.index, recorder.indexCapacity * sizeof(uint64_t));
+    recorder.frameCount = 0;
+    recorder.offset = sizeof(header);
+    recorder.sinceKeyframe = -1;
+    recorder.startedAt = nanos();
+    recorder.dropped = 0;
+    recorder.path = path;
+    if (fwrite(&header, sizeof(header), 1, file) != 1 || !OpenFileStream(&recorder.stream, file, true, 0))
+    {
+        perror(path);
+        fclose(file);
+        return false;
+    }
+    return true;
+}
+
+// Encodes the frame and hands it to the recorder's thread. Never waits for the disk: when the
+// thread has fallen that far behind the frame is dropped, and the next one is a keyframe.
+void RecordFrame(const uint8_t *pixels, int particleCount, int64_t frameStart)
+{
+    int pixelCount = canvas->width() * canvas->height();
+    bool keyframe = recorder.sinceKeyframe < 0 || recorder.sinceKeyframe + 1 >= RECORDING_KEYFRAME_INTERVAL;
+    RecordedFrame *frame = (RecordedFrame *)recorder.encoded;
+    uint8_t *payload = recorder.encoded + sizeof(RecordedFrame);
+    frame->size = keyframe ? EncodeKeyframe(pixels, pixelCount, payload)
+                           : EncodeDelta(pixels, recorder.previous, pixelCount, payload);
+    frame->sinceKeyframe = keyframe ? 0 : recorder.sinceKeyframe + 1;
+    frame->particleCount = particleCount;
+    frame->time = frameStart - recorder.startedAt;
+    size_t frameSize = sizeof(RecordedFrame) + frame->size;
+    if (FileStreamRoom(&recorder.stream) < frameSize)
+    {
+        recorder.dropped++;
+        recorder.sinceKeyframe = -1;
+        return;
+    }
+    if (recorder.frameCount == recorder.indexCapacity)
+    {
+        uint64_t *grown = (uint64_t *)realloc(recorder.index, 2 * recorder.indexCapacity * sizeof(uint64_t));
+        if (grown == NULL)
+        {
+            // The index so far is still good, so finish the file off with what it has
+            fprintf(stderr, "%s: no memory for a longer index, stopping the recording\n", recorder.path);
+            CloseRecording();
+            return;
+        }
+        recorder.index = grown;
+        recorder.indexCapacity *= 2;
+    }
+    FileStreamPut(&recorder.stream, recorder.encoded, frameSize);
+    recorder.index[recorder.frameCount++] = recorder.offset;
+    recorder.offset += frameSize;
+    recorder.sinceKeyframe = frame->sinceKeyframe;
+    memcpy(recorder.previous, pixels, pixelCount * 3);
+}
+
+// Finishes the file off with the index, so playback can seek in it
+void CloseRecording()
+{
+    if (recorder.stream.file == NULL)
+        return;
+    FILE *file = recorder.stream.file;
+    CloseFileStream(&recorder.stream);
+    bool failed = recorder.stream.failed;
+
+    RecordingHeader header = {};
+    header.magic = RECORDING_MAGIC;
+    header.version = RECORDING_VERSION;
+    header.keyframeInterval = RECORDING_KEYFRAME_INTERVAL;
+    header.width = canvas->width();
+    header.height = canvas->height();
+    header.frameCount = recorder.frameCount;
+    header.indexOffset = recorder.offset;
+    if (fwrite(recorder.index, sizeof(uint64_t), recorder.frameCount, file) != recorder.frameCount ||
+        fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1)
+        failed = true;
+    if (fclose(file) != 0)
+        failed = true;
+    if (failed)
+        fprintf(stderr, "%s: not all of the recording was written\n", recorder.path);
+
+    double bytes = recorder.offset + recorder.frameCount * sizeof(uint64_t);
+    double rawBytes = (double)recorder.frameCount * canvas->width() * canvas->height() * 3;
+    printf("%llu frames recorded to %s, %.2f MB, %.0f bytes a frame, %.1fx smaller than raw, %ld dropped\n",
+           (unsigned long long)recorder.frameCount, recorder.path, bytes / 1e6,
+           recorder.frameCount > 0 ? bytes / recorder.frameCount : 0.0, bytes > 0 ? rawBytes / bytes : 0.0,
+           recorder.dropped);
+    free(recorder.previous);
+    free(recorder.encoded);
+    free(recorder.index);
+}
+
+// Finds the frames in a recording that was cut short before its index was written.
+// Stops at the first frame that isn't all there, or when there is no memory for more.
+uint64_t ScanRecording(FILE *file, uint64_t fileSize, uint64_t **index)
+{
+    uint64_t capacity = RECORDING_INDEX_START;
+    uint64_t count = 0;
+    *index = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    if (*index == NULL)
+        return 0;
+    uint64_t offset = sizeof(RecordingHeader);
+    RecordedFrame frame;
+    while (fseeko(file, offset, SEEK_SET) == 0 && fread(&frame, sizeof(frame), 1, file) == 1 &&
+           offset + sizeof(frame) + frame.size <= fileSize)
+    {
+        if (count == capacity)
+        {
+            uint64_t *grown = (uint64_t *)realloc(*index, 2 * capacity * sizeof(uint64_t));
+            if (grown == NULL)
+                break;
+            *index = grown;
+            capacity *= 2;
+        }
+        (*index)[count++] = offset;
+        offset += sizeof(frame) + frame.size;
+    }
+    return count;
+}
+
+// Where frame n starts, from the index at the end of the file, or from scanned when the
+// recording was cut short and ScanRecording() had to find the frames
+bool ReadFrameOffset(FILE *file, const RecordingHeader &header, const uint64_t *scanned, uint64_t n, uint64_t *offset)
+{
+    if (scanned != NULL)
+    {
+        *offset = scanned[n];
+        return true;
+    }
+    return fseeko(file, header.indexOffset + n * sizeof(uint64_t), SEEK_SET) == 0 && fread(offset, sizeof(*offset), 1, file) == 1;
+}
+
+// --play=PATH. No simulation, the panel shows a recording made with --record at the pace it
+// was recorded, starting from --play-from=N. The file is read ahead on a thread of its own.
+int RunPlayback(const char *path, uint64_t firstFrame)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    RecordingHeader header;
+    struct stat info;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != RECORDING_MAGIC ||
+        header.version != RECORDING_VERSION || fstat(fileno(file), &info) != 0)
+    {
+        fprintf(stderr, "%s is not a version %d recording\n", path, RECORDING_VERSION);
+        fclose(file);
+        return 1;
+    }
+    if (header.width != canvas->width() || header.height != canvas->height())
+    {
+        fprintf(stderr, "%s was recorded on a %ux%u panel, not %dx%d\n", path, header.width, header.height,
+                canvas->width(), canvas->height());
+        fclose(file);
+        return 1;
+    }
+
+    // The index stays in the file, and only the entries a seek needs are read from it
+    uint64_t *scanned = NULL;
+    uint64_t frameCount = header.frameCount;
+    uint64_t dataEnd = header.indexOffset;
+    if (header.indexOffset == 0 || header.indexOffset + frameCount * sizeof(uint64_t) > (uint64_t)info.st_size)
+    {
+        frameCount = ScanRecording(file, info.st_size, &scanned);
+        dataEnd = (frameCount > 0) ? scanned[frameCount - 1] : sizeof(header);
+        if (frameCount > 0)
+        {
+            RecordedFrame last;
+            fseeko(file, dataEnd, SEEK_SET);
+            if (fread(&last, sizeof(last), 1, file) == 1)
+                dataEnd += sizeof(last) + last.size;
+        }
+        printf("%s has no index, it was cut short after %llu frames\n", path, (unsigned long long)frameCount);
+    }
+    if (firstFrame >= frameCount)
+    {
+        fprintf(stderr, "%s has %llu frames, there is no frame %llu\n", path, (unsigned long long)frameCount,
+                (unsigned long long)firstFrame);
+        free(scanned);
+        fclose(file);
+        return 1;
+    }
+
+    // The frame we want says how far back its keyframe is, and decoding starts there
+    RecordedFrame frame;
+    uint64_t at = 0;
+    uint64_t from = 0;
+    uint64_t keyframe = 0;
+    bool found = ReadFrameOffset(file, header, scanned, firstFrame, &at) && at < dataEnd &&
+                 fseeko(file, at, SEEK_SET) == 0 && fread(&frame, sizeof(frame), 1, file) == 1 &&
+                 frame.sinceKeyframe <= firstFrame;
+    if (found)
+    {
+        keyframe = firstFrame - frame.sinceKeyframe;
+        found = ReadFrameOffset(file, header, scanned, keyframe, &from) && from <= at;
+    }
+    free(scanned);
+    if (!found)
+    {
+        fprintf(stderr, "%s: frame %llu is damaged\n", path, (unsigned long long)firstFrame);
+        fclose(file);
+        return 1;
+    }
+    fseeko(file, from, SEEK_SET);
+    posix_fadvise(fileno(file), from, dataEnd - from, POSIX_FADV_SEQUENTIAL);
+    FileStream stream;
+    if (!OpenFileStream(&stream, file, false, dataEnd - from))
+    {
+        perror(path);
+        fclose(file);
+        return 1;
+    }
+    printf("Playing %s from frame %llu of %llu\n", path, (unsigned long long)firstFrame,
+           (unsigned long long)frameCount);
+
+    int pixelCount = canvas->width() * canvas->height();
+    uint8_t *pixels = (uint8_t *)calloc(pixelCount, 3);
+    uint8_t *payload = (uint8_t *)malloc(MaxEncodedFrameSize(pixelCount));
+    AddPrefaultRegion(pixels, pixelCount * 3);
+    AddPrefaultRegion(payload, MaxEncodedFrameSize(pixelCount));
+    int64_t startedAt = 0;
+    int64_t firstTime = 0;
+    int64_t lastShownAt = 0;
+    long played = 0;
+    long late = 0;
+    for (uint64_t n = keyframe; n < frameCount && !interrupt_received; n++)
+    {
+        if (!FileStreamTake(&stream, &frame, sizeof(frame)) || frame.size > MaxEncodedFrameSize(pixelCount) ||
+            !FileStreamTake(&stream, payload, frame.size) || (n == keyframe && frame.sinceKeyframe != 0) ||
+            !DecodeFrame(payload, frame.size, frame.sinceKeyframe == 0, pixels, pixelCount))
+        {
+            fprintf(stderr, "%s: frame %llu is damaged\n", path, (unsigned long long)n);
+            break;
+        }
+        // The frames between the keyframe and the first one shown are only decoded
+        if (n < firstFrame)
+            continue;
+
+        if (n == firstFrame)
+        {
+            startedAt = nanos();
+            firstTime = frame.time;
+        }
+        int64_t due = startedAt + frame.time - firstTime;
+        SleepUntil(due);
+        int64_t now = nanos();
+        if (now - due > PLAYBACK_LATE)
+            late++;
+        const uint8_t *pixel = pixels;
+        BeginFramePixels();
+        for (int y = 0; y < canvas->height(); y++)
+        {
+            for (int x = 0; x < canvas->width(); x++, pixel += 3)
+            {
+                SetCanvasPixel(x, y, {pixel[0], pixel[1], pixel[2]});
+            }
+        }
+        FinishFramePixels(frame.particleCount, now, nanos() - now, (played > 0) ? now - lastShownAt : 0);
+        canvas = matrix->SwapOnVSync(canvas);
+        lastShownAt = now;
+        played++;
+        if (printStats && played % STATS_PRINT_INTERVAL == 0)
+            printf("%ld frames played, %ld late, %ld waits for the disk\n", played, late, stream.waits);
+    }
+
+    printf("%ld frames played, %ld late, %ld waits for the disk\n", played, late, stream.waits);
+    CloseFileStream(&stream);
+    fclose(file);
+    free(pixels);
+    free(payload);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    RGBMatrix::Options matrix_options;
+    RuntimeOptions runtime_opt;
+    int targetFps = DEFAULT_TARGET_FPS;
+    bool realtime = false;
+    int simCpus[MAX_SIM_THREADS];
+    int simCpuCount = 0;
+    int simPriority = DEFAULT_SIM_PRIORITY;
+    int fixedParticleCount = 0;
+    bool tune = true;
+    bool retune = false;
+    bool benchLayout = false;
+    bool benchGrid = false;
+    bool benchSchedule = false;
+    bool benchCompact = false;
+    bool determinismCheck = false;
+    const char *tracePath = NULL;
+    bool checkTrace = false;
+    const char *tuneCachePath = DEFAULT_TUNE_CACHE;
+    const char *frameRingName = NULL;
+    const char *sendTo = NULL;
+    int receivePort = 0;
+    const char *recordTo = NULL;
+    const char *playFrom = NULL;
+    uint64_t firstPlayedFrame = 0;
+    if (!ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+        return 1;
+    }
+    // Whatever the matrix library did not recognise is ours
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--stats") == 0)
+            printStats = true;
+        else if (strncmp(argv[i], "--fps=", 6) == 0)
+            targetFps = atoi(argv[i] + 6);
+        else if (strcmp(argv[i], "--realtime") == 0)
+            realtime = true;
+        else if (strncmp(argv[i], "--sim-cpu=", 10) == 0)
+        {
+            simCpuCount = ParseCpuList(argv[i] + 10, simCpus, MAX_SIM_THREADS);
+            if (simCpuCount < 0)
+            {
+                fprintf(stderr, "--sim-cpu takes a CPU or a list of up to %d, like 2 or 2,0,1\n", MAX_SIM_THREADS);
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--sim-priority=", 15) == 0)
+            simPriority = atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--particles=", 12) == 0)
+            fixedParticleCount = atoi(argv[i] + 12);
+        else if (strcmp(argv[i], "--no-tune") == 0)
+            tune = false;
+        else if (strcmp(argv[i], "--retune") == 0)
+            retune = true;
+        else if (strcmp(argv[i], "--bench-layout") == 0)
+            benchLayout = true;
+        else if (strcmp(argv[i], "--bench-grid") == 0)
+            benchGrid = true;
+        else if (strcmp(argv[i], "--bench-schedule") == 0)
+            benchSchedule = true;
+        else if (strcmp(argv[i], "--bench-compact") == 0)
+            benchCompact = true;
+        else if (strcmp(argv[i], "--deterministic") == 0)
+            deterministicForces = true;
+        else if (strcmp(argv[i], "--compact") == 0)
+            compactState = true;
+        else if (strcmp(argv[i], "--determinism-check") == 0)
+            determinismCheck = true;
+        else if (strncmp(argv[i], "--trace=", 8) == 0)
+            tracePath = argv[i] + 8;
+        else if (strncmp(argv[i], "--check-trace=", 14) == 0)
+        {
+            tracePath = argv[i] + 14;
+            checkTrace = true;
+        }
+        else if (strncmp(argv[i], "--tune-cache=", 13) == 0)
+            tuneCachePath = argv[i] + 13;
+        else if (strcmp(argv[i], "--export-frames") == 0)
+            frameRingName = FRAME_RING_DEFAULT_NAME;
+        else if (strncmp(argv[i], "--export-frames=", 16) == 0)
+            frameRingName = argv[i] + 16;
+        else if (strncmp(argv[i], "--send=", 7) == 0)
+            sendTo = argv[i] + 7;
+        else if (strncmp(argv[i], "--receive=", 10) == 0)
+            receivePort = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--record=", 9) == 0)
+            recordTo = argv[i] + 9;
+        else if (strncmp(argv[i], "--play=", 7) == 0)
+            playFrom = argv[i] + 7;
+        else if (strncmp(argv[i], "--play-from=", 12) == 0)
+            firstPlayedFrame = strtoull(argv[i] + 12, NULL, 10);
+        else if (strncmp(argv[i], "--integrator=", 13) == 0)
+        {
+            int k = 0;
+            while (k < INTEGRATOR_COUNT && strcmp(argv[i] + 13, integratorNames[k]) != 0)
+                k++;
+            if (k == INTEGRATOR_COUNT)
+            {
+                fprintf(stderr, "unknown integrator %s, use euler, verlet or exponential\n", argv[i] + 13);
+                return 1;
+            }
+            integrator = (Integrator)k;
+        }
+    }
+    if (sendTo != NULL && receivePort > 0)
+    {
+        fprintf(stderr, "--send and --receive can't be used together\n");
+        return 1;
+    }
+    if (playFrom != NULL && receivePort > 0)
+    {
+        fprintf(stderr, "--play and --receive can't be used together\n");
+        return 1;
+    }
+    frameTiming.framePeriod = (targetFps > 0) ? 1000000000 / targetFps : 0;
+    // Without a frame rate to hold there is nothing to govern by
+    governor.enabled = fixedParticleCount <= 0 && frameTiming.framePeriod > 0;
+    governor.budget = frameTiming.framePeriod * GOVERNOR_BUDGET_SHARE;
+  
+    matrix = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
+    if (matrix == NULL)
+    {
+        return 1;
+    }
+    canvas = matrix->CreateFrameCanvas();
+
+
+    // It is always good to set up a signal handler to cleanly exit when we
+    // receive a CTRL-C for instance. The DrawOnCanvas() routine is looking
+    // for that.
+    signal(SIGTERM, InterruptHandler);
+    signal(SIGINT, InterruptHandler);
+
+    if (fixedParticleCount > MAX_PARTICLES)
+        fixedParticleCount = MAX_PARTICLES;
+
+    initialize();
+    if (benchLayout)
+    {
+        StartSimWorkers(1);
+        RunLayoutBench((fixedParticleCount > 0) ? fixedParticleCount : MAX_PARTICLES);
+        delete matrix;
+        return 0;
+    }
+    if (benchGrid)
+    {
+        StartSimWorkers(MAX_SIM_THREADS);
+        RunGridBench((fixedParticleCount > 0) ? fixedParticleCount : MAX_PARTICLES);
+        delete matrix;
+        return 0;
+    }
+    if (benchSchedule)
+    {
+        StartSimWorkers(MAX_SIM_THREADS);
+        RunScheduleBench((fixedParticleCount > 0) ? fixedParticleCount : MAX_PARTICLES);
+        delete matrix;
+        return 0;
+    }
+    if (benchCompact)
+    {
+        StartSimWorkers(1);
+        RunCompactBench((fixedParticleCount > 0) ? fixedParticleCount : MAX_PARTICLES);
+        delete matrix;
+        return 0;
+    }
+    if (determinismCheck)
+    {
+        StartSimWorkers(MAX_SIM_THREADS);
+        RunDeterminismCheck((fixedParticleCount > 0) ? fixedParticleCount : TRACE_PARTICLES);
+        delete matrix;
+        return 0;
+    }
+    if (frameRingName != NULL)
+    {
+        frameRing = CreateFrameRing(frameRingName, canvas->width(), canvas->height());
+        if (frameRing == NULL)
+        {
+            delete matrix;
+            return 1;
+        }
+    }
+    if (sendTo != NULL && !OpenFrameSender(sendTo))
+    {
+        delete matrix;
+        return 1;
+    }
+    if (recordTo != NULL && !OpenRecording(recordTo))
+    {
+        delete matrix;
+        return 1;
+    }
+    if (frameRing == NULL && (frameSender.socket >= 0 || recordTo != NULL))
+    {
+        localFramePixels = (uint8_t *)calloc(canvas->width() * canvas->height(), 3);
+        AddPrefaultRegion(localFramePixels, canvas->width() * canvas->height() * 3);
+    }
+
+    // The matrix has started its refresh thread by now, so this only affects ours
+    if (realtime)
+        EnterRealtimeMode(simCpus, simCpuCount, simPriority);
+
+    if (receivePort > 0)
+    {
+        int status = RunReceiver(receivePort);
+        CloseRecording();
+        delete matrix;
+        if (frameRing != NULL)
+            shm_unlink(frameRingName);
+        return status;
+    }
+    if (playFrom != NULL)
+    {
+        int status = RunPlayback(playFrom, firstPlayedFrame);
+        CloseRecording();
+        delete matrix;
+        if (frameRing != NULL)
+            shm_unlink(frameRingName);
+        return status;
+    }
+
+    // Tune for the most particles this run can have
+    if (tune)
+    {
+        AutoTune((fixedParticleCount > 0) ? fixedParticleCount : MAX_PARTICLES, tuneCachePath, retune);
+        initialize();
+    }
+    if (tracePath != NULL)
+    {
+        int status = RunTrace(tracePath, checkTrace, (fixedParticleCount > 0) ? fixedParticleCount : TRACE_PARTICLES);
+        CloseRecording();
+        delete matrix;
+        if (frameRing != NULL)
+            shm_unlink(frameRingName);
+        return status;
+    }
+    SetGridHeight(simConfig.gridHeight);
+    activeParticleCount = (fixedParticleCount > 0) ? fixedParticleCount : START_PARTICLES;
+    retireFrom = activeParticleCount;
+
+    int64_t deadline = nanos();
+    while (!interrupt_received)
+    {
+        loop();
+
+        if (frameTiming.framePeriod > 0)
+        {
+            // Step on a fixed schedule instead of a fixed gap after each frame, so
+            // time spent in loop() doesn't add up into drift
+            deadline += frameTiming.framePeriod;
+            int64_t now = nanos();
+            // After a stall, start over from now instead of rushing to catch up
+            if (now - deadline > frameTiming.framePeriod)
+                deadline = now;
+            SleepUntil(deadline);
+        }
     }
 
+    PrintFrameTiming();
+    if (frameSender.socket >= 0)
+        printf("%ld frames sent, %ld dropped\n", frameSender.sent, frameSender.failed);
+    CloseRecording();
     delete matrix;
+    if (frameRing != NULL)
+        shm_unlink(frameRingName);
 
     return 0;
 }
@@ -5,19 +5,35 @@
 #include <iostream>
 #include <raylib.h>
 #include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
 
 #define CANVAS_WIDTH (64 * 1) // Resolution of what you want to draw to
 #define CANVAS_HEIGHT (32 * 1)
-#define CANVAS_ASPECT_RATIO (CANVAS_WIDTH / CANVAS_HEIGHT)
+#define CANVAS_ASPECT_RATIO ((float)CANVAS_WIDTH / CANVAS_HEIGHT)
 #define SCREEN_WIDTH (CANVAS_WIDTH * 9) // How big will it be on your screen?
 #define SCREEN_HEIGHT (CANVAS_HEIGHT * 9)
 
-#define CELL_GRID_WIDTH 4
-#define CELL_GRID_HEIGHT 2
-#define MAX_PARTICLES_PER_CELL 100
-
-#define MAX_PARTICLES 100
-#define MAX_COLOR_GROUPS 2
+// The grid is sized at runtime to follow the largest interaction radius, up to this many cells
+#define MAX_CELL_GRID_HEIGHT 8
+#define MAX_CELL_GRID_WIDTH (MAX_CELL_GRID_HEIGHT * CANVAS_WIDTH / CANVAS_HEIGHT)
+// The grid is padded with a ring of ghost cells that hold wrapped copies of the opposite edge
+#define GHOST_GRID_WIDTH (MAX_CELL_GRID_WIDTH + 2)
+#define GHOST_GRID_HEIGHT (MAX_CELL_GRID_HEIGHT + 2)
+#define MAX_PARTICLES_PER_CELL 255 // Run offsets are bytes, so no more than this
+
+#ifndef MAX_PARTICLES
+#define MAX_PARTICLES 2000 // Room in the pool. The governor decides how much of it is in use.
+#endif
+#define START_PARTICLES 100
+#define MIN_PARTICLES 16
+#define TARGET_FPS 60
+#define MAX_COLOR_GROUPS 32 // How many groups the tables have room for, see colorGroupCount
 
 using namespace std;
 
@@ -28,6 +44,18 @@ using namespace std;
 static void Initialize(void);
 static void UpdateDrawFrame(void); // Update and draw one frame
 static void randomizeAttractionFactorMatrix(void);
+static void StepSimulation(float deltaTime);
+static void RunBenchmark(void);
+static void RunEnsemble(int worldCount, int groupCount);
+static void RunSleepCheck(void);
+static void RunIntegratorCheck(void);
+static void RunSubstepCheck(void);
+static void RunPanelModel(void);
+static void DrawStatsOverlay(void);
+static void DrawPanelModel(void);
+static void UpdateGovernor(float frameCost);
+static void UpdateFades(void);
+static void SpawnFromMouse(void);
 
 const uint8_t PanelColorDepth = 3; // Per channel
 struct PanelColor
@@ -44,7 +72,9 @@ enum ColorGroup
 {
 	GROUP_RED,
 	GROUP_BLUE,
-	GROUP_YELLOW
+	GROUP_YELLOW,
+	GROUP_WHITE,
+	GROUP_GREEN
 };
 
 const PanelColor ColorGroupColors[] = {
@@ -54,44 +84,180 @@ const PanelColor ColorGroupColors[] = {
 	{255, 255, 255},
 	{20, 255, 180},
 	};
+// Groups past the named ones get colors spread around the hue wheel
+PanelColor groupColors[MAX_COLOR_GROUPS];
+
+// How many color groups are in play
+int colorGroupCount = 2;
 
-float attractionFactorMatrix[MAX_COLOR_GROUPS][MAX_COLOR_GROUPS];
+// How particles of one color group react to particles of another
+struct InteractionParams
+{
+	float attractionFactor;
+	float maxDistance;		// In worldspace, the radius of the sphere of influence
+	float tooCloseDistance; // Fraction of maxDistance; closer than this, and the particles push each other away
+	float inverseMaxDistance;
+};
+// Indexed [subject group][object group]. A row is 512 bytes, so every row starts on a cache line.
+alignas(64) InteractionParams interactionTable[MAX_COLOR_GROUPS][MAX_COLOR_GROUPS];
 
 struct Particle
 {
 	Vector2 position;
 	Vector2 velocity;
 	ColorGroup colorGroup;
+	uint8_t fade; // Brightness, ramps up when the governor adds the particle and down when it retires it
+	uint8_t calmFrames; // Steps in a row it has barely moved. Asleep at SLEEP_FRAMES.
+	Vector2 halfKick;	// Velocity Verlet only: the half of the last step's kick still to be applied
+	float peakForce;	// Strongest force it felt last frame, after forceFactor. Picks its cell's substeps.
 };
 
 Particle particles[MAX_PARTICLES];
-
-// In worldspace, the radius of the sphere of influence for each particle.
-const float maxDistance = 0.25; // Please let 2 be evenly divisible by this number, for cellSize's sake
+// Particles [0, activeParticleCount) are simulated and drawn, the rest of the pool waits.
+// The ones from retireFrom up are fading out on their way back into the pool.
+int activeParticleCount = START_PARTICLES;
+int retireFrom = START_PARTICLES;
+
+// In worldspace, the default radius of the sphere of influence for each particle.
+const float maxDistance = 0.25;
+// Default fraction of maxDistance where pushing turns into pulling
+const float tooCloseDistance = 0.4;
 const float dt = 0.01;
-const float frictionFactor = 0.8;
+const float frictionFactor = 0.8; // How much velocity is left after one frame at FRICTION_REFERENCE_FPS
 const float forceFactor = 5.0;
+// Friction is applied per second, so the motion doesn't change with the frame rate
+#define FRICTION_REFERENCE_FPS 60
+const float damping = -logf(frictionFactor) * FRICTION_REFERENCE_FPS;
+
+// How a step turns forces into motion. I cycles through them.
+enum Integrator
+{
+	INTEGRATOR_SYMPLECTIC_EULER, // Velocity first, then position with the new velocity
+	INTEGRATOR_VELOCITY_VERLET,	 // Second order, still one force pass per step
+	INTEGRATOR_EXPONENTIAL,		 // Friction and force integrated exactly over the step
+	INTEGRATOR_COUNT
+};
+const char *integratorNames[INTEGRATOR_COUNT] = {"symplectic Euler", "velocity Verlet", "exponential"};
+Integrator integrator = INTEGRATOR_SYMPLECTIC_EULER;
+
+// Size of the area the particles live in. It wraps around at the edges.
+const float worldWidth = CANVAS_ASPECT_RATIO;
+const float worldHeight = 1.0;
 
 struct Cell
 {
 	uint16_t particleIndices[MAX_PARTICLES_PER_CELL];
+	// Where each particle is as seen from this cell. Ghost cells shift these across the edge.
+	Vector2 particlePositions[MAX_PARTICLES_PER_CELL];
+	// Particles are sorted by color group, and each group that is present gets one run.
+	// Run k holds group runGroups[k] at [runStart[k], runStart[k + 1]).
+	uint8_t runGroups[MAX_COLOR_GROUPS];
+	uint8_t runStart[MAX_COLOR_GROUPS + 1];
+	uint8_t runCount;
 	uint8_t particleCount;
+	bool restless; // Holds an awake particle that is still getting somewhere, which wakes sleepers nearby
+	uint8_t substepLevel; // The finest level of the particles in it this frame, see multiRateEnabled
+	bool changed;		  // Gained, lost or moved particles this substep, see RebinDueParticles()
+};
+
+// Divide the area into cells that are at least as big as the
+// largest circle of influence's radius. Set by UpdateCellSize().
+int cellGridWidth;
+int cellGridHeight;
+float cellWidth;
+float cellHeight;
+// Force per world unit of the stiffest push in the table, before forceFactor. Also set by UpdateCellSize().
+float stiffestPush;
+// What the last step actually did. Cheap enough to always be on.
+#define OCCUPANCY_BUCKETS 8 // Cells holding 0, 1, 2-3, 4-7, ... 64 or more particles
+struct SimStats
+{
+	long candidatePairs;  // Pairs the force loop looked at
+	long pairsInRange;	  // Pairs close enough to push or pull
+	int droppedParticles; // Left out of the grid because their cell was full
+	int wrapShifts;		  // Particles copied across an edge into the ghost ring
+	int maxCellOccupancy;
+	float meanCellOccupancy;
+	int occupancyHistogram[OCCUPANCY_BUCKETS];
+	int sleepingParticles; // Skipped by the force loop, see sleepingEnabled
+	int substepCells[3];   // Real cells taking 1, 2 and 4 substeps, see multiRateEnabled
+	int particleSteps;	   // Times a particle was integrated, more than once each where cells substep
 };
+SimStats frameStats;
+
+// Lazy mode. A particle that has been nearly still, with nearly no force on it, for
+// SLEEP_FRAMES steps in a row stops and is skipped by the force loop. It still pushes
+// and pulls the others. It wakes up as soon as anything in its own or a neighboring
+// cell moves faster than SLEEP_WAKE_SPEED. Off by default, Z toggles it.
+#define SLEEP_FRAMES 30
+#define SLEEP_SPEED 0.01	  // World units per second
+#define SLEEP_FORCE 0.05	  // After forceFactor
+#define SLEEP_WAKE_SPEED 0.02 // Anything faster than this nearby is worth waking up for
+bool sleepingEnabled = false;
+
+// Multi-rate stepping. Each cell takes 1, 2 or 4 substeps a frame, depending on how crowded it
+// is and how hard its particles were pushed last frame, so a dense clump gets the small steps
+// it needs to stay stable while the rest of the world costs one step. A particle keeps its
+// cell's level for the frame. On each substep where its level is due it feels everything around
+// it and is integrated over its level's share of the frame, and cells with nothing due are
+// skipped. Between its steps a particle is seen where its last step started. Off by default, M toggles it.
+#define SUBSTEP_LEVELS 3	   // 1, 2 or 4 substeps
+#define SUBSTEP_STABILITY 1.0  // Radians a cell's stiffest wobble may turn through in one substep
+#define SUBSTEP_MAX_KICK 0.005 // World units the strongest force in a cell may move a particle by in one substep
+bool multiRateEnabled = false;
+// The level each particle steps at this frame, taken from its cell by ClassifySubsteps()
+uint8_t particleLevels[MAX_PARTICLES];
+
+// Panel timing model. What the real panels and the devices driving them would make of the sim.
+// A HUB75 panel lights two rows at a time and gets its color depth from binary-coded modulation:
+// a refresh loads every scan row once per bit plane and shows plane b 2^b times as long as
+// plane 0. On the Pi the matrix library spins a core of its own doing that, on the Mega the
+// refresh interrupt takes a share of the only core, and what's left is the sim's budget.
+// T cycles through the targets, --panel-model prints them all.
+#define PANEL_ROWS 32	   // Per panel. A taller canvas is more panels on the end of the chain.
+#define PANEL_SCAN_ROWS 16 // Rows loaded one after another
+struct PanelTarget
+{
+	const char *name;
+	int targetFps;
+	float budgetShare; // Of the frame, what the frontend's governor lets the sim have
+	int cores;
+	int simThreads;
+	int refreshCores; // Kept busy by the refresh, 0 when it runs from an interrupt instead
+	int bitPlanes;
+	float clockNs;		 // Shifting one column into the chain
+	float rowOverheadNs; // Latching and switching rows, once per row load
+	float lsbNs;		 // How long plane 0 is shown
+	// What the sim costs there. Rough, calibrate against each frontend's own numbers.
+	float pairShare;  // Candidate pairs as a share of particles squared, 0 to go by this sim's grid
+	float pairNs;	  // Per candidate pair
+	float inRangeNs;  // On top of that, per pair in range
+	float particleNs; // Integrating and drawing
+	float frameNs;	  // Clearing, the grid, swapping
+};
+#define PANEL_TARGET_COUNT 2
+const PanelTarget panelTargets[PANEL_TARGET_COUNT] = {
+	// particle-life-pi on a Pi 3 with the library's defaults. The sim costs are this machine's
+	// --bench scaled down to a Cortex-A53, so measure them on a Pi before leaning on them.
+	{"Pi 3", 100, 0.5, 4, 3, 1, 11, 60, 2000, 130, 0.0, 25, 60, 300, 200000},
+	// particle-life-arduino with RGBmatrixPanel's 4 planes, driven from its timer interrupt.
+	// Its 4x2 grid hands each particle 9 cells' worth of neighbors out of 8, hence the 9 / 8.
+	// The sim costs come from the AVR cost model in particle-life-arduino/host.
+	{"Mega", 25, 1.0, 1, 1, 0, 4, 500, 9400, 40000, 9.0 / 8, 75000, 125000, 400000, 450000},
+};
+int panelTarget = -1; // Into panelTargets, -1 for none
 
-// Used to define which way a neighboring cell is wrapped around the edge of the area
-struct CellWrap
+// Counted by each thread walking the pairs, then merged into frameStats
+struct PairCounters
 {
-	bool wrappedLeft;
-	bool wrappedRight;
-	bool wrappedTop;
-	bool wrappedBottom;
+	long candidatePairs;
+	long pairsInRange;
 };
 
-// Divide the area into cells whos size is the
-// diameter of the circle of influence for every particle
-const float cellSize = maxDistance * 2.0;
 // Each grid cell contains a list of particles within its bounds.
-Cell grid[CELL_GRID_HEIGHT][CELL_GRID_WIDTH];
+// Row and column 0 and the row and column after the last real one are ghost cells,
+// the real cells start at [1][1].
+Cell grid[GHOST_GRID_HEIGHT][GHOST_GRID_WIDTH];
 
 // If there is an overflow, return 255
 uint8_t AddClamp(uint8_t a, uint8_t b)
@@ -164,65 +330,24 @@ void FrameBufferAddPixV(Vector2 pos, PanelColor color)
 	FrameBufferAddPix(pos.x, pos.y, color);
 }
 
-void InitCellWraps(CellWrap *neighborCellWraps, uint8_t size)
-{
-	for (uint8_t i = 0; i < size; i++)
-	{
-		neighborCellWraps[i].wrappedLeft = false;
-		neighborCellWraps[i].wrappedRight = false;
-		neighborCellWraps[i].wrappedTop = false;
-		neighborCellWraps[i].wrappedBottom = false;
-	}
-}
-
-void GetNeighborCells(Cell **listToPopulate, int row, int col, CellWrap *wrapList)
+// Row and col are in padded grid coordinates, so the neighbors of a real cell
+// never need to wrap; the ghost ring already holds the shifted copies.
+void GetNeighborCells(Cell **listToPopulate, int row, int col)
 {
-	uint8_t left = (col == 0) ? CELL_GRID_WIDTH - 1 : col - 1;
-	uint8_t right = (col + 1) % CELL_GRID_WIDTH;
-	uint8_t above = (row == 0) ? CELL_GRID_HEIGHT - 1 : row - 1;
-	uint8_t below = (row + 1) % CELL_GRID_HEIGHT;
 	/*
 	012
 	345
 	678
 	*/
-	listToPopulate[0] = &grid[above][left];
-	listToPopulate[1] = &grid[above][col];
-	listToPopulate[2] = &grid[above][right];
-	listToPopulate[3] = &grid[row][left];
+	listToPopulate[0] = &grid[row - 1][col - 1];
+	listToPopulate[1] = &grid[row - 1][col];
+	listToPopulate[2] = &grid[row - 1][col + 1];
+	listToPopulate[3] = &grid[row][col - 1];
 	listToPopulate[4] = &grid[row][col];
-	listToPopulate[5] = &grid[row][right];
-	listToPopulate[6] = &grid[below][left];
-	listToPopulate[7] = &grid[below][col];
-	listToPopulate[8] = &grid[below][right];
-
-	// Which way are the cells wrapped?
-	if (col == 0)
-	{
-		// If the leftmost column, the left neighbors are all wrapped
-		wrapList[0].wrappedLeft = true;
-		wrapList[3].wrappedLeft = true;
-		wrapList[6].wrappedLeft = true;
-	}
-	else if (col == CELL_GRID_WIDTH - 1)
-	{
-		// If the rightmost column, the right neighbors are all wrapped
-		wrapList[2].wrappedRight = true;
-		wrapList[5].wrappedRight = true;
-		wrapList[8].wrappedRight = true;
-	}
-	if (row == 0)
-	{
-		wrapList[0].wrappedTop = true;
-		wrapList[1].wrappedTop = true;
-		wrapList[2].wrappedTop = true;
-	}
-	else if (row == CELL_GRID_HEIGHT - 1)
-	{
-		wrapList[6].wrappedBottom = true;
-		wrapList[7].wrappedBottom = true;
-		wrapList[8].wrappedBottom = true;
-	}
+	listToPopulate[5] = &grid[row][col + 1];
+	listToPopulate[6] = &grid[row + 1][col - 1];
+	listToPopulate[7] = &grid[row + 1][col];
+	listToPopulate[8] = &grid[row + 1][col + 1];
 }
 
 // PC display ----------------------------
@@ -242,17 +367,50 @@ Color PanelColorToColor(PanelColor color)
 //----------------------------------------------------------------------------------
 // Main entry point
 //----------------------------------------------------------------------------------
-int main(void)
+int main(int argc, char *argv[])
 {
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+	{
+		RunBenchmark();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--integrator-check") == 0)
+	{
+		RunIntegratorCheck();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--sleep-check") == 0)
+	{
+		RunSleepCheck();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--substep-check") == 0)
+	{
+		RunSubstepCheck();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--panel-model") == 0)
+	{
+		RunPanelModel();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--ensemble") == 0)
+	{
+		// --ensemble [world count] [color groups]
+		RunEnsemble(argc > 2 ? atoi(argv[2]) : 256, argc > 3 ? atoi(argv[3]) : colorGroupCount);
+		return 0;
+	}
+
 	InitWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "goofing");
 
 	RenderTexture2D renderTexture = LoadRenderTexture(SCREEN_WIDTH, SCREEN_HEIGHT);
 	Rectangle source = {0, (float)-CANVAS_HEIGHT, (float)CANVAS_WIDTH, (float)-CANVAS_HEIGHT}; // - Because OpenGL coordinates are inverted
 	Rectangle dest = {0, 0, (float)SCREEN_WIDTH, (float)SCREEN_HEIGHT};
 
-	SetTargetFPS(60);
+	SetTargetFPS(TARGET_FPS);
 
 	Initialize();
+	bool showStats = false;
 
 	while (!WindowShouldClose()) // Detect window close button or ESC key
 	{
@@ -274,12 +432,43 @@ int main(void)
 		ClearBackground(RAYWHITE);
 		DrawTexturePro(renderTexture.texture, source, dest, (Vector2){0, 0}, 0.0f, WHITE);
 		// DrawFPS(16, 16);
+		if (showStats)
+			DrawStatsOverlay();
+		if (panelTarget >= 0)
+			DrawPanelModel();
 		EndDrawing();
 
 		// If R is pressed, run randomizeAttractionFactorMatrix();
 		if (IsKeyPressed(KEY_R)){
 			randomizeAttractionFactorMatrix();
 		}
+		// I switches how forces turn into motion
+		if (IsKeyPressed(KEY_I))
+		{
+			integrator = (Integrator)((integrator + 1) % INTEGRATOR_COUNT);
+		}
+		// Z lets settled particles sleep
+		if (IsKeyPressed(KEY_Z))
+		{
+			sleepingEnabled = !sleepingEnabled;
+		}
+		// M gives crowded cells extra substeps
+		if (IsKeyPressed(KEY_M))
+		{
+			multiRateEnabled = !multiRateEnabled;
+		}
+		// Mouse buttons add and remove particles
+		SpawnFromMouse();
+		// S shows what the step is doing
+		if (IsKeyPressed(KEY_S))
+		{
+			showStats = !showStats;
+		}
+		// T shows how the panel and the sim would fare on each device
+		if (IsKeyPressed(KEY_T))
+		{
+			panelTarget = (panelTarget + 1 < PANEL_TARGET_COUNT) ? panelTarget + 1 : -1;
+		}
 	}
 
 	CloseWindow(); // Close window and OpenGL context
@@ -401,10 +590,10 @@ void DrawPoint(Vector2 position, PanelColor color)
 	FrameBufferAddPixV(pixelCornerBottomRight, colorBottomRight);
 }
 
-float AttractionForceMag(float distance, float attractionFactor)
+// Distance is a fraction of the interaction radius.
+// Closer than tooCloseDistance, and the particles will push each other away.
+float AttractionForceMag(float distance, float attractionFactor, float tooCloseDistance)
 {
-	// Closer than this, and the particles will push each other away
-	const float tooCloseDistance = 0.4;
 	if (distance < tooCloseDistance)
 	{
 		// Get away from me!
@@ -421,45 +610,276 @@ float AttractionForceMag(float distance, float attractionFactor)
 	}
 }
 
+// Keeps a coordinate within [0, extent) while preserving how far past the edge it went
+float WrapCoordinate(float value, float extent)
+{
+	value = fmodf(value, extent);
+	if (value < 0)
+		value += extent;
+	// A tiny negative value can round up to exactly extent
+	if (value >= extent)
+		value = 0;
+	return value;
+}
+
+// Copies the real cell on the opposite edge into a ghost cell, shifting
+// the positions so they appear just past this edge of the world.
+void FillGhostCell(int row, int col)
+{
+	int sourceRow = (row == 0) ? cellGridHeight : (row == cellGridHeight + 1) ? 1 : row;
+	int sourceCol = (col == 0) ? cellGridWidth : (col == cellGridWidth + 1) ? 1 : col;
+	Vector2 shift = {
+		(col == 0) ? -worldWidth : (col == cellGridWidth + 1) ? worldWidth : 0.0f,
+		(row == 0) ? -worldHeight : (row == cellGridHeight + 1) ? worldHeight : 0.0f};
+
+	Cell *source = &grid[sourceRow][sourceCol];
+	Cell *ghost = &grid[row][col];
+	frameStats.wrapShifts += source->particleCount;
+	for (int p = 0; p < source->particleCount; p++)
+	{
+		ghost->particleIndices[p] = source->particleIndices[p];
+		ghost->particlePositions[p] = Vector2Add(source->particlePositions[p], shift);
+	}
+	memcpy(ghost->runGroups, source->runGroups, source->runCount);
+	memcpy(ghost->runStart, source->runStart, source->runCount + 1);
+	ghost->runCount = source->runCount;
+	ghost->particleCount = source->particleCount;
+	ghost->restless = source->restless;
+}
+
+// Reorders a cell's particles so each color group is one contiguous run.
+// Groups with no particles here get no run, so the force loop never visits them.
+void SortCellByColorGroup(Cell *cell)
+{
+	uint8_t groupCounts[MAX_COLOR_GROUPS] = {0};
+	for (int p = 0; p < cell->particleCount; p++)
+	{
+		groupCounts[particles[cell->particleIndices[p]].colorGroup]++;
+	}
+
+	uint8_t nextSlot[MAX_COLOR_GROUPS];
+	uint8_t start = 0;
+	cell->runCount = 0;
+	for (int g = 0; g < colorGroupCount; g++)
+	{
+		nextSlot[g] = start;
+		if (groupCounts[g] == 0)
+			continue;
+		cell->runGroups[cell->runCount] = g;
+		cell->runStart[cell->runCount] = start;
+		cell->runCount++;
+		start += groupCounts[g];
+	}
+	cell->runStart[cell->runCount] = start;
+
+	uint16_t sortedIndices[MAX_PARTICLES_PER_CELL];
+	Vector2 sortedPositions[MAX_PARTICLES_PER_CELL];
+	for (int p = 0; p < cell->particleCount; p++)
+	{
+		uint8_t slot = nextSlot[particles[cell->particleIndices[p]].colorGroup]++;
+		sortedIndices[slot] = cell->particleIndices[p];
+		sortedPositions[slot] = cell->particlePositions[p];
+	}
+	memcpy(cell->particleIndices, sortedIndices, cell->particleCount * sizeof(sortedIndices[0]));
+	memcpy(cell->particlePositions, sortedPositions, cell->particleCount * sizeof(sortedPositions[0]));
+}
+
+// Copies the whole ring of ghost cells, or with changedOnly just the ghosts of cells marked changed
+void UpdateGhostCells(bool changedOnly)
+{
+	// Top and bottom rows, including the corners
+	for (int c = 0; c < cellGridWidth + 2; c++)
+	{
+		int sourceCol = (c == 0) ? cellGridWidth : (c == cellGridWidth + 1) ? 1 : c;
+		if (!changedOnly || grid[cellGridHeight][sourceCol].changed)
+			FillGhostCell(0, c);
+		if (!changedOnly || grid[1][sourceCol].changed)
+			FillGhostCell(cellGridHeight + 1, c);
+	}
+	// Left and right columns
+	for (int r = 1; r <= cellGridHeight; r++)
+	{
+		if (!changedOnly || grid[r][cellGridWidth].changed)
+			FillGhostCell(r, 0);
+		if (!changedOnly || grid[r][1].changed)
+			FillGhostCell(r, cellGridWidth + 1);
+	}
+}
+
+// Adds up the pull from a run of particles that all share one color group,
+// so the interaction parameters stay the same for the whole run.
+// The result still needs to be scaled by forceFactor.
+Vector2 GroupRunForce(Vector2 subjectPos, const Vector2 *objectPositions, int count, const InteractionParams &params, PairCounters *counters)
+{
+	Vector2 totalForce = {0.0, 0.0};
+	counters->candidatePairs += count;
+	for (int pJ = 0; pJ < count; pJ++)
+	{
+		// Already shifted across the edge if this is a ghost cell
+		Vector2 particleObjPercievedPos = objectPositions[pJ];
+
+		// Only deal with neighbors within sphere of influence.
+		// The subject itself is skipped by having zero distance.
+		Vector2 delta = Vector2Subtract(subjectPos, particleObjPercievedPos);
+		float distance = Vector2Length(delta);
+		if (distance > 0.0 && distance < params.maxDistance)
+		{
+			// How hard do I need to move?
+			float forceMag = AttractionForceMag(distance * params.inverseMaxDistance, params.attractionFactor, params.tooCloseDistance);
+
+			// Where do I need to move?
+			// Normalize then scale by force magnitude, which is relative to the radius
+			Vector2 force = Vector2Scale(delta, -1.0 / distance * forceMag * params.maxDistance);
+			totalForce = Vector2Add(totalForce, force);
+			counters->pairsInRange++;
+		}
+	}
+	return totalForce;
+}
+
+// The real cell a position inside the world falls in
+Cell *CellAt(Vector2 position)
+{
+	int cell_row = position.y / cellHeight;
+	int cell_col = position.x / cellWidth;
+	// Rounding can put a particle sitting right on the far edge one cell too far
+	if (cell_row > cellGridHeight - 1)
+		cell_row = cellGridHeight - 1;
+	if (cell_col > cellGridWidth - 1)
+		cell_col = cellGridWidth - 1;
+	return &grid[cell_row + 1][cell_col + 1];
+}
+
 void UpdateGrid()
 {
 	// Clear the list of particles for each cell
-	for (int i = 0; i < CELL_GRID_HEIGHT; i++)
+	for (int i = 1; i <= cellGridHeight; i++)
 	{
-		for (int j = 0; j < CELL_GRID_WIDTH; j++)
+		for (int j = 1; j <= cellGridWidth; j++)
 		{
 			grid[i][j].particleCount = 0;
+			grid[i][j].restless = false;
+			grid[i][j].substepLevel = 0;
+			grid[i][j].changed = false;
 		}
 	}
 
 	// Add each particle to the list of particles for its corresponding cell
-	for (int i = 0; i < MAX_PARTICLES; i++)
+	for (int i = 0; i < activeParticleCount; i++)
 	{
-
-		int cell_row = particles[i].position.y / cellSize;
-		int cell_col = particles[i].position.x / cellSize;
-		
-		Cell *cell = &grid[cell_row][cell_col];
+		Cell *cell = CellAt(particles[i].position);
+		particleLevels[i] = 0;
 		if (cell->particleCount < MAX_PARTICLES_PER_CELL)
 		{
 			cell->particleIndices[cell->particleCount] = i;
+			cell->particlePositions[cell->particleCount] = particles[i].position;
 			cell->particleCount++;
+			if (sleepingEnabled && particles[i].calmFrames < SLEEP_FRAMES && Vector2Length(particles[i].velocity) > SLEEP_WAKE_SPEED)
+				cell->restless = true;
+		}
+		else
+		{
+			frameStats.droppedParticles++;
 		}
 	}
 
+	int occupiedTotal = 0;
+	for (int i = 1; i <= cellGridHeight; i++)
+	{
+		for (int j = 1; j <= cellGridWidth; j++)
+		{
+			SortCellByColorGroup(&grid[i][j]);
+
+			int count = grid[i][j].particleCount;
+			occupiedTotal += count;
+			if (count > frameStats.maxCellOccupancy)
+				frameStats.maxCellOccupancy = count;
+			int bucket = 0;
+			while (count > 0 && bucket < OCCUPANCY_BUCKETS - 1)
+			{
+				count >>= 1;
+				bucket++;
+			}
+			frameStats.occupancyHistogram[bucket]++;
+		}
+	}
+	frameStats.meanCellOccupancy = (float)occupiedTotal / (cellGridWidth * cellGridHeight);
+}
+
+// Resizes the grid so a cell is never smaller than the largest interaction radius
+void UpdateCellSize()
+{
+	float largestRadius = 0.0;
+	stiffestPush = 0.0;
+	for (int i = 0; i < colorGroupCount; i++)
+	{
+		for (int j = 0; j < colorGroupCount; j++)
+		{
+			largestRadius = fmax(largestRadius, interactionTable[i][j].maxDistance);
+			// The push grows by 1 / tooCloseDistance for every world unit closer, whatever the radius
+			stiffestPush = fmax(stiffestPush, 1.0 / interactionTable[i][j].tooCloseDistance);
+		}
+	}
+
+	cellGridWidth = (int)(worldWidth / largestRadius);
+	cellGridHeight = (int)(worldHeight / largestRadius);
+	if (cellGridWidth > MAX_CELL_GRID_WIDTH)
+		cellGridWidth = MAX_CELL_GRID_WIDTH;
+	if (cellGridHeight > MAX_CELL_GRID_HEIGHT)
+		cellGridHeight = MAX_CELL_GRID_HEIGHT;
+	if (cellGridWidth < 1)
+		cellGridWidth = 1;
+	if (cellGridHeight < 1)
+		cellGridHeight = 1;
+	cellWidth = worldWidth / cellGridWidth;
+	cellHeight = worldHeight / cellGridHeight;
+}
+
+void SetInteraction(int subjectGroup, int objectGroup, float attractionFactor, float radius, float tooClose)
+{
+	InteractionParams *params = &interactionTable[subjectGroup][objectGroup];
+	params->attractionFactor = attractionFactor;
+	params->maxDistance = radius;
+	params->tooCloseDistance = tooClose;
+	params->inverseMaxDistance = 1.0 / radius;
 }
 
 void randomizeAttractionFactorMatrix()
 {
-	for (int i = 0; i < MAX_COLOR_GROUPS; i++)
+	for (int i = 0; i < colorGroupCount; i++)
 	{
-		for (int j = 0; j < MAX_COLOR_GROUPS; j++)
+		for (int j = 0; j < colorGroupCount; j++)
 		{
-			attractionFactorMatrix[j][i] = RandFloat(-1.0, 1.0);
+			interactionTable[j][i].attractionFactor = RandFloat(-1.0, 1.0);
 		}
 	}
 }
 
+// Gives every pair of groups its own radius and push distance
+void randomizeInteractionRadii()
+{
+	for (int i = 0; i < colorGroupCount; i++)
+	{
+		for (int j = 0; j < colorGroupCount; j++)
+		{
+			SetInteraction(i, j, interactionTable[i][j].attractionFactor, RandFloat(maxDistance * 0.5, maxDistance), RandFloat(0.2, 0.5));
+		}
+	}
+	UpdateCellSize();
+}
+
+// Hue is from 0 to 1
+PanelColor HueToPanelColor(float hue)
+{
+	float r = fabsf(hue * 6 - 3) - 1;
+	float g = 2 - fabsf(hue * 6 - 2);
+	float b = 2 - fabsf(hue * 6 - 4);
+	return {
+		(uint8_t)(255 * fmin(fmax(r, 0.0), 1.0)),
+		(uint8_t)(255 * fmin(fmax(g, 0.0), 1.0)),
+		(uint8_t)(255 * fmin(fmax(b, 0.0), 1.0))};
+}
+
 static void Initialize()
 {
 	// Initialize the particles with random positions, velocities, and colors
@@ -470,130 +890,434 @@ static void Initialize()
 		// particles[i].velocity = {RandFloat(-1, 1), RandFloat(-1, 1)};
 		particles[i].velocity = {0.0, 0.0};
 
-		particles[i].colorGroup = (ColorGroup)RandByte(GROUP_RED, MAX_COLOR_GROUPS - 1);
+		particles[i].colorGroup = (ColorGroup)RandByte(GROUP_RED, colorGroupCount - 1);
+		particles[i].fade = 255;
+		particles[i].calmFrames = 0;
+		particles[i].halfKick = {0.0, 0.0};
+		particles[i].peakForce = 0.0;
 
 		// particles[i].colorDraw = ColorGroupColors[particles[i].colorGroup];
 	}
 
+	const int namedColorCount = sizeof(ColorGroupColors) / sizeof(ColorGroupColors[0]);
+	for (int g = 0; g < MAX_COLOR_GROUPS; g++)
+	{
+		groupColors[g] = (g < namedColorCount) ? ColorGroupColors[g] : HueToPanelColor((float)(g - namedColorCount) / (MAX_COLOR_GROUPS - namedColorCount));
+	}
+
+	for (int i = 0; i < MAX_COLOR_GROUPS; i++)
+	{
+		for (int j = 0; j < MAX_COLOR_GROUPS; j++)
+		{
+			SetInteraction(i, j, 0.0, maxDistance, tooCloseDistance);
+		}
+	}
 	//randomizeAttractionFactorMatrix();
-	attractionFactorMatrix[0][0] = 1.0;
-	attractionFactorMatrix[0][1] = -1.0;
-	attractionFactorMatrix[1][0] = 0.2;
-	attractionFactorMatrix[1][1] = 0.0;
+	interactionTable[0][0].attractionFactor = 1.0;
+	interactionTable[0][1].attractionFactor = -1.0;
+	interactionTable[1][0].attractionFactor = 0.2;
+	interactionTable[1][1].attractionFactor = 0.0;
+	UpdateCellSize();
+	activeParticleCount = START_PARTICLES;
+	retireFrom = START_PARTICLES;
 }
 
-static void UpdateDrawFrame()
+// Counts how long a particle has been sitting still, and stops it dead once it falls asleep
+void UpdateCalm(Particle *p, Vector2 force)
 {
-	static int t = 0;
-	t++;
+	if (Vector2Length(p->velocity) > SLEEP_SPEED || Vector2Length(force) > SLEEP_FORCE)
+	{
+		p->calmFrames = 0;
+		return;
+	}
+	p->calmFrames++;
+	if (p->calmFrames == SLEEP_FRAMES)
+	{
+		p->velocity = {0.0, 0.0};
+		p->halfKick = {0.0, 0.0};
+	}
+}
 
-	// Update time
-	static unsigned long prevMillis = 0;
-	unsigned long currentMillis = millis();
-	float deltaTime = (currentMillis - prevMillis) / 1000.0f;
-	prevMillis = currentMillis;
+// What a step costs to set up for the chosen integrator, worked out once per step instead of per particle
+struct IntegratorStep
+{
+	float deltaTime;
+	float decay;	 // How much velocity is left after deltaTime of friction
+	float settle;	 // Integral of decay over the step, in seconds
+	float driftScale; // Turns a force into how far it moves a particle during the step
+};
 
-	FrameBufferClear({0, 0, 0});
+IntegratorStep PrepareIntegratorStep(float deltaTime)
+{
+	IntegratorStep step;
+	step.deltaTime = deltaTime;
+	step.decay = expf(-damping * deltaTime);
+	step.settle = (damping > 0.0f) ? (1.0f - step.decay) / damping : deltaTime;
+	step.driftScale = (damping > 0.0f) ? (deltaTime - step.settle) / damping : 0.5f * deltaTime * deltaTime;
+	return step;
+}
 
-	UpdateGrid();
+// Moves a particle on by one step given the force on it now. Doesn't wrap it.
+void IntegrateParticle(Particle *p, Vector2 force, const IntegratorStep &step)
+{
+	switch (integrator)
+	{
+	case INTEGRATOR_VELOCITY_VERLET:
+		// Finish the last step's kick now that the new force is known, then drift and start this step's kick
+		p->velocity = Vector2Add(p->velocity, Vector2Add(p->halfKick, Vector2Scale(force, 0.5f * step.deltaTime)));
+		p->velocity = Vector2Scale(p->velocity, step.decay);
+		p->position = Vector2Add(p->position, Vector2Add(Vector2Scale(p->velocity, step.deltaTime), Vector2Scale(force, 0.5f * step.deltaTime * step.deltaTime)));
+		p->halfKick = Vector2Scale(force, 0.5f * step.deltaTime);
+		break;
+	case INTEGRATOR_EXPONENTIAL:
+		// Exact when the force holds still over the step: velocity slides from where it was toward force / damping
+		p->position = Vector2Add(p->position, Vector2Add(Vector2Scale(p->velocity, step.settle), Vector2Scale(force, step.driftScale)));
+		p->velocity = Vector2Add(Vector2Scale(p->velocity, step.decay), Vector2Scale(force, step.settle));
+		break;
+	default:
+		p->velocity = Vector2Scale(p->velocity, step.decay);
+		p->velocity = Vector2Add(p->velocity, Vector2Scale(force, step.deltaTime));
+		p->position = Vector2Add(p->position, Vector2Scale(p->velocity, step.deltaTime));
+		break;
+	}
+}
 
-	// Update each particle, one cell at a time
-	for (int r = 0; r < CELL_GRID_HEIGHT; r++)
+// Picks each cell's substeps for a frame of deltaTime and returns the highest level picked
+int ClassifySubsteps(float deltaTime)
+{
+	int topLevel = 0;
+	for (int r = 1; r <= cellGridHeight; r++)
 	{
-		for (int c = 0; c < CELL_GRID_WIDTH; c++)
+		for (int c = 1; c <= cellGridWidth; c++)
 		{
-			// Get list of the 8 neighboring cells and itself
-			Cell *neighborCells[9];
-			CellWrap neighborCellWraps[9];
-			InitCellWraps(neighborCellWraps, 9);
-			GetNeighborCells(neighborCells, r, c, neighborCellWraps);
+			Cell *cell = &grid[r][c];
+			// Worst case, everything in the cell pushes on one particle at once
+			float wobble = sqrtf(forceFactor * stiffestPush * cell->particleCount);
+			float peakForce = 0.0;
+			for (int p = 0; p < cell->particleCount; p++)
+			{
+				peakForce = fmax(peakForce, particles[cell->particleIndices[p]].peakForce);
+			}
+			float needed = fmax(wobble * deltaTime / SUBSTEP_STABILITY, deltaTime * sqrtf(peakForce / SUBSTEP_MAX_KICK));
 
-			// Go through every particle in this cell (as subjects)
-			for (int pI = 0; pI < grid[r][c].particleCount; pI++)
+			int level = 0;
+			while (level < SUBSTEP_LEVELS - 1 && (1 << level) < needed)
+				level++;
+			cell->substepLevel = level;
+			for (int p = 0; p < cell->particleCount; p++)
 			{
-				uint16_t i = grid[r][c].particleIndices[pI];
-				Vector2 totalForce = {0.0, 0.0}; // Will be accumulated when looping through neighbors
-				// Go through each neighboring cell
+				particleLevels[cell->particleIndices[p]] = level;
+			}
+			frameStats.substepCells[level]++;
+			if (level > topLevel)
+				topLevel = level;
+		}
+	}
+	return topLevel;
+}
+
+// Whether particles at level start a step on this substep of a frame split 1 << topLevel ways
+bool LevelStepsAt(int level, int substep, int topLevel)
+{
+	return (substep & ((1 << (topLevel - level)) - 1)) == 0;
+}
+
+// Between substeps: catches up the particles whose step ended on this one. They are wrapped,
+// their positions are copied into the grid, and any that left its cell moves to the one it is in
+// now, so the neighborhoods looked at stay right. The rest are left where their step started.
+void RebinDueParticles(int substep, int topLevel)
+{
+	for (int r = 1; r <= cellGridHeight; r++)
+	{
+		for (int c = 1; c <= cellGridWidth; c++)
+		{
+			Cell *cell = &grid[r][c];
+			if (!LevelStepsAt(cell->substepLevel, substep, topLevel))
+				continue;
+			cell->changed = true;
+			int kept = 0;
+			for (int p = 0; p < cell->particleCount; p++)
+			{
+				uint16_t i = cell->particleIndices[p];
+				Vector2 position = cell->particlePositions[p];
+				if (LevelStepsAt(particleLevels[i], substep, topLevel))
+				{
+					particles[i].position.x = WrapCoordinate(particles[i].position.x, worldWidth);
+					particles[i].position.y = WrapCoordinate(particles[i].position.y, worldHeight);
+					position = particles[i].position;
+					// One that can't fit where it went stays put, so it isn't left out of the rest of the frame
+					Cell *home = CellAt(position);
+					if (home != cell && home->particleCount < MAX_PARTICLES_PER_CELL)
+					{
+						home->particleIndices[home->particleCount] = i;
+						home->particlePositions[home->particleCount] = position;
+						home->particleCount++;
+						home->substepLevel = max(home->substepLevel, particleLevels[i]);
+						home->changed = true;
+						continue;
+					}
+				}
+				cell->particleIndices[kept] = i;
+				cell->particlePositions[kept] = position;
+				kept++;
+			}
+			cell->particleCount = kept;
+		}
+	}
+
+	for (int r = 1; r <= cellGridHeight; r++)
+	{
+		for (int c = 1; c <= cellGridWidth; c++)
+		{
+			if (grid[r][c].changed)
+				SortCellByColorGroup(&grid[r][c]);
+		}
+	}
+	int wrapShifts = frameStats.wrapShifts;
+	UpdateGhostCells(true);
+	frameStats.wrapShifts = wrapShifts;
+	for (int r = 1; r <= cellGridHeight; r++)
+	{
+		for (int c = 1; c <= cellGridWidth; c++)
+		{
+			grid[r][c].changed = false;
+		}
+	}
+}
+
+// Moves every particle forward by deltaTime
+static void StepSimulation(float deltaTime)
+{
+	memset(&frameStats, 0, sizeof(frameStats));
+	PairCounters counters = {0, 0};
+
+	UpdateGrid();
+
+	int topLevel = multiRateEnabled ? ClassifySubsteps(deltaTime) : 0;
+	UpdateGhostCells(false);
+	const int substeps = 1 << topLevel;
+	IntegratorStep steps[SUBSTEP_LEVELS];
+	for (int level = 0; level <= topLevel; level++)
+	{
+		steps[level] = PrepareIntegratorStep(deltaTime / (1 << level));
+	}
+
+	for (int substep = 0; substep < substeps; substep++)
+	{
+		if (substep > 0)
+			RebinDueParticles(substep, topLevel);
+
+		// Update each particle, one cell at a time
+		for (int r = 1; r <= cellGridHeight; r++)
+		{
+			for (int c = 1; c <= cellGridWidth; c++)
+			{
+				// Nothing here starts a step on this substep
+				Cell *cell = &grid[r][c];
+				if (!LevelStepsAt(cell->substepLevel, substep, topLevel))
+					continue;
+
+				// Get list of the 8 neighboring cells and itself
+				Cell *neighborCells[9];
+				GetNeighborCells(neighborCells, r, c);
+
+				// Sleeping particles here only wake up if something around them is on the move
+				bool disturbed = false;
 				for (int n = 0; n < 9; n++)
 				{
-					// Go through every particle in this cell (as objects)
-					for (int pJ = 0; pJ < neighborCells[n]->particleCount; pJ++)
+					disturbed = disturbed || neighborCells[n]->restless;
+				}
+
+				// Go through every particle in this cell (as subjects), one color group at a time
+				for (int subjectRun = 0; subjectRun < cell->runCount; subjectRun++)
+				{
+					const InteractionParams *interactionRow = interactionTable[cell->runGroups[subjectRun]];
+					for (int pI = cell->runStart[subjectRun]; pI < cell->runStart[subjectRun + 1]; pI++)
 					{
-						uint16_t j = neighborCells[n]->particleIndices[pJ];
-						if (&particles[j] == &particles[i])
+						uint16_t i = cell->particleIndices[pI];
+						int level = particleLevels[i];
+						if (!LevelStepsAt(level, substep, topLevel))
 							continue;
-
-						Vector2 particleObjPercievedPos = particles[j].position;
-						// Offset location if it's wrapped
-						if (neighborCellWraps[n].wrappedLeft)
-						{
-							// TODO: let these not be constants. Should be aspect ratio (width of field in particle's float coord system)
-							particleObjPercievedPos.x -= CANVAS_ASPECT_RATIO;
-						}
-						if (neighborCellWraps[n].wrappedRight)
+						if (sleepingEnabled && particles[i].calmFrames >= SLEEP_FRAMES)
 						{
-							particleObjPercievedPos.x += CANVAS_ASPECT_RATIO;
+							if (!disturbed)
+							{
+								if (substep == 0)
+									frameStats.sleepingParticles++;
+								continue;
+							}
+							particles[i].calmFrames = 0;
 						}
-						if (neighborCellWraps[n].wrappedTop)
+						Vector2 subjectPos = cell->particlePositions[pI];
+						Vector2 totalForce = {0.0, 0.0}; // Will be accumulated when looping through neighbors
+						// Go through each neighboring cell
+						for (int n = 0; n < 9; n++)
 						{
-							particleObjPercievedPos.y -= 1.0;
-						}
-						if (neighborCellWraps[n].wrappedBottom)
-						{
-							particleObjPercievedPos.y += 1.0;
-						}
-
-						// Only deal with neighbors within sphere of influence
-						Vector2 delta = Vector2Subtract(particles[i].position, particleObjPercievedPos);
-						float distance = Vector2Length(delta);
-						if (distance > 0.0 && distance < maxDistance)
-						{
-							// How hard do I need to move?
-							float forceMag = AttractionForceMag(distance / maxDistance, attractionFactorMatrix[particles[i].colorGroup][particles[j].colorGroup]);
-
-							// Where do I need to move?
-							// Normalize then scale by force magnitude
-							Vector2 force = Vector2Scale(delta, -1.0 / distance * forceMag);
-							totalForce = Vector2Add(totalForce, force);
+							// Go through each color group's run of particles in this cell (as objects)
+							Cell *neighbor = neighborCells[n];
+							for (int objectRun = 0; objectRun < neighbor->runCount; objectRun++)
+							{
+								uint8_t start = neighbor->runStart[objectRun];
+								uint8_t end = neighbor->runStart[objectRun + 1];
+								totalForce = Vector2Add(totalForce, GroupRunForce(subjectPos, &neighbor->particlePositions[start], end - start, interactionRow[neighbor->runGroups[objectRun]], &counters));
+							}
 						}
+						totalForce = Vector2Scale(totalForce, forceFactor);
+
+						IntegrateParticle(&particles[i], totalForce, steps[level]);
+						frameStats.particleSteps++;
+						float forceLength = Vector2Length(totalForce);
+						particles[i].peakForce = (substep == 0) ? forceLength : fmax(particles[i].peakForce, forceLength);
+						// Its last step of the frame
+						if (sleepingEnabled && substep + (1 << (topLevel - level)) == substeps)
+							UpdateCalm(&particles[i], totalForce);
 					}
 				}
+			}
+		}
+	}
 
-				totalForce = Vector2Scale(totalForce, maxDistance * forceFactor);
+	// If a particle went off the screen, wrap it around to the other side
+	for (int i = 0; i < activeParticleCount; i++)
+	{
+		particles[i].position.x = WrapCoordinate(particles[i].position.x, worldWidth);
+		particles[i].position.y = WrapCoordinate(particles[i].position.y, worldHeight);
+	}
 
-				particles[i].velocity = Vector2Scale(particles[i].velocity, frictionFactor);
-				particles[i].velocity = Vector2Add(particles[i].velocity, Vector2Scale(totalForce, deltaTime));
+	frameStats.candidatePairs += counters.candidatePairs;
+	frameStats.pairsInRange += counters.pairsInRange;
+}
 
-				// Update the particle's position based on its velocity
-				particles[i].position.x += particles[i].velocity.x * deltaTime;
-				particles[i].position.y += particles[i].velocity.y * deltaTime;
+// Share of the pairs looked at that were too far away to matter
+float RejectedPairRatio(const SimStats &stats)
+{
+	if (stats.candidatePairs == 0)
+		return 0.0;
+	return 1.0 - (float)stats.pairsInRange / stats.candidatePairs;
+}
 
-				// If the particle goes off the screen, wrap it around to the other side
-				if (particles[i].position.x < 0.01)
-					particles[i].position.x = 1.99;
-				if (particles[i].position.x > 2)
-					particles[i].position.x = 0.01;
-				if (particles[i].position.y < 0.01)
-					particles[i].position.y = 0.99;
-				if (particles[i].position.y > 1)
-					particles[i].position.y = 0.01;
-			}
-		}
+static void DrawStatsOverlay()
+{
+	const int fontSize = 20;
+	int y = 10;
+	DrawText(TextFormat("%d FPS, %d particles, %s", GetFPS(), activeParticleCount, integratorNames[integrator]), 10, y, fontSize, WHITE);
+	y += fontSize;
+	DrawText(TextFormat("pairs %ld, in range %ld (%.0f%% rejected)", frameStats.candidatePairs, frameStats.pairsInRange, RejectedPairRatio(frameStats) * 100), 10, y, fontSize, WHITE);
+	y += fontSize;
+	DrawText(TextFormat("cells %dx%d, mean %.1f, max %d", cellGridWidth, cellGridHeight, frameStats.meanCellOccupancy, frameStats.maxCellOccupancy), 10, y, fontSize, WHITE);
+	y += fontSize;
+	DrawText(TextFormat("dropped %d, wrap shifts %d", frameStats.droppedParticles, frameStats.wrapShifts), 10, y, fontSize, WHITE);
+	y += fontSize;
+	const int *h = frameStats.occupancyHistogram;
+	DrawText(TextFormat("occupancy 0:%d 1:%d 2+:%d 4+:%d 8+:%d 16+:%d 32+:%d 64+:%d", h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]), 10, y, fontSize, WHITE);
+	if (sleepingEnabled)
+	{
+		y += fontSize;
+		DrawText(TextFormat("asleep %d (%.0f%%)", frameStats.sleepingParticles, frameStats.sleepingParticles * 100.0 / max(activeParticleCount, 1)), 10, y, fontSize, WHITE);
 	}
+	if (multiRateEnabled)
+	{
+		y += fontSize;
+		DrawText(TextFormat("cells at 1/2/4 substeps %d/%d/%d", frameStats.substepCells[0], frameStats.substepCells[1], frameStats.substepCells[2]), 10, y, fontSize, WHITE);
+	}
+}
+
+// What a PanelTarget would make of a frame with these stats
+struct PanelEstimate
+{
+	float refreshHz;
+	float refreshShare;	// Of all the device's cores
+	float budgetMs;		// Of the frame, for the sim
+	float simMs;		// What the sim would take with this many particles
+	int maxParticles;	// About as many as fit in the budget
+};
+
+PanelEstimate EstimatePanel(const PanelTarget &target, const SimStats &stats, int particleCount)
+{
+	PanelEstimate estimate;
+
+	// Each row load shifts in the whole chain. Planes shown for less time than that wait for it.
+	int columns = CANVAS_WIDTH * ((CANVAS_HEIGHT + PANEL_ROWS - 1) / PANEL_ROWS);
+	float loadNs = columns * target.clockNs + target.rowOverheadNs;
+	float rowNs = 0;
+	for (int plane = 0; plane < target.bitPlanes; plane++)
+	{
+		rowNs += max(loadNs, target.lsbNs * (1 << plane));
+	}
+	float refreshNs = rowNs * PANEL_SCAN_ROWS;
+	estimate.refreshHz = 1e9 / refreshNs;
+	// An interrupt-driven refresh is busy for the row loads and idle while a plane is shown
+	float stolenShare = (target.refreshCores > 0) ? 0.0f : PANEL_SCAN_ROWS * target.bitPlanes * loadNs / refreshNs;
+	estimate.refreshShare = (target.refreshCores > 0) ? (float)target.refreshCores / target.cores : stolenShare;
+
+	// The sim's cost as a * n^2 + b * n + c, assuming its threads split the work evenly
+	float n = max(particleCount, 1);
+	float pairShare = (target.pairShare > 0) ? target.pairShare : stats.candidatePairs / (n * n);
+	float a = pairShare * target.pairNs + stats.pairsInRange / (n * n) * target.inRangeNs;
+	float b = target.particleNs;
+	float c = target.frameNs;
+	float nsPerMs = 1e6 * target.simThreads * (1.0f - stolenShare);
+	estimate.budgetMs = 1000.0f / target.targetFps * target.budgetShare;
+	estimate.simMs = (a * particleCount * particleCount + b * particleCount + c) / nsPerMs;
+
+	float capacity = estimate.budgetMs * nsPerMs - c;
+	if (capacity <= 0)
+		estimate.maxParticles = 0;
+	else if (a <= 0)
+		estimate.maxParticles = capacity / b;
+	else
+		estimate.maxParticles = (-b + sqrtf(b * b + 4 * a * capacity)) / (2 * a);
+	return estimate;
+}
+
+static void DrawPanelModel()
+{
+	const int fontSize = 20;
+	int y = SCREEN_HEIGHT - 2 * fontSize - 10;
+	const PanelTarget &target = panelTargets[panelTarget];
+	PanelEstimate estimate = EstimatePanel(target, frameStats, activeParticleCount);
+	if (target.refreshCores > 0)
+		DrawText(TextFormat("%s: panel %.0f Hz, refresh takes %d of %d cores", target.name, estimate.refreshHz, target.refreshCores, target.cores), 10, y, fontSize, WHITE);
+	else
+		DrawText(TextFormat("%s: panel %.0f Hz, refresh takes %.0f%% of the CPU", target.name, estimate.refreshHz, estimate.refreshShare * 100), 10, y, fontSize, WHITE);
+	y += fontSize;
+	bool fits = estimate.simMs <= estimate.budgetMs;
+	DrawText(TextFormat("sim %.1f of %.1f ms at %d FPS, fits about %d particles", estimate.simMs, estimate.budgetMs, target.targetFps, estimate.maxParticles), 10, y, fontSize, fits ? GREEN : RED);
+}
+
+static void UpdateDrawFrame()
+{
+	static int t = 0;
+	t++;
+
+	// Update time
+	static unsigned long prevMillis = 0;
+	unsigned long currentMillis = millis();
+	float deltaTime = (currentMillis - prevMillis) / 1000.0f;
+	prevMillis = currentMillis;
+
+	auto frameStart = chrono::steady_clock::now();
+
+	FrameBufferClear({0, 0, 0});
+
+	StepSimulation(deltaTime);
 
 	// Draw each particle
-	for (int i = 0; i < MAX_PARTICLES; i++)
+	for (int i = 0; i < activeParticleCount; i++)
 	{
 		// Scale from world space to screen space
 		Vector2 posOnScreen = {particles[i].position.x * CANVAS_WIDTH / (CANVAS_ASPECT_RATIO), particles[i].position.y * CANVAS_HEIGHT};
-		DrawPoint(posOnScreen, ColorGroupColors[particles[i].colorGroup]);
+		DrawPoint(posOnScreen, PanelColorMultiply(groupColors[particles[i].colorGroup], particles[i].fade / 255.0f));
 	}
 
+	UpdateFades();
+	UpdateGovernor(chrono::duration<float>(chrono::steady_clock::now() - frameStart).count());
+
 	// if (t % 20 == 0)
 	// {
-	// 	for (int i = 0; i < CELL_GRID_HEIGHT; i++)
+	// 	for (int i = 1; i <= cellGridHeight; i++)
 	// 	{
-	// 		for (int j = 0; j < CELL_GRID_WIDTH; j++)
+	// 		for (int j = 1; j <= cellGridWidth; j++)
 	// 		{
 	// 			printf("%03d ", grid[i][j].particleCount);
 	// 		}
@@ -602,3 +1326,744 @@ static void UpdateDrawFrame()
 	// 	printf("\n");
 	// }
 }
+
+//----------------------------------------------------------------------------------
+// Particle pool
+// Live particles are packed into [0, activeParticleCount), so every loop over them is
+// dense, and the retiring ones sit at the end of that range. Spawning and despawning
+// are O(1) and never allocate. Only do either between steps: the grid holds particle
+// indices and gets rebuilt from the pool at the start of the next step.
+//----------------------------------------------------------------------------------
+
+#define FADE_STEP 17 // Fade change per frame, 15 frames from black to full
+
+// Takes a particle out of the pool, dark so it fades in, with no velocity.
+// The caller places it. Returns NULL when the pool is used up.
+Particle *SpawnParticle()
+{
+	if (activeParticleCount == MAX_PARTICLES)
+		return NULL;
+	int slot = activeParticleCount++;
+	// Keep the retiring particles at the end by moving the first of them behind the new one
+	if (retireFrom < slot)
+	{
+		particles[slot] = particles[retireFrom];
+		slot = retireFrom;
+	}
+	retireFrom++;
+
+	Particle *p = &particles[slot];
+	p->velocity = {0.0, 0.0};
+	p->fade = 0;
+	p->calmFrames = 0;
+	p->halfKick = {0.0, 0.0};
+	p->peakForce = 0.0;
+	return p;
+}
+
+// Somewhere random, in a random group
+void SpawnRandomParticle()
+{
+	Particle *p = SpawnParticle();
+	if (p == NULL)
+		return;
+	p->position = {RandFloat(0, worldWidth), RandFloat(0, worldHeight)};
+	p->colorGroup = (ColorGroup)RandByte(GROUP_RED, colorGroupCount - 1);
+}
+
+// Puts particle i straight back in the pool by moving another one into its slot.
+// Loops that despawn as they go should look at slot i again afterwards.
+void DespawnParticle(int i)
+{
+	if (i < retireFrom)
+	{
+		// Fill the hole from the last particle that isn't retiring, which leaves the hole at the start of the retiring ones
+		particles[i] = particles[--retireFrom];
+		i = retireFrom;
+	}
+	particles[i] = particles[--activeParticleCount];
+}
+
+// Starts the last count particles fading out. UpdateFades() despawns them once they are dark.
+void RetireParticles(int count)
+{
+	retireFrom = max(retireFrom - count, 0);
+}
+
+// Brings new particles up to full brightness and retiring ones down to nothing
+static void UpdateFades()
+{
+	for (int i = 0; i < retireFrom; i++)
+	{
+		particles[i].fade = particles[i].fade > 255 - FADE_STEP ? 255 : particles[i].fade + FADE_STEP;
+	}
+
+	if (retireFrom == activeParticleCount)
+		return;
+	bool allDark = true;
+	for (int i = retireFrom; i < activeParticleCount; i++)
+	{
+		particles[i].fade = particles[i].fade < FADE_STEP ? 0 : particles[i].fade - FADE_STEP;
+		allDark = allDark && particles[i].fade == 0;
+	}
+	// They went out together, and they're already at the end, so they can go back in the pool together
+	if (allDark)
+		activeParticleCount = retireFrom;
+}
+
+// The left mouse button sprays particles of random groups at the cursor, the right one removes them
+static void SpawnFromMouse()
+{
+	Vector2 mouse = GetMousePosition();
+	Vector2 cursor = {mouse.x / SCREEN_WIDTH * worldWidth, mouse.y / SCREEN_HEIGHT * worldHeight};
+	const float brushRadius = 0.05;
+
+	if (IsMouseButtonDown(MOUSE_BUTTON_LEFT))
+	{
+		for (int n = 0; n < 4; n++)
+		{
+			Particle *p = SpawnParticle();
+			if (p == NULL)
+				break;
+			p->position = {WrapCoordinate(cursor.x + RandFloat(-brushRadius, brushRadius), worldWidth),
+						   WrapCoordinate(cursor.y + RandFloat(-brushRadius, brushRadius), worldHeight)};
+			p->colorGroup = (ColorGroup)RandByte(GROUP_RED, colorGroupCount - 1);
+		}
+	}
+	if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT))
+	{
+		int i = 0;
+		while (i < activeParticleCount)
+		{
+			if (Vector2Length(Vector2Subtract(particles[i].position, cursor)) < brushRadius)
+				DespawnParticle(i); // Something else is in slot i now
+			else
+				i++;
+		}
+	}
+}
+
+//----------------------------------------------------------------------------------
+// Particle count governor
+// Adds particles while the frame has time to spare and retires them when it runs
+// over, so the count settles at whatever the machine can hold at TARGET_FPS.
+//----------------------------------------------------------------------------------
+
+#define GOVERNOR_BUDGET_SHARE 0.5 // Share of the frame that stepping and drawing may use, the rest is for presenting
+#define GOVERNOR_HEADROOM 0.75	  // Only grow while under this share of the budget, so the count doesn't flap
+#define GOVERNOR_INTERVAL 15	  // Frames to wait after a change before judging it
+
+struct Governor
+{
+	float averageCost;	   // Smoothed seconds spent stepping and drawing
+	int framesUntilChange;
+};
+Governor governor = {0.0, GOVERNOR_INTERVAL};
+
+static void UpdateGovernor(float frameCost)
+{
+	governor.averageCost += (frameCost - governor.averageCost) * 0.1f;
+	if (governor.framesUntilChange > 0)
+	{
+		governor.framesUntilChange--;
+		return;
+	}
+	// Let the last retirement finish before deciding anything else
+	if (retireFrom != activeParticleCount)
+		return;
+
+	// Change by a few percent at a time, so big pools don't take forever to fill
+	int step = activeParticleCount / 32 + 1;
+	const float budget = GOVERNOR_BUDGET_SHARE / TARGET_FPS;
+	if (governor.averageCost > budget && activeParticleCount > MIN_PARTICLES)
+	{
+		RetireParticles(min(step, activeParticleCount - MIN_PARTICLES));
+		governor.framesUntilChange = GOVERNOR_INTERVAL;
+	}
+	else if (governor.averageCost < budget * GOVERNOR_HEADROOM && activeParticleCount < MAX_PARTICLES)
+	{
+		for (int i = 0; i < step; i++)
+		{
+			SpawnRandomParticle();
+		}
+		governor.framesUntilChange = GOVERNOR_INTERVAL;
+	}
+}
+
+// Steps the simulation without a window and prints what each candidate pair costs
+// as the number of color groups goes up. Run with --bench.
+// The whole pool is used, build with a different MAX_PARTICLES to change it.
+static void RunBenchmark()
+{
+	const int groupCounts[] = {2, 4, 8, 16, 32};
+	const int warmupSteps = 20;
+	const int steps = 200;
+	const float stepTime = 1.0 / 60;
+
+	printf("%d particles, %d steps per run\n", MAX_PARTICLES, steps);
+	printf("groups   grid   pairs/step   in range   ms/step   ns/pair\n");
+	for (int groupCount : groupCounts)
+	{
+		srand(1);
+		colorGroupCount = groupCount;
+		Initialize();
+		randomizeAttractionFactorMatrix();
+		randomizeInteractionRadii();
+		// Pin one pair to the full radius so every run gets the same grid
+		SetInteraction(0, 0, interactionTable[0][0].attractionFactor, maxDistance, tooCloseDistance);
+		UpdateCellSize();
+		activeParticleCount = MAX_PARTICLES;
+		retireFrom = MAX_PARTICLES;
+
+		for (int i = 0; i < warmupSteps; i++)
+		{
+			StepSimulation(stepTime);
+		}
+
+		double seconds = 0.0;
+		double pairs = 0.0;
+		double pairsInRange = 0.0;
+		for (int i = 0; i < steps; i++)
+		{
+			auto start = chrono::steady_clock::now();
+			StepSimulation(stepTime);
+			seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			pairs += frameStats.candidatePairs;
+			pairsInRange += frameStats.pairsInRange;
+		}
+
+		printf("%6d   %dx%d   %10.0f   %7.1f%%   %7.3f   %7.2f\n", groupCount, cellGridWidth, cellGridHeight,
+			   pairs / steps, pairsInRange * 100.0 / pairs, seconds * 1000.0 / steps, seconds * 1e9 / pairs);
+	}
+}
+
+// Runs the same world with sleeping off and then on, and prints how far the sleeping
+// run has drifted from the reference and how much of it was asleep. Done for the default
+// matrix, which keeps chasing itself around, and for one where everything clumps up and
+// settles. Any error in the first one also grows chaotically, so judge by the second.
+// Run with --sleep-check.
+static void RunSleepCheck()
+{
+	const int particleCount = min(300, MAX_PARTICLES);
+	const int steps = 1200;
+	const int checkpointEvery = 120;
+	const int checkpoints = steps / checkpointEvery;
+	const float stepTime = 1.0 / 60;
+	vector<Vector2> reference((size_t)checkpoints * particleCount);
+
+	for (int scenario = 0; scenario < 2; scenario++)
+	{
+		printf("%s, %d particles, steps of %.4f s\n", scenario == 0 ? "default matrix" : "everything attracts at 0.6", particleCount, stepTime);
+		printf("  time   asleep   mean error   max error   (world units)\n");
+		double referenceSeconds = 0.0;
+		double sleepingSeconds = 0.0;
+		for (int run = 0; run < 2; run++)
+		{
+			srand(1);
+			Initialize();
+			if (scenario == 1)
+			{
+				for (int i = 0; i < colorGroupCount; i++)
+				{
+					for (int j = 0; j < colorGroupCount; j++)
+					{
+						interactionTable[i][j].attractionFactor = 0.6;
+					}
+				}
+			}
+			activeParticleCount = particleCount;
+			retireFrom = particleCount;
+			sleepingEnabled = (run == 1);
+
+			for (int step = 1; step <= steps; step++)
+			{
+				auto start = chrono::steady_clock::now();
+				StepSimulation(stepTime);
+				double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+				if (run == 0)
+					referenceSeconds += seconds;
+				else
+					sleepingSeconds += seconds;
+				if (step % checkpointEvery != 0)
+					continue;
+
+				Vector2 *saved = &reference[(size_t)(step / checkpointEvery - 1) * particleCount];
+				if (run == 0)
+				{
+					for (int i = 0; i < particleCount; i++)
+						saved[i] = particles[i].position;
+					continue;
+				}
+
+				double totalError = 0.0;
+				float maxError = 0.0;
+				for (int i = 0; i < particleCount; i++)
+				{
+					// Measured the short way around the wrapped world
+					float dx = fabsf(particles[i].position.x - saved[i].x);
+					float dy = fabsf(particles[i].position.y - saved[i].y);
+					dx = fmin(dx, worldWidth - dx);
+					dy = fmin(dy, worldHeight - dy);
+					float error = sqrtf(dx * dx + dy * dy);
+					totalError += error;
+					maxError = fmax(maxError, error);
+				}
+				printf("%5.1fs   %5.1f%%   %10.5f   %9.5f\n", step * stepTime, frameStats.sleepingParticles * 100.0 / particleCount,
+					   totalError / particleCount, maxError);
+			}
+		}
+		printf("%.3f ms/step without sleeping, %.3f ms/step with. A pixel is %.5f.\n\n",
+			   referenceSeconds * 1000.0 / steps, sleepingSeconds * 1000.0 / steps, worldHeight / CANVAS_HEIGHT);
+	}
+	sleepingEnabled = false;
+}
+
+// Steps a world that clumps up with each integrator at a range of step sizes, and prints how
+// far it ends up from the same world stepped very finely. Shows how big a step each one can
+// take before it starts to go wrong. Run with --integrator-check.
+static void RunIntegratorCheck()
+{
+	const int particleCount = min(300, MAX_PARTICLES);
+	const float simulatedTime = 1.0;
+	const float referenceStep = 1.0 / 960;
+	const int stepRates[] = {240, 120, 60, 30, 15, 8};
+	vector<Vector2> reference(particleCount);
+
+	printf("%d particles, %.1f s, compared to %s at 1/%.0f s\n", particleCount, simulatedTime, integratorNames[INTEGRATOR_EXPONENTIAL], 1.0 / referenceStep);
+	printf("%-18s", "steps per second");
+	for (int rate : stepRates)
+		printf("%9d", rate);
+	printf("   (mean error, world units)\n");
+
+	const Integrator previous = integrator;
+	for (int run = -1; run < INTEGRATOR_COUNT; run++)
+	{
+		integrator = (run < 0) ? INTEGRATOR_EXPONENTIAL : (Integrator)run;
+		if (run >= 0)
+			printf("%-18s", integratorNames[integrator]);
+		for (int rate : stepRates)
+		{
+			float stepTime = (run < 0) ? referenceStep : 1.0f / rate;
+			srand(1);
+			Initialize();
+			for (int i = 0; i < colorGroupCount; i++)
+			{
+				for (int j = 0; j < colorGroupCount; j++)
+				{
+					interactionTable[i][j].attractionFactor = 0.6;
+				}
+			}
+			activeParticleCount = particleCount;
+			retireFrom = particleCount;
+			for (int s = 0; s < (int)(simulatedTime / stepTime + 0.5f); s++)
+			{
+				StepSimulation(stepTime);
+			}
+
+			if (run < 0)
+			{
+				for (int i = 0; i < particleCount; i++)
+					reference[i] = particles[i].position;
+				break;
+			}
+			double totalError = 0.0;
+			for (int i = 0; i < particleCount; i++)
+			{
+				float dx = fabsf(particles[i].position.x - reference[i].x);
+				float dy = fabsf(particles[i].position.y - reference[i].y);
+				dx = fmin(dx, worldWidth - dx);
+				dy = fmin(dy, worldHeight - dy);
+				totalError += sqrtf(dx * dx + dy * dy);
+			}
+			printf("%9.5f", totalError / particleCount);
+		}
+		if (run >= 0)
+			printf("\n");
+	}
+	integrator = previous;
+}
+
+// Steps a world that clumps up hard at a range of frame rates, once at one step per frame and
+// once with multi-rate substeps, and prints how far each ends up from the same world stepped
+// very finely, next to how many pairs each had to look at. For multi-rate it also prints what
+// that costs next to one step, in pairs and in particles integrated. Run with --substep-check.
+static void RunSubstepCheck()
+{
+	const int particleCount = min(600, MAX_PARTICLES);
+	const float simulatedTime = 1.0;
+	const float referenceStep = 1.0 / 960;
+	const int stepRates[] = {60, 30, 15, 8};
+	vector<Vector2> reference(particleCount);
+
+	printf("%d particles, %.1f s, %s, compared to 1/%.0f s steps\n", particleCount, simulatedTime, integratorNames[integrator], 1.0 / referenceStep);
+	printf("frames/s   one step: error     pairs   multi-rate: error     pairs   pairs x  steps x   cells at 1/2/4 substeps\n");
+	for (int rate = -1; rate < (int)(sizeof(stepRates) / sizeof(stepRates[0])); rate++)
+	{
+		if (rate >= 0)
+			printf("%8d", stepRates[rate]);
+		long oneStepPairs = 0;
+		long oneStepParticleSteps = 0;
+		for (int run = 0; run < 2; run++)
+		{
+			float stepTime = (rate < 0) ? referenceStep : 1.0f / stepRates[rate];
+			srand(1);
+			Initialize();
+			for (int i = 0; i < colorGroupCount; i++)
+			{
+				for (int j = 0; j < colorGroupCount; j++)
+				{
+					interactionTable[i][j].attractionFactor = (i == 0 && j == 0) ? 1.0 : 0.0;
+				}
+			}
+			activeParticleCount = particleCount;
+			retireFrom = particleCount;
+			multiRateEnabled = (run == 1);
+			long pairs = 0;
+			long particleSteps = 0;
+			int levelCells[SUBSTEP_LEVELS] = {0};
+			for (int s = 0; s < (int)(simulatedTime / stepTime + 0.5f); s++)
+			{
+				StepSimulation(stepTime);
+				pairs += frameStats.candidatePairs;
+				particleSteps += frameStats.particleSteps;
+				for (int level = 0; level < SUBSTEP_LEVELS; level++)
+					levelCells[level] += frameStats.substepCells[level];
+			}
+
+			if (rate < 0)
+			{
+				for (int i = 0; i < particleCount; i++)
+					reference[i] = particles[i].position;
+				break;
+			}
+			double totalError = 0.0;
+			for (int i = 0; i < particleCount; i++)
+			{
+				float dx = fabsf(particles[i].position.x - reference[i].x);
+				float dy = fabsf(particles[i].position.y - reference[i].y);
+				dx = fmin(dx, worldWidth - dx);
+				dy = fmin(dy, worldHeight - dy);
+				totalError += sqrtf(dx * dx + dy * dy);
+			}
+			printf("%18.5f %9ld", totalError / particleCount, pairs);
+			if (run == 0)
+			{
+				oneStepPairs = pairs;
+				oneStepParticleSteps = particleSteps;
+			}
+			else
+			{
+				printf("   %6.2f  %7.2f", (double)pairs / max(oneStepPairs, 1L), (double)particleSteps / max(oneStepParticleSteps, 1L));
+				int cellCount = max(levelCells[0] + levelCells[1] + levelCells[2], 1);
+				printf("   %3.0f%% %3.0f%% %3.0f%%", levelCells[0] * 100.0 / cellCount, levelCells[1] * 100.0 / cellCount, levelCells[2] * 100.0 / cellCount);
+			}
+		}
+		if (rate >= 0)
+			printf("\n");
+	}
+	multiRateEnabled = false;
+}
+
+// Prints what each PanelTarget would make of the default world at a few particle counts,
+// averaged over a second of stepping after it has had a second to settle. Run with --panel-model.
+static void RunPanelModel()
+{
+	const int particleCounts[] = {24, 100, 400, 1600};
+	const float stepTime = 1.0 / 60;
+
+	for (int t = 0; t < PANEL_TARGET_COUNT; t++)
+	{
+		PanelEstimate estimate = EstimatePanel(panelTargets[t], frameStats, 1);
+		printf("%s: panel %.0f Hz, refresh takes %.0f%% of the device, sim budget %.1f ms at %d FPS\n", panelTargets[t].name,
+			   estimate.refreshHz, estimate.refreshShare * 100, estimate.budgetMs, panelTargets[t].targetFps);
+	}
+	printf("particles   pairs/step   in range");
+	for (int t = 0; t < PANEL_TARGET_COUNT; t++)
+		printf("   %6s ms    fits", panelTargets[t].name);
+	printf("\n");
+	for (int particleCount : particleCounts)
+	{
+		if (particleCount > MAX_PARTICLES)
+			break;
+		srand(1);
+		Initialize();
+		activeParticleCount = particleCount;
+		retireFrom = particleCount;
+		for (int s = 0; s < 60; s++)
+		{
+			StepSimulation(stepTime);
+		}
+		SimStats average = {};
+		for (int s = 0; s < 60; s++)
+		{
+			StepSimulation(stepTime);
+			average.candidatePairs += frameStats.candidatePairs;
+			average.pairsInRange += frameStats.pairsInRange;
+		}
+		average.candidatePairs /= 60;
+		average.pairsInRange /= 60;
+
+		printf("%9d   %10ld   %8ld", particleCount, average.candidatePairs, average.pairsInRange);
+		for (int t = 0; t < PANEL_TARGET_COUNT; t++)
+		{
+			PanelEstimate estimate = EstimatePanel(panelTargets[t], average, particleCount);
+			printf("   %9.1f   %5d", estimate.simMs, estimate.maxParticles);
+		}
+		printf("\n");
+	}
+}
+
+//----------------------------------------------------------------------------------
+// Ensemble search (--ensemble)
+// Steps lots of small worlds, each with its own attraction matrix and seed,
+// and writes the matrices that formed the most structure out as presets.
+//----------------------------------------------------------------------------------
+
+#define ENSEMBLE_PARTICLES 64
+#define ENSEMBLE_LANES 8 // Worlds stepped side by side in one batch
+#define ENSEMBLE_MAX_GROUPS 8
+#define ENSEMBLE_SETTLE_STEPS 600
+#define ENSEMBLE_SCORE_STEPS 120 // Scored every few steps at the end of the run
+#define ENSEMBLE_PRESET_COUNT 8
+#define SCORE_BINS_X 8
+#define SCORE_BINS_Y 4
+
+// ENSEMBLE_LANES worlds that are stepped together. Every world has the same particle count
+// and particle p is always in group p % groupCount, so the innermost loops run across the
+// worlds with no branches and the compiler can put one world in each SIMD lane.
+struct EnsembleBatch
+{
+	float x[ENSEMBLE_PARTICLES][ENSEMBLE_LANES];
+	float y[ENSEMBLE_PARTICLES][ENSEMBLE_LANES];
+	float vx[ENSEMBLE_PARTICLES][ENSEMBLE_LANES];
+	float vy[ENSEMBLE_PARTICLES][ENSEMBLE_LANES];
+	float halfKickX[ENSEMBLE_PARTICLES][ENSEMBLE_LANES]; // Velocity Verlet only, as in Particle
+	float halfKickY[ENSEMBLE_PARTICLES][ENSEMBLE_LANES];
+	float attraction[ENSEMBLE_MAX_GROUPS][ENSEMBLE_MAX_GROUPS][ENSEMBLE_LANES];
+	uint32_t seeds[ENSEMBLE_LANES];
+	float scores[ENSEMBLE_LANES];
+};
+
+// rand() is shared between threads, so every world gets its own xorshift generator
+float SeededRandFloat(uint32_t *state, float a, float b)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return a + (*state / 4294967296.0f) * (b - a);
+}
+
+static void InitEnsembleBatch(EnsembleBatch *batch, uint32_t firstSeed, int groupCount)
+{
+	for (int l = 0; l < ENSEMBLE_LANES; l++)
+	{
+		batch->seeds[l] = firstSeed + l;
+		batch->scores[l] = 0.0;
+		uint32_t state = batch->seeds[l] * 2654435761u + 1; // xorshift can't start from 0
+		for (int i = 0; i < groupCount; i++)
+		{
+			for (int j = 0; j < groupCount; j++)
+			{
+				batch->attraction[i][j][l] = SeededRandFloat(&state, -1.0, 1.0);
+			}
+		}
+		for (int p = 0; p < ENSEMBLE_PARTICLES; p++)
+		{
+			batch->x[p][l] = SeededRandFloat(&state, 0, worldWidth);
+			batch->y[p][l] = SeededRandFloat(&state, 0, worldHeight);
+			batch->vx[p][l] = 0.0;
+			batch->vy[p][l] = 0.0;
+			batch->halfKickX[p][l] = 0.0;
+			batch->halfKickY[p][l] = 0.0;
+		}
+	}
+}
+
+// Same force and integration as StepSimulation, with whichever integrator is picked, but all
+// pairs and all worlds at once. The worlds are small enough that a grid would not pay for itself.
+static void StepEnsembleBatch(EnsembleBatch *batch, int groupCount, float deltaTime)
+{
+	const float inverseMaxDistance = 1.0 / maxDistance;
+	float forceX[ENSEMBLE_PARTICLES][ENSEMBLE_LANES] = {};
+	float forceY[ENSEMBLE_PARTICLES][ENSEMBLE_LANES] = {};
+
+	for (int i = 0; i < ENSEMBLE_PARTICLES; i++)
+	{
+		for (int j = 0; j < ENSEMBLE_PARTICLES; j++)
+		{
+			const float *attraction = batch->attraction[i % groupCount][j % groupCount];
+			for (int l = 0; l < ENSEMBLE_LANES; l++)
+			{
+				// Take the nearest copy of j across the wrapped edges
+				float dx = batch->x[i][l] - batch->x[j][l];
+				float dy = batch->y[i][l] - batch->y[j][l];
+				dx = (dx > worldWidth * 0.5f) ? dx - worldWidth : (dx < -worldWidth * 0.5f) ? dx + worldWidth : dx;
+				dy = (dy > worldHeight * 0.5f) ? dy - worldHeight : (dy < -worldHeight * 0.5f) ? dy + worldHeight : dy;
+
+				float distance = sqrtf(dx * dx + dy * dy);
+				float d = distance * inverseMaxDistance;
+				float push = d / tooCloseDistance - 1;
+				float pull = attraction[l] * (1.0f - fabsf(2.0f * d - 1 - tooCloseDistance) / (1 - tooCloseDistance));
+				float forceMag = (d < tooCloseDistance) ? push : pull;
+				// Zero for the particle itself and anything out of range
+				float scale = (distance > 0.0f && d < 1.0f) ? -forceMag * maxDistance / distance : 0.0f;
+				forceX[i][l] += dx * scale;
+				forceY[i][l] += dy * scale;
+			}
+		}
+	}
+
+	// Each world's particle goes through IntegrateParticle(), so friction and the integrator
+	// are the ones the panels run with. The pair loop above is what costs.
+	const IntegratorStep step = PrepareIntegratorStep(deltaTime);
+	for (int i = 0; i < ENSEMBLE_PARTICLES; i++)
+	{
+		for (int l = 0; l < ENSEMBLE_LANES; l++)
+		{
+			Particle p = {};
+			p.position = {batch->x[i][l], batch->y[i][l]};
+			p.velocity = {batch->vx[i][l], batch->vy[i][l]};
+			p.halfKick = {batch->halfKickX[i][l], batch->halfKickY[i][l]};
+			IntegrateParticle(&p, {forceX[i][l] * forceFactor, forceY[i][l] * forceFactor}, step);
+			batch->x[i][l] = WrapCoordinate(p.position.x, worldWidth);
+			batch->y[i][l] = WrapCoordinate(p.position.y, worldHeight);
+			batch->vx[i][l] = p.velocity.x;
+			batch->vy[i][l] = p.velocity.y;
+			batch->halfKickX[i][l] = p.halfKick.x;
+			batch->halfKickY[i][l] = p.halfKick.y;
+		}
+	}
+}
+
+// Cheap measure of how much structure each world has, added to its score.
+// Clumping is how much more the occupancy of a coarse grid varies than it would for
+// particles scattered at random. It is weighted by how much the world still moves,
+// so frozen crystals lose out to clusters that chase each other around.
+static void ScoreEnsembleBatch(EnsembleBatch *batch)
+{
+	const float binCount = SCORE_BINS_X * SCORE_BINS_Y;
+	const float meanOccupancy = ENSEMBLE_PARTICLES / binCount;
+	for (int l = 0; l < ENSEMBLE_LANES; l++)
+	{
+		int bins[SCORE_BINS_Y][SCORE_BINS_X] = {};
+		float speed = 0.0;
+		for (int p = 0; p < ENSEMBLE_PARTICLES; p++)
+		{
+			int bx = (int)(batch->x[p][l] / worldWidth * SCORE_BINS_X);
+			int by = (int)(batch->y[p][l] / worldHeight * SCORE_BINS_Y);
+			bins[min(by, SCORE_BINS_Y - 1)][min(bx, SCORE_BINS_X - 1)]++;
+			speed += sqrtf(batch->vx[p][l] * batch->vx[p][l] + batch->vy[p][l] * batch->vy[p][l]);
+		}
+		speed /= ENSEMBLE_PARTICLES;
+
+		float variance = 0.0;
+		for (int by = 0; by < SCORE_BINS_Y; by++)
+		{
+			for (int bx = 0; bx < SCORE_BINS_X; bx++)
+			{
+				variance += (bins[by][bx] - meanOccupancy) * (bins[by][bx] - meanOccupancy);
+			}
+		}
+		variance /= binCount;
+		// For uniformly scattered particles the variance is about equal to the mean
+		float clumping = fmax(variance / meanOccupancy - 1.0, 0.0);
+		float activity = speed / (speed + 0.05f);
+		batch->scores[l] += clumping * activity;
+	}
+}
+
+struct EnsembleResult
+{
+	float score;
+	uint32_t seed;
+	float attraction[ENSEMBLE_MAX_GROUPS][ENSEMBLE_MAX_GROUPS];
+};
+
+static void RunEnsemble(int worldCount, int groupCount)
+{
+	if (groupCount < 1 || groupCount > ENSEMBLE_MAX_GROUPS || worldCount < 1)
+	{
+		printf("Usage: --ensemble [world count] [color groups, 1 to %d]\n", ENSEMBLE_MAX_GROUPS);
+		return;
+	}
+
+	const float stepTime = 1.0 / 60;
+	const int batchCount = (worldCount + ENSEMBLE_LANES - 1) / ENSEMBLE_LANES;
+	const int threadCount = max(1, (int)thread::hardware_concurrency());
+	vector<EnsembleBatch> batches(batchCount);
+	atomic<int> nextBatch(0);
+
+	auto start = chrono::steady_clock::now();
+	auto worker = [&]() {
+		int b;
+		while ((b = nextBatch++) < batchCount)
+		{
+			EnsembleBatch *batch = &batches[b];
+			InitEnsembleBatch(batch, 1 + b * ENSEMBLE_LANES, groupCount);
+			for (int step = 0; step < ENSEMBLE_SETTLE_STEPS + ENSEMBLE_SCORE_STEPS; step++)
+			{
+				StepEnsembleBatch(batch, groupCount, stepTime);
+				if (step >= ENSEMBLE_SETTLE_STEPS && step % 10 == 0)
+					ScoreEnsembleBatch(batch);
+			}
+		}
+	};
+	vector<thread> threads;
+	for (int t = 0; t < threadCount; t++)
+	{
+		threads.push_back(thread(worker));
+	}
+	for (thread &t : threads)
+	{
+		t.join();
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	vector<EnsembleResult> results;
+	for (int w = 0; w < worldCount; w++)
+	{
+		EnsembleBatch *batch = &batches[w / ENSEMBLE_LANES];
+		int l = w % ENSEMBLE_LANES;
+		EnsembleResult result = {};
+		result.score = batch->scores[l];
+		result.seed = batch->seeds[l];
+		for (int i = 0; i < groupCount; i++)
+		{
+			for (int j = 0; j < groupCount; j++)
+			{
+				result.attraction[i][j] = batch->attraction[i][j][l];
+			}
+		}
+		results.push_back(result);
+	}
+	sort(results.begin(), results.end(), [](const EnsembleResult &a, const EnsembleResult &b) { return a.score > b.score; });
+
+	printf("%d worlds of %d particles, %d groups, %d threads: %.2f s\n", worldCount, ENSEMBLE_PARTICLES, groupCount, threadCount, seconds);
+
+	// Written as C initializers that can be pasted over the attraction matrix setup on the panels
+	const char *presetPath = "ensemble-presets.txt";
+	FILE *file = fopen(presetPath, "w");
+	if (file == NULL)
+	{
+		printf("Could not write %s\n", presetPath);
+		return;
+	}
+	int presetCount = min((int)results.size(), ENSEMBLE_PRESET_COUNT);
+	for (int r = 0; r < presetCount; r++)
+	{
+		printf("  score %6.3f  seed %u\n", results[r].score, results[r].seed);
+		fprintf(file, "// score %.3f, seed %u\n{", results[r].score, results[r].seed);
+		for (int i = 0; i < groupCount; i++)
+		{
+			fprintf(file, "%s{", i > 0 ? ", " : "");
+			for (int j = 0; j < groupCount; j++)
+			{
+				fprintf(file, "%s%.3f", j > 0 ? ", " : "", results[r].attraction[i][j]);
+			}
+			fprintf(file, "}");
+		}
+		fprintf(file, "},\n");
+	}
+	fclose(file);
+	printf("Wrote the best %d to %s\n", presetCount, presetPath);
+}